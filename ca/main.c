@@ -17,8 +17,13 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,8 +32,161 @@
 
 #include <tee_client_api.h>
 
+#include <iperfTZ_cpu.h>
+#include <iperfTZ_hist.h>
+#include <iperfTZ_payload.h>
 #include <iperfTZ_ta.h>
 
+#define THREADS_MAX 256
+#define BENCH_SIZE_MIN 64
+#define SWEEP_MAX 32
+
+/* Values a sweep takes for an option */
+struct sweep_list {
+  uint32_t v[SWEEP_MAX];
+  unsigned int n;
+};
+
+/* Block size, socket buffer size, protocol and direction of a sweep */
+struct sweep {
+  struct sweep_list l, w, u, r;
+};
+
+/* Options of the CA itself, the TA gets struct iptz_args */
+struct ca_args {
+  unsigned int threads;
+  unsigned int ncpus;
+  int cpus[THREADS_MAX]; /* thread i runs on cpus[i % ncpus] */
+  double stall; /* seconds without progress before a test is stopped */
+  uint32_t blocks; /* per invocation of a test kept open, 0 for one invocation */
+  int payload_alloc; /* payload in shared memory of the TEE client library */
+  size_t payload_size;
+  int counters;      /* hardware counters around the invocations */
+  unsigned int runs; /* tests after another in each session */
+  int sweeping;      /* runs every point of the sweep */
+  struct sweep sweep;
+  unsigned long bench_calls; /* per case of the microbenchmark, 0 to run a test */
+  size_t bench_size;         /* largest memref of the microbenchmark */
+};
+
+/* A thread with a session of its own */
+struct session {
+  pthread_t thread;
+  unsigned int index;
+  int cpu;
+  TEEC_Context *ctx;
+  pthread_barrier_t *barrier;
+  struct iptz_args *defaults;
+  uint32_t command_id;
+  uint32_t blocks;
+  unsigned int runs;
+  TEEC_Session sess;
+  TEEC_SharedMemory args_sm;
+  TEEC_SharedMemory results_sm;
+  TEEC_SharedMemory telemetry_sm; /* with live telemetry */
+  TEEC_SharedMemory payload_sm;   /* with a normal world payload */
+  int payload_alloc;
+  size_t payload_size;
+  void *payload;                  /* registered memory of the CA */
+  TEEC_Operation op;
+  struct timespec ta, to;
+  int counters;
+  struct iptz_cpu usage;          /* of the thread over ta to to */
+  TEEC_Result res;
+  uint32_t ret_orig;
+  int opened;
+  /* Block buffer of the session's TA over the runs */
+  long long setup_first_ns;
+  long long setup_later_ns;
+  /* Test kept open across invocations */
+  unsigned long long invokes;
+  long long invoke_ns;
+  long long open_ns;
+  long long close_ns;
+  /* Live telemetry reader */
+  int invoked;              /* set once the TA may write the ring */
+  uint32_t tail;            /* next record to read */
+  struct iptz_record last;
+  struct timespec progress; /* when the bytes last grew */
+  int stalled;
+};
+
+/* The live telemetry reader and the sessions it watches */
+struct live {
+  pthread_t thread;
+  struct session *threads;
+  unsigned int n;
+  struct iptz_args *args;
+  double stall;
+  int stop;
+};
+
+static void print_pacer(struct iptz_results *results,
+			struct iptz_args *args)
+{
+  double runtime = results->runtime_ns / 1e9;
+  double achieved = runtime > 0 ? results->bytes_transmitted * 8 / runtime : 0;
+
+  printf("bitrate: target %" PRIu32 " bit/s, achieved %.0f bit/s, error %+.2f %%, pacer slept %" PRIu32 " times for %" PRIu32 " ms\n",
+	 args->bitrate, achieved, (achieved - args->bitrate) * 100 / args->bitrate,
+	 results->pacer_waits, results->pacer_wait_msec);
+}
+
+static void print_latency(struct iptz_latency *l)
+{
+  printf("latency per block: min = %.3f ms, p50 = %.3f ms, p90 = %.3f ms, p99 = %.3f ms, p99.9 = %.3f ms, max = %.3f ms (%" PRIu64 " blocks)\n",
+	 l->min / 1e6, l->p50 / 1e6, l->p90 / 1e6, l->p99 / 1e6, l->p999 / 1e6, l->max / 1e6, l->count);
+}
+
+static void print_loss(struct iptz_loss *l)
+{
+  printf("datagrams: received = %" PRIu64 ", lost = %" PRIu64 "/%" PRIu64 " (%.3f %%), duplicates = %" PRIu64 ", reordered = %" PRIu64 ", jitter = %.3f ms\n",
+	 l->datagrams, l->lost, l->expected, l->expected > 0 ? l->lost * 100.0 / l->expected : 0.0,
+	 l->duplicates, l->reordered, l->jitter / 1e6);
+}
+
+static void print_intervals(struct iptz_results *results,
+			    struct iptz_args *args)
+{
+  struct iptz_interval *iv;
+  uint32_t start = 0;
+  uint32_t i;
+
+  for (i = 0; (i < results->intervals) && (i < IPERFTZ_INTERVALS_MAX); i++) {
+    iv = &results->interval[i];
+    printf("[%3" PRIu32 ".%.3" PRIu32 "-%3" PRIu32 ".%.3" PRIu32 " s] bytes = %" PRIu32 ", %.3f Mbit/s, cycles = %" PRIu32 ", worlds_time = %" PRIu32 ".%.6" PRIu32 " s",
+	   start / 1000, start % 1000, iv->end_msec / 1000, iv->end_msec % 1000,
+	   iv->bytes, iv->end_msec > start ? iv->bytes * 8.0 / (iv->end_msec - start) / 1000 : 0.0,
+	   iv->cycles, iv->worlds_usec / 1000000, iv->worlds_usec % 1000000);
+    if ((args->protocol == IPERFTZ_UDP) && args->reverse)
+      printf(", lost = %" PRIu32 ", jitter = %.3f ms", iv->lost, iv->jitter_usec / 1000.0);
+    putchar('\n');
+    start = iv->end_msec;
+  }
+  if (results->intervals > IPERFTZ_INTERVALS_MAX)
+    printf("%" PRIu32 " more intervals were not recorded\n",
+	   results->intervals - IPERFTZ_INTERVALS_MAX);
+}
+
+static void print_streams(struct iptz_results *results,
+			  struct iptz_args *args)
+{
+  struct iptz_stream *st;
+  double runtime = results->runtime_ns / 1e9;
+  uint32_t i;
+
+  for (i = 0; (i < results->streams) && (i < IPERFTZ_STREAMS_MAX); i++) {
+    st = &results->stream[i];
+    printf("[stream %2" PRIu32 "] bytes = %" PRIu32 ", %.3f Mbit/s, cycles = %" PRIu32 ", worlds_time = %.9f s",
+	   i, st->bytes, runtime > 0 ? st->bytes * 8.0 / runtime / 1e6 : 0.0,
+	   st->cycles, st->worlds_ns / 1e9);
+    if ((args->protocol == IPERFTZ_UDP) && args->reverse)
+      printf(", lost = %" PRIu64 "/%" PRIu64 ", jitter = %.3f ms",
+	     st->loss.lost, st->loss.expected, st->loss.jitter / 1e6);
+    putchar('\n');
+  }
+}
+
 static int print_results(struct iptz_results *results,
 			 struct iptz_args *args,
 			 struct timespec *ta,
@@ -36,7 +194,33 @@ static int print_results(struct iptz_results *results,
 {
   FILE *fp;
 
-  printf("cycles = %" PRIu32 ", zcycles = %" PRIu32 ", bytes transmitted = %" PRIu32 ", worlds_time = %" PRIu32 ".%.3" PRIu32 " s, runtime = %" PRIu32 ".%.3" PRIu32 " s\n", results->cycles, results->zcycles, results->bytes_transmitted, results->worlds_sec, results->worlds_msec, results->runtime_sec, results->runtime_msec);
+  if (args->interval_msec > 0)
+    print_intervals(results, args);
+  if (results->streams > 1)
+    print_streams(results, args);
+  printf("cycles = %" PRIu32 ", zcycles = %" PRIu32 ", bytes transmitted = %" PRIu32 ", worlds_time = %.9f s, runtime = %.9f s\n", results->cycles, results->zcycles, results->bytes_transmitted, results->worlds_ns / 1e9, results->runtime_ns / 1e9);
+  printf("worlds_time per cycle = %.3f us, TA clock: %s, resolution %" PRIu32 " ns\n",
+	 results->cycles > 0 ? results->worlds_ns / 1e3 / results->cycles : 0.0,
+	 results->clock == IPERFTZ_CLOCK_COUNTER ? "generic timer" :
+	 (results->clock == IPERFTZ_CLOCK_MONOTONIC ? "CLOCK_MONOTONIC" : "system time"),
+	 results->clock_res_ns);
+  if (results->latency.count > 0)
+    print_latency(&results->latency);
+  if ((args->protocol == IPERFTZ_UDP) && args->reverse)
+    print_loss(&results->loss);
+  if (results->drained)
+    puts("The server stopped sending before the test was over");
+  if ((args->bitrate > 0) && !args->reverse)
+    print_pacer(results, args);
+  printf("block buffer: %s, setup = %.3f us, random fill = %.3f us\n",
+	 results->buffer_reused ? "reused from the session" : "filled for this test",
+	 results->buffer_setup_ns / 1e3, results->buffer_fill_ns / 1e3);
+  if (args->verify && args->reverse)
+    printf("verified %s = %" PRIu64 ", mismatches = %" PRIu64 ", verify time = %.3f ms (%.1f %% of the runtime, %.3f GB/s)\n",
+	   args->protocol == IPERFTZ_UDP ? "datagrams" : "blocks",
+	   results->verify_blocks, results->verify_errors, results->verify_ns / 1e6,
+	   results->runtime_ns > 0 ? results->verify_ns * 100.0 / results->runtime_ns : 0.0,
+	   results->verify_ns > 0 ? (double)results->bytes_transmitted / results->verify_ns : 0.0);
 
   fp = fopen("./iperfTZ-ca.csv", "a");
   if (fp == NULL) {
@@ -53,53 +237,262 @@ static int print_results(struct iptz_results *results,
    * 6. Number of transmitted chunks in less than 1 millisecond
    * 7. Start time in seconds since epoch
    * 8. End time in seconds since epoch
+   * 9. Runtime in nanoseconds
+   * 10. World switch time in nanoseconds
+   * 11. Resolution of the TA's clock in nanoseconds
    */  
-  fprintf(fp, "%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ".%.3" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%lli.%li,%lli.%li\n", args->blksize >> 10, args->socket_bufsize >> 10, results->bytes_transmitted, results->runtime_sec, results->runtime_msec, results->cycles, results->zcycles, (long long int)ta->tv_sec, ta->tv_nsec, (long long int)to->tv_sec, to->tv_nsec);
+  fprintf(fp, "%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ".%.3" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%lli.%09li,%lli.%09li,%" PRIu64 ",%" PRIu64 ",%" PRIu32 "\n", args->blksize >> 10, args->socket_bufsize >> 10, results->bytes_transmitted, results->runtime_sec, results->runtime_msec, results->cycles, results->zcycles, (long long int)ta->tv_sec, ta->tv_nsec, (long long int)to->tv_sec, to->tv_nsec, results->runtime_ns, results->worlds_ns, results->clock_res_ns);
   fclose(fp);
 
   return 0;
 }
 
-static void init_args(struct iptz_args *args)
+static void init_args(struct iptz_args *args, struct ca_args *ca)
 {
   args->blksize = TCP_WINDOW_DEFAULT;
   args->socket_bufsize = TCP_WINDOW_DEFAULT;
+  args->bitrate = 0;
+  args->burst = 0;
+  args->transmit_bytes = 0;
+  args->interval_msec = 0;
+  args->port = IPERFTZ_PORT;
+  args->control = 0;
+  args->streams = 1;
   args->protocol = IPERFTZ_TCP;
   args->reverse = 0;
+  args->telemetry_msec = 0;
+  args->payload = IPERFTZ_PAYLOAD_TA;
+  args->seed = IPERFTZ_SEED;
+  args->verify = 0;
+  ca->threads = 1;
+  ca->ncpus = 0;
+  ca->stall = 0;
+  ca->blocks = 0;
+  ca->payload_alloc = 0;
+  ca->payload_size = IPERFTZ_PAYLOAD_SIZE;
+  ca->counters = 0;
+  ca->runs = 1;
+  ca->sweeping = 0;
+  memset(&ca->sweep, 0, sizeof(ca->sweep));
+  ca->bench_calls = 0;
+  ca->bench_size = IPERFTZ_PAYLOAD_SIZE;
+}
+
+/*
+ * Parse a comma-separated list of values, each a number or a range lo:hi
+ * whose values double from lo up to hi.
+ */
+static int parse_list(struct sweep_list *list, char *spec, uint32_t max)
+{
+  unsigned long lo, hi;
+  char *end;
+
+  list->n = 0;
+  do {
+    lo = strtoul(spec, &end, 0);
+    hi = lo;
+    if (*end == ':')
+      hi = strtoul(end + 1, &end, 0);
+    if ((end == spec) || (lo > hi) || (hi > max) || ((lo == 0) && (hi > 0)))
+      return -1;
+    do {
+      if (list->n == SWEEP_MAX)
+	return -1;
+      list->v[list->n++] = lo;
+      lo *= 2;
+    } while ((lo <= hi) && (lo > 0));
+    spec = end + 1;
+  } while (*end == ',');
+
+  return *end == '\0' ? 0 : -1;
+}
+
+/* A sweep option as in -s l=1024:65536, -s u=0,1 */
+static int parse_sweep(struct sweep *sw, char *spec)
+{
+  if ((spec[0] == '\0') || (spec[1] != '='))
+    return -1;
+  switch (spec[0]) {
+  case 'l':
+    return parse_list(&sw->l, spec + 2, UINT32_MAX);
+  case 'w':
+    return parse_list(&sw->w, spec + 2, (1L<<30)-(1<<14));
+  case 'u':
+    return parse_list(&sw->u, spec + 2, 1);
+  case 'r':
+    return parse_list(&sw->r, spec + 2, 1);
+  default:
+    return -1;
+  }
+}
+
+/* Parse a comma-separated CPU list */
+static int parse_cpus(struct ca_args *ca, char *list)
+{
+  char *end;
+  long cpu;
+
+  ca->ncpus = 0;
+  do {
+    cpu = strtol(list, &end, 10);
+    if ((end == list) || (cpu < 0) || (cpu >= CPU_SETSIZE) || (ca->ncpus == THREADS_MAX))
+      return -1;
+    ca->cpus[ca->ncpus++] = cpu;
+    list = end + 1;
+  } while (*end == ',');
+
+  return *end == '\0' ? 0 : -1;
 }
 
 static int parse_args(struct iptz_args *args,
+		      struct ca_args *ca,
 		      char *argv[],
 		      int argc)
 {
   int c;
   int errflg = 0;
   unsigned long long br;
+  double interval;
+  char *end;
   
-  while ((c = getopt(argc, argv, "b:i:l:n:ruw:")) != -1) {
+  while ((c = getopt(argc, argv, "a:B:b:cHI:i:L:l:m:n:P:p:R:rS:s:t:uVW:w:x:")) != -1) {
     switch (c) {
+    case 'a':
+      if (parse_cpus(ca, optarg) == -1) {
+	fprintf(stderr, "Invalid CPU list: '%s'\n", optarg);
+	errflg++;
+      }
+      break;
+    case 'B':
+      ca->blocks = strtoul(optarg, (char **)NULL, 10);
+      if (ca->blocks == 0) {
+	fprintf(stderr, "Blocks per invocation must be positive\n");
+	errflg++;
+      }
+      break;
     case 'b':
-      br = strtoull(optarg, (char **)NULL, 10);
+      br = strtoull(optarg, &end, 10);
       if (br > UINT32_MAX)
 	args->bitrate = UINT32_MAX;
       else
 	args->bitrate = br;
+      /* An optional bucket size follows the rate as in -b rate/burst */
+      if (*end == '/')
+	args->burst = strtoul(end + 1, (char **)NULL, 10);
+      break;
+    case 'c':
+      args->control = 1;
+      break;
+    case 'H':
+      ca->counters = 1;
+      break;
+    case 'I':
+      /* The TA's clock counts milliseconds */
+      interval = strtod(optarg, (char **)NULL);
+      if ((interval < 0.001) || (interval > 3600)) {
+	fprintf(stderr, "Interval must be between 0.001 and 3600 seconds\n");
+	errflg++;
+      } else {
+	args->interval_msec = interval * 1000 + 0.5;
+      }
       break;
     case 'i':
-      strncpy(args->ip, optarg, IPERFTZ_ADDRSTRLEN);
+      strncpy(args->ip, optarg, IPERFTZ_ADDRSTRLEN - 1);
+      args->ip[IPERFTZ_ADDRSTRLEN - 1] = '\0';
+      break;
+    case 'L':
+      interval = strtod(optarg, (char **)NULL);
+      if ((interval < 0.001) || (interval > 3600)) {
+	fprintf(stderr, "Telemetry period must be between 0.001 and 3600 seconds\n");
+	errflg++;
+      } else {
+	args->telemetry_msec = interval * 1000 + 0.5;
+      }
       break;
     case 'l':
       args->blksize = strtoul(optarg, (char **)NULL, 10);
       break;
+    case 'm':
+      /* The payload's memory and size as in -m register/4194304 */
+      end = strchr(optarg, '/');
+      if (end != NULL) {
+	*end = '\0';
+	ca->payload_size = strtoul(end + 1, (char **)NULL, 10);
+      }
+      ca->payload_alloc = strcmp(optarg, "alloc") == 0;
+      if (ca->payload_alloc || (strcmp(optarg, "register") == 0)) {
+	args->payload = IPERFTZ_PAYLOAD_SHARED;
+      } else if (strcmp(optarg, "copy") == 0) {
+	args->payload = IPERFTZ_PAYLOAD_COPY;
+      } else {
+	fprintf(stderr, "Unknown payload memory: %s\n", optarg);
+	errflg++;
+      }
+      break;
     case 'n':
       args->transmit_bytes = strtoul(optarg, (char **)NULL, 10);
       break;
+    case 'P':
+      args->streams = strtoul(optarg, (char **)NULL, 10);
+      if ((args->streams == 0) || (args->streams > IPERFTZ_STREAMS_MAX)) {
+	fprintf(stderr, "Streams must be between 1 and %d\n", IPERFTZ_STREAMS_MAX);
+	errflg++;
+      }
+      break;
+    case 'p':
+      args->port = strtoul(optarg, (char **)NULL, 10);
+      if ((args->port == 0) || (args->port > 65535)) {
+	fprintf(stderr, "Port must be between 1 and 65535\n");
+	errflg++;
+      }
+      break;
+    case 'R':
+      ca->runs = strtoul(optarg, (char **)NULL, 10);
+      if (ca->runs == 0) {
+	fprintf(stderr, "Runs must be positive\n");
+	errflg++;
+      }
+      break;
     case 'r':
       args->reverse = 1;
       break;
+    case 'S':
+      ca->stall = strtod(optarg, (char **)NULL);
+      if (ca->stall <= 0) {
+	fprintf(stderr, "Stall timeout must be positive\n");
+	errflg++;
+      }
+      break;
+    case 's':
+      if (parse_sweep(&ca->sweep, optarg) == -1) {
+	fprintf(stderr, "Invalid sweep: %s\n", optarg);
+	errflg++;
+      }
+      ca->sweeping = 1;
+      break;
+    case 't':
+      ca->threads = strtoul(optarg, (char **)NULL, 10);
+      if ((ca->threads == 0) || (ca->threads > THREADS_MAX)) {
+	fprintf(stderr, "Threads must be between 1 and %d\n", THREADS_MAX);
+	errflg++;
+      }
+      break;
     case 'u':
       args->protocol = IPERFTZ_UDP;
       break;
+    case 'V':
+      args->verify = 1;
+      break;
+    case 'W':
+      /* Calls per case and the largest memref as in -W 1000000/65536 */
+      ca->bench_calls = strtoul(optarg, &end, 10);
+      if (*end == '/')
+	ca->bench_size = strtoul(end + 1, (char **)NULL, 10);
+      if ((ca->bench_calls == 0) || (ca->bench_size < BENCH_SIZE_MIN)) {
+	fprintf(stderr, "Benchmark needs calls and a size of at least %d B\n", BENCH_SIZE_MIN);
+	errflg++;
+      }
+      break;
     case 'w':
       args->socket_bufsize = strtoul(optarg, (char **)NULL, 10);
       if (args->socket_bufsize > ((1L<<30)-(1<<14))) {
@@ -107,6 +500,9 @@ static int parse_args(struct iptz_args *args,
 	errflg++;
       }
       break;
+    case 'x':
+      args->seed = strtoul(optarg, (char **)NULL, 0);
+      break;
     case ':':
       fprintf(stderr, "Option -%c requires an operand\n", optopt);
       errflg++;
@@ -116,100 +512,1018 @@ static int parse_args(struct iptz_args *args,
       errflg++;
     }
   }
+  if ((ca->blocks > 0) && ((args->telemetry_msec > 0) || (ca->stall > 0))) {
+    fprintf(stderr, "Options -L and -S are not available with -B\n");
+    errflg++;
+  }
+  if (ca->sweeping && ((ca->threads > 1) || (ca->blocks > 0) || (args->telemetry_msec > 0) ||
+		       (ca->stall > 0) || (args->payload != IPERFTZ_PAYLOAD_TA))) {
+    fprintf(stderr, "Options -B, -L, -m, -S and -t are not available with -s\n");
+    errflg++;
+  }
+  if (!ca->sweeping && (ca->runs > 1) && ((ca->blocks > 0) || (args->telemetry_msec > 0) || (ca->stall > 0))) {
+    fprintf(stderr, "Options -B, -L and -S are not available with -R\n");
+    errflg++;
+  }
+  /* The TA goes round the payload in blocks */
+  if ((args->payload != IPERFTZ_PAYLOAD_TA) && (ca->payload_size < args->blksize))
+    ca->payload_size = args->blksize;
+  /* Stalls are detected through the telemetry */
+  if ((ca->stall > 0) && (args->telemetry_msec == 0))
+    args->telemetry_msec = 100;
   if (errflg) {
     errno = EINVAL;
-    fprintf(stderr, "usage: %s -b size -i IP -l size -n size -ru -w size\n", argv[0]);
+    fprintf(stderr, "usage: %s -a cpu[,cpu...] -B blocks -b rate[/burst] -c -H -I interval -i IP -L interval -l size -m alloc|register|copy[/size] -n size -P streams -p port -R runs -r -S seconds -s l|w|u|r=list -t threads -u -V -W calls[/size] -w size -x seed\n", argv[0]);
     return EINVAL;
   }
 
   return 0;
 }
 
-int main(int argc, char *argv[])
+static long long elapsed_ns(struct timespec *ti, struct timespec *tj)
+{
+  return (tj->tv_sec - ti->tv_sec) * 1000000000LL + tj->tv_nsec - ti->tv_nsec;
+}
+
+/*
+ * Keep one test open in the TA and move it forward a number of blocks
+ * per invocation, which tells the cost of an invocation from that of a
+ * connection. The results of the last invocation cover the whole test.
+ */
+static TEEC_Result session_blocks(struct session *t)
+{
+  struct iptz_args *args = (struct iptz_args *)t->args_sm.buffer;
+  struct iptz_results *results = (struct iptz_results *)t->results_sm.buffer;
+  TEEC_Operation op;
+  TEEC_Result res, cres;
+  struct timespec ti, tj;
+
+  memset(&op, 0, sizeof(op));
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_WHOLE, TEEC_NONE,
+				   TEEC_NONE, TEEC_NONE);
+  op.params[0].memref.parent = &t->args_sm;
+  op.params[0].memref.offset = 0;
+  op.params[0].memref.size = t->args_sm.size;
+  clock_gettime(CLOCK_MONOTONIC, &ti);
+  res = TEEC_InvokeCommand(&t->sess, IPERFTZ_TA_OPEN, &op, &t->ret_orig);
+  clock_gettime(CLOCK_MONOTONIC, &tj);
+  t->open_ns = elapsed_ns(&ti, &tj);
+  if (res != TEEC_SUCCESS)
+    return res;
+
+  do {
+    memset(&op, 0, sizeof(op));
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT, TEEC_MEMREF_WHOLE,
+				     t->payload_sm.buffer != NULL ? TEEC_MEMREF_WHOLE : TEEC_NONE,
+				     TEEC_NONE);
+    op.params[0].value.a = t->blocks;
+    op.params[1].memref.parent = &t->results_sm;
+    op.params[1].memref.offset = 0;
+    op.params[1].memref.size = t->results_sm.size;
+    if (t->payload_sm.buffer != NULL) {
+      op.params[2].memref.parent = &t->payload_sm;
+      op.params[2].memref.offset = 0;
+      op.params[2].memref.size = t->payload_sm.size;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ti);
+    res = TEEC_InvokeCommand(&t->sess, IPERFTZ_TA_TRANSFER, &op, &t->ret_orig);
+    clock_gettime(CLOCK_MONOTONIC, &tj);
+    t->invokes++;
+    t->invoke_ns += elapsed_ns(&ti, &tj);
+  } while ((res == TEEC_SUCCESS) && !results->drained &&
+	   (((args->transmit_bytes == 0) && (results->runtime_ns < 10000000000ULL)) ||
+	    ((args->transmit_bytes > 0) && (results->bytes_transmitted < args->transmit_bytes))));
+
+  memset(&op, 0, sizeof(op));
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_WHOLE, TEEC_NONE,
+				   TEEC_NONE, TEEC_NONE);
+  op.params[0].memref.parent = &t->results_sm;
+  op.params[0].memref.offset = 0;
+  op.params[0].memref.size = t->results_sm.size;
+  clock_gettime(CLOCK_MONOTONIC, &ti);
+  cres = TEEC_InvokeCommand(&t->sess, IPERFTZ_TA_CLOSE, &op, &t->ret_orig);
+  clock_gettime(CLOCK_MONOTONIC, &tj);
+  t->close_ns = elapsed_ns(&ti, &tj);
+
+  return res != TEEC_SUCCESS ? res : cres;
+}
+
+/* What reusing the TA's block buffer saved the runs after the first */
+static void print_runs(struct session *t)
+{
+  double later = t->setup_later_ns / 1e3 / (t->runs - 1);
+
+  printf("runs = %u, block buffer setup: first run = %.3f us, later runs = %.3f us, saved per run = %.3f us\n",
+	 t->runs, t->setup_first_ns / 1e3, later, t->setup_first_ns / 1e3 - later);
+}
+
+/* Where the time of the invocations went, next to the TA's socket calls */
+static void print_invokes(struct session *t)
+{
+  struct iptz_results *results = (struct iptz_results *)t->results_sm.buffer;
+  long long outside = t->invoke_ns - (long long)results->worlds_ns;
+
+  printf("invocations = %llu of %" PRIu32 " blocks, open = %.3f ms, close = %.3f ms, invocation = %.3f us, outside socket calls = %.3f us/invocation, %.3f us/block\n",
+	 t->invokes, t->blocks, t->open_ns / 1e6, t->close_ns / 1e6,
+	 t->invokes > 0 ? t->invoke_ns / 1e3 / t->invokes : 0.0,
+	 t->invokes > 0 ? outside / 1e3 / t->invokes : 0.0,
+	 results->cycles > 0 ? outside / 1e3 / results->cycles : 0.0);
+}
+
+static void print_share(const char *what, long long ns, long long wall)
+{
+  printf("  %-28s %12.3f ms %6.1f %%\n", what, ns / 1e6, wall > 0 ? ns * 100.0 / wall : 0.0);
+}
+
+/*
+ * Break the time from the invocation to its return down by layer: the
+ * TEE client and world switches outside the TA, the TA's setup, its
+ * socket calls and what it did in between, its teardown and, from a
+ * server daemon's report, the server's time in its socket calls. Clocks
+ * of the CA and the TA differ, so the shares are good to a few
+ * microseconds. A test kept open across invocations spends part of its
+ * runtime back in the CA, which counts as outside the TA.
+ */
+static int print_overhead(struct iptz_results *results,
+			  struct iptz_args *args,
+			  struct timespec *ta,
+			  struct timespec *to)
+{
+  FILE *fp;
+  long long wall = elapsed_ns(ta, to);
+  long long pacer = results->pacer_wait_msec * 1000000LL;
+  long long sockets = results->worlds_ns - results->verify_ns;
+  long long between = results->runtime_ns - results->worlds_ns - pacer - results->returned_ns;
+  long long rest = results->invoke_ns - results->buffer_setup_ns - results->connect_ns -
+    (results->runtime_ns - results->returned_ns) - results->report_ns - results->close_ns;
+  struct iptz_report *r = &results->server;
+
+  printf("overhead of %.3f ms from invocation to return:\n", wall / 1e6);
+  print_share("outside the TA", wall - (long long)results->invoke_ns, wall);
+  print_share(results->buffer_reused ? "block buffer setup" : "block buffer setup and fill",
+	      results->buffer_setup_ns, wall);
+  print_share("socket open and handshake", results->connect_ns, wall);
+  print_share("inside socket calls", sockets, wall);
+  if (results->verify_ns > 0)
+    print_share("verifying blocks", results->verify_ns, wall);
+  if (pacer > 0)
+    print_share("pacer sleeping", pacer, wall);
+  print_share("between socket calls", between, wall);
+  if (args->control)
+    print_share("waiting for the server", results->report_ns, wall);
+  print_share("socket close", results->close_ns, wall);
+  print_share("rest of the TA", rest, wall);
+  if (results->reported)
+    printf("server: bytes = %" PRIu64 ", runtime = %.3f ms, inside socket calls = %.3f ms (%.1f %%), CPU time = %.3f ms\n",
+	   r->bytes, r->runtime_ns / 1e6, r->net_ns / 1e6,
+	   r->runtime_ns > 0 ? r->net_ns * 100.0 / r->runtime_ns : 0.0, r->cpu_ns / 1e6);
+  else
+    printf("server: no report%s\n", args->control ? "" : ", the test was not negotiated with a daemon (-c)");
+
+  fp = fopen("./iperfTZ-overhead.csv", "a");
+  if (fp == NULL) {
+    perror("fopen");
+    return errno;
+  }
+  /*
+   * CSV format, times in nanoseconds:
+   * 1. Chunk size in KiB
+   * 2. Socket buffer size in KiB
+   * 3. Number of bytes transmitted
+   * 4. Time from the invocation to its return
+   * 5. Outside the TA
+   * 6. Block buffer setup
+   * 7. Socket open and control handshake
+   * 8. Inside socket calls
+   * 9. Verifying blocks
+   * 10. Pacer sleeping
+   * 11. Between socket calls
+   * 12. Waiting for the server's report
+   * 13. Socket close
+   * 14. Rest of the TA
+   * 15. Server's runtime, 0 without its report
+   * 16. Server's time inside socket calls
+   * 17. Server's CPU time
+   */
+  fprintf(fp, "%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%lli,%lli,%" PRIu64 ",%" PRIu64 ",%lli,%" PRIu64 ",%lli,%lli,%" PRIu64 ",%" PRIu64 ",%lli,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+	  args->blksize >> 10, args->socket_bufsize >> 10, results->bytes_transmitted,
+	  wall, wall - (long long)results->invoke_ns, results->buffer_setup_ns, results->connect_ns,
+	  sockets, results->verify_ns, pacer, between, results->report_ns, results->close_ns, rest,
+	  r->runtime_ns, r->net_ns, r->cpu_ns);
+  fclose(fp);
+
+  return 0;
+}
+
+/*
+ * What the invocations cost the CA's thread, see iperfTZ_cpu.h. Time in
+ * the secure world shows as system time.
+ */
+static void print_cpu(struct session *t, struct iptz_results *results)
 {
+  struct iptz_cpu *c = &t->usage;
+  long long cpu = cpu_time_ns(c);
+  uint32_t bytes = results->bytes_transmitted;
+
+  printf("CA CPU: user = %.3f ms, system = %.3f ms, thread = %.3f ms, utilisation = %.1f %%, %.3f s/GB, context switches = %ld voluntary, %ld involuntary\n",
+	 tv_ns(&c->ru.ru_utime) / 1e6, tv_ns(&c->ru.ru_stime) / 1e6, c->thread_ns / 1e6,
+	 c->wall_ns > 0 ? cpu * 100.0 / c->wall_ns : 0.0, bytes > 0 ? cpu / (double)bytes : 0.0,
+	 c->ru.ru_nvcsw, c->ru.ru_nivcsw);
+  if (!t->counters)
+    return;
+  if (!cpu_counted(c)) {
+    printf("CA hardware counters: not available (%s)\n", strerror(c->error));
+    return;
+  }
+  printf("CA hardware counters%s: cycles = %" PRIu64 " (%.3f cycles/B), instructions = %" PRIu64 " (%.2f per cycle), cache misses = %" PRIu64 "\n",
+	 c->user_only ? " (user space)" : "",
+	 c->count[CPU_CYCLES], bytes > 0 ? (double)c->count[CPU_CYCLES] / bytes : 0.0,
+	 c->count[CPU_INSTRUCTIONS],
+	 c->count[CPU_CYCLES] > 0 ? (double)c->count[CPU_INSTRUCTIONS] / c->count[CPU_CYCLES] : 0.0,
+	 c->count[CPU_CACHE_MISSES]);
+}
+
+/*
+ * Share the normal world payload the TA sends from or receives into,
+ * either allocated by the TEE client library or the CA's own memory
+ * registered with it, which is how an application would hand over its
+ * data.
+ */
+static TEEC_Result open_payload(struct session *t)
+{
+  unsigned char *p;
+  size_t i, blksize;
   int rc;
-  TEEC_Context ctx;
+
+  t->payload_sm.size = t->payload_size;
+  t->payload_sm.flags = TEEC_MEM_INPUT | TEEC_MEM_OUTPUT;
+  if (t->payload_alloc) {
+    t->res = TEEC_AllocateSharedMemory(t->ctx, &t->payload_sm);
+    if (t->res != TEEC_SUCCESS) {
+      fprintf(stderr, "TEEC_AllocateSharedMemory failed with code %#" PRIx32 "\n", t->res);
+      t->payload_sm.buffer = NULL;
+      return t->res;
+    }
+  } else {
+    rc = posix_memalign(&t->payload, sysconf(_SC_PAGESIZE), t->payload_size);
+    if (rc != 0) {
+      fprintf(stderr, "posix_memalign: %s\n", strerror(rc));
+      t->payload = NULL;
+      t->res = TEEC_ERROR_OUT_OF_MEMORY;
+      return t->res;
+    }
+    t->payload_sm.buffer = t->payload;
+    t->res = TEEC_RegisterSharedMemory(t->ctx, &t->payload_sm);
+    if (t->res != TEEC_SUCCESS) {
+      fprintf(stderr, "TEEC_RegisterSharedMemory failed with code %#" PRIx32 "\n", t->res);
+      t->payload_sm.buffer = NULL;
+      return t->res;
+    }
+  }
+
+  /* Every block of the payload carries the pattern a receiver expects */
+  p = (unsigned char *)t->payload_sm.buffer;
+  blksize = t->defaults->blksize;
+  for (i = 0; i < t->payload_size; i += blksize)
+    pattern_fill(p + i, t->payload_size - i < blksize ? t->payload_size - i : blksize,
+		 t->defaults->seed);
+  return TEEC_SUCCESS;
+}
+
+/*
+ * Allocate the session's shared memory, open it and prepare the operation
+ * of a whole test. Whatever succeeded is released by session_close().
+ */
+static TEEC_Result session_open(struct session *t)
+{
+  TEEC_UUID uuid = IPERFTZ_TA_UUID;
+  TEEC_Operation *op = &t->op;
+
+  t->args_sm.size = sizeof(struct iptz_args);
+  t->args_sm.flags = TEEC_MEM_INPUT;
+  t->res = TEEC_AllocateSharedMemory(t->ctx, &t->args_sm);
+  if (t->res != TEEC_SUCCESS) {
+    fprintf(stderr, "TEEC_AllocateSharedMemory failed with code %#" PRIx32 "\n", t->res);
+    t->args_sm.buffer = NULL;
+    return t->res;
+  }
+  memcpy(t->args_sm.buffer, t->defaults, sizeof(struct iptz_args));
+
+  t->results_sm.size = sizeof(struct iptz_results);
+  t->results_sm.flags = TEEC_MEM_OUTPUT;
+  t->res = TEEC_AllocateSharedMemory(t->ctx, &t->results_sm);
+  if (t->res != TEEC_SUCCESS) {
+    fprintf(stderr, "TEEC_AllocateSharedMemory failed with code %#" PRIx32 "\n", t->res);
+    t->results_sm.buffer = NULL;
+    return t->res;
+  }
+
+  if (t->defaults->telemetry_msec > 0) {
+    t->telemetry_sm.size = sizeof(struct iptz_telemetry);
+    t->telemetry_sm.flags = TEEC_MEM_INPUT | TEEC_MEM_OUTPUT;
+    t->res = TEEC_AllocateSharedMemory(t->ctx, &t->telemetry_sm);
+    if (t->res != TEEC_SUCCESS) {
+      fprintf(stderr, "TEEC_AllocateSharedMemory failed with code %#" PRIx32 "\n", t->res);
+      t->telemetry_sm.buffer = NULL;
+      return t->res;
+    }
+    memset(t->telemetry_sm.buffer, 0, sizeof(struct iptz_telemetry));
+  }
+
+  if (t->defaults->payload != IPERFTZ_PAYLOAD_TA) {
+    if (open_payload(t) != TEEC_SUCCESS)
+      return t->res;
+  }
+
+  t->res = TEEC_OpenSession(t->ctx, &t->sess, &uuid,
+			    TEEC_LOGIN_PUBLIC, NULL, NULL, &t->ret_orig);
+  if (t->res != TEEC_SUCCESS) {
+    fprintf(stderr, "TEEC_Opensession failed with code %#" PRIx32 " origin %#" PRIx32 "\n",
+	    t->res, t->ret_orig);
+    return t->res;
+  }
+  t->opened = 1;
+
+  memset(op, 0, sizeof(*op));
+  op->paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_WHOLE, TEEC_MEMREF_WHOLE,
+				    t->telemetry_sm.buffer != NULL ? TEEC_MEMREF_WHOLE : TEEC_NONE,
+				    t->payload_sm.buffer != NULL ? TEEC_MEMREF_WHOLE : TEEC_NONE);
+  op->params[0].memref.parent = &t->args_sm;
+  op->params[0].memref.offset = 0;
+  op->params[0].memref.size = t->args_sm.size;
+  op->params[1].memref.parent = &t->results_sm;
+  op->params[1].memref.offset = 0;
+  op->params[1].memref.size = t->results_sm.size;
+  if (t->telemetry_sm.buffer != NULL) {
+    op->params[2].memref.parent = &t->telemetry_sm;
+    op->params[2].memref.offset = 0;
+    op->params[2].memref.size = t->telemetry_sm.size;
+  }
+  if (t->payload_sm.buffer != NULL) {
+    op->params[3].memref.parent = &t->payload_sm;
+    op->params[3].memref.offset = 0;
+    op->params[3].memref.size = t->payload_sm.size;
+  }
+
+  return TEEC_SUCCESS;
+}
+
+static void session_close(struct session *t)
+{
+  if (t->opened)
+    TEEC_CloseSession(&t->sess);
+  if (t->payload_sm.buffer != NULL)
+    TEEC_ReleaseSharedMemory(&t->payload_sm);
+  free(t->payload);
+  if (t->telemetry_sm.buffer != NULL)
+    TEEC_ReleaseSharedMemory(&t->telemetry_sm);
+  if (t->results_sm.buffer != NULL)
+    TEEC_ReleaseSharedMemory(&t->results_sm);
+  if (t->args_sm.buffer != NULL)
+    TEEC_ReleaseSharedMemory(&t->args_sm);
+}
+
+/*
+ * Open the session and its shared memory, wait for the other threads and
+ * run the test. The barrier lines up the invocations, so that the threads
+ * enter the TEE at once.
+ */
+static void *session_thread(void *arg)
+{
+  struct session *t = (struct session *)arg;
+  struct iptz_results *results;
+  TEEC_Operation *op = &t->op;
+  unsigned int run;
+  cpu_set_t set;
+  int rc;
+
+  if (t->cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(t->cpu, &set);
+    rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0)
+      fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(rc));
+  }
+
+  session_open(t);
+
+  /* Threads that failed still have to show up, the others wait for them */
+  pthread_barrier_wait(t->barrier);
+  if (!t->opened)
+    return NULL;
+
+  results = (struct iptz_results *)t->results_sm.buffer;
+  __atomic_store_n(&t->invoked, 1, __ATOMIC_RELEASE);
+  cpu_open(&t->usage, RUSAGE_THREAD, t->counters);
+  cpu_start(&t->usage);
+  clock_gettime(CLOCK_REALTIME, &t->ta);
+  if (t->blocks > 0) {
+    t->res = session_blocks(t);
+  } else {
+    /* Only the last run's results are kept */
+    for (run = 0; run < t->runs; run++) {
+      if (run > 0) {
+	cpu_start(&t->usage);
+	clock_gettime(CLOCK_REALTIME, &t->ta);
+      }
+      t->res = TEEC_InvokeCommand(&t->sess, t->command_id, op, &t->ret_orig);
+      if (t->res != TEEC_SUCCESS)
+	break;
+      if (run == 0)
+	t->setup_first_ns = results->buffer_setup_ns;
+      else
+	t->setup_later_ns += results->buffer_setup_ns;
+    }
+  }
+  clock_gettime(CLOCK_REALTIME, &t->to);
+  cpu_stop(&t->usage);
+  cpu_close(&t->usage);
+  if (t->res != TEEC_SUCCESS)
+    fprintf(stderr, "TEEC_InvokeCommand failed with code %#" PRIx32 " origin %#" PRIx32 "\n", t->res, t->ret_orig);
+
+  return NULL;
+}
+
+static double ts_sec(struct timespec *t)
+{
+  return t->tv_sec + t->tv_nsec / 1e9;
+}
+
+/*
+ * Print the records a session's TA published since the last poll, and
+ * stop a test that made no progress within the stall timeout. A TA
+ * blocked in a socket call only notices the cancellation once the call
+ * returns.
+ */
+static void live_poll(struct live *l, struct session *t, struct timespec *now)
+{
+  struct iptz_telemetry *ring;
+  struct iptz_record r;
+  uint32_t head;
+
+  if (!__atomic_load_n(&t->invoked, __ATOMIC_ACQUIRE))
+    return;
+  ring = (struct iptz_telemetry *)t->telemetry_sm.buffer;
+
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (head - t->tail > IPERFTZ_RECORDS) {
+    printf("%u telemetry records were overwritten\n", head - t->tail - IPERFTZ_RECORDS);
+    t->tail = head - IPERFTZ_RECORDS;
+  }
+  for (; t->tail != head; t->tail++) {
+    r = ring->record[t->tail % IPERFTZ_RECORDS];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - t->tail > IPERFTZ_RECORDS)
+      continue;
+    if (l->n > 1)
+      printf("[thread %3u] ", t->index);
+    printf("live [%8.3f s] bytes = %" PRIu64 ", %.3f Mbit/s, cycles = %" PRIu32 ", errors = %" PRIu32,
+	   r.time_ns / 1e9, r.bytes,
+	   r.time_ns > t->last.time_ns ? (r.bytes - t->last.bytes) * 8e3 / (r.time_ns - t->last.time_ns) : 0.0,
+	   r.cycles, r.errors);
+    if ((l->args->protocol == IPERFTZ_UDP) && l->args->reverse)
+      printf(", lost = %" PRIu64, r.lost);
+    putchar('\n');
+    if ((r.bytes > t->last.bytes) || (t->progress.tv_sec == 0))
+      t->progress = *now;
+    t->last = r;
+  }
+  fflush(stdout);
+
+  if (__atomic_load_n(&ring->state, __ATOMIC_ACQUIRE) != IPERFTZ_TELEMETRY_RUNNING)
+    return;
+  if (t->progress.tv_sec == 0)
+    t->progress = *now;
+  if ((l->stall > 0) && !t->stalled && (ts_sec(now) - ts_sec(&t->progress) > l->stall)) {
+    fprintf(stderr, "Thread %u made no progress for %.3f s, stopping the test\n", t->index, l->stall);
+    __atomic_store_n(&ring->stop, 1, __ATOMIC_RELEASE);
+    TEEC_RequestCancellation(&t->op);
+    t->stalled = 1;
+  }
+}
+
+static void *live_thread(void *arg)
+{
+  struct live *l = (struct live *)arg;
+  struct timespec now, period;
+  unsigned int i;
+  int stop;
+
+  period.tv_sec = l->args->telemetry_msec / 1000;
+  period.tv_nsec = l->args->telemetry_msec % 1000 * 1000000L;
+  do {
+    /* A last poll after the sessions ended picks up their final records */
+    stop = __atomic_load_n(&l->stop, __ATOMIC_ACQUIRE);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < l->n; i++)
+      live_poll(l, &l->threads[i], &now);
+    if (!stop)
+      nanosleep(&period, NULL);
+  } while (!stop);
+
+  return NULL;
+}
+
+/*
+ * Sum of the threads' results over the span from the first start to the
+ * last end, and how evenly the threads fared: the spread of their
+ * throughput and Jain's fairness index, 1 when all got the same.
+ */
+static void print_threads(struct session *threads, unsigned int n)
+{
+  struct iptz_results *results;
+  double first = 0, last = 0, latest_start = 0, earliest_end = 0;
+  double rate, sum = 0, sumsq = 0, min = 0, max = 0, mean, stddev;
+  unsigned long long bytes = 0;
+  unsigned int i, ok = 0;
+
+  for (i = 0; i < n; i++) {
+    if (threads[i].res != TEEC_SUCCESS)
+      continue;
+    results = (struct iptz_results *)threads[i].results_sm.buffer;
+    rate = results->runtime_ns > 0 ? results->bytes_transmitted * 8e3 / results->runtime_ns : 0;
+    printf("[thread %3u] cpu %d: bytes transmitted = %" PRIu32 ", runtime = %.9f s, %.3f Mbit/s\n",
+	   i, threads[i].cpu, results->bytes_transmitted, results->runtime_ns / 1e9, rate);
+    if ((ok == 0) || (ts_sec(&threads[i].ta) < first))
+      first = ts_sec(&threads[i].ta);
+    if ((ok == 0) || (ts_sec(&threads[i].ta) > latest_start))
+      latest_start = ts_sec(&threads[i].ta);
+    if ((ok == 0) || (ts_sec(&threads[i].to) > last))
+      last = ts_sec(&threads[i].to);
+    if ((ok == 0) || (ts_sec(&threads[i].to) < earliest_end))
+      earliest_end = ts_sec(&threads[i].to);
+    if ((ok == 0) || (rate < min))
+      min = rate;
+    if ((ok == 0) || (rate > max))
+      max = rate;
+    sum += rate;
+    sumsq += rate * rate;
+    bytes += results->bytes_transmitted;
+    ok++;
+  }
+  if (ok == 0)
+    return;
+
+  mean = sum / ok;
+  stddev = ok > 1 ? sqrt((sumsq - sum * sum / ok) / (ok - 1)) : 0;
+  printf("threads = %u/%u, bytes transmitted = %llu, span = %.3f s, aggregate = %.3f Mbit/s\n",
+	 ok, n, bytes, last - first, last > first ? bytes * 8 / (last - first) / 1e6 : 0.0);
+  printf("per thread: min = %.3f Mbit/s, mean = %.3f Mbit/s, max = %.3f Mbit/s, stddev = %.3f Mbit/s (%.1f %%), fairness = %.3f\n",
+	 min, mean, max, stddev, mean > 0 ? stddev * 100 / mean : 0.0,
+	 sumsq > 0 ? sum * sum / (ok * sumsq) : 0.0);
+  printf("start skew = %.3f ms, end skew = %.3f ms\n",
+	 (latest_start - first) * 1e3, (last - earliest_end) * 1e3);
+}
+
+/* Memory the echo command of the microbenchmark passes */
+enum bench_mem {
+  BENCH_TEMP,      /* TEEC_MEMREF_TEMP_* of the CA's memory */
+  BENCH_WHOLE,     /* TEEC_MEMREF_WHOLE of allocated shared memory */
+  BENCH_REGISTERED /* TEEC_MEMREF_PARTIAL_* of registered CA memory */
+};
+
+static const char *bench_names[] = { "temp", "whole", "registered" };
+
+static void print_bench(const char *name,
+			size_t size,
+			struct iptz_hist *h,
+			long long total_ns)
+{
+  struct iptz_latency l;
+
+  hist_summary(h, &l);
+  printf("%-10s %8zu B: calls = %" PRIu64 ", mean = %.3f us, min = %.3f us, p50 = %.3f us, p90 = %.3f us, p99 = %.3f us, p99.9 = %.3f us, max = %.3f us\n",
+	 name, size, l.count, l.count > 0 ? total_ns / 1e3 / l.count : 0.0,
+	 l.min / 1e3, l.p50 / 1e3, l.p90 / 1e3, l.p99 / 1e3, l.p999 / 1e3, l.max / 1e3);
+}
+
+/*
+ * Invoke cmd with op calls times and record the latency of each call.
+ * A first call, which may map the memory, is left out.
+ */
+static TEEC_Result bench_loop(TEEC_Session *sess,
+			      uint32_t cmd,
+			      TEEC_Operation *op,
+			      unsigned long calls,
+			      struct iptz_hist *h,
+			      long long *total_ns)
+{
+  struct timespec ti, tj;
+  TEEC_Result res;
+  uint32_t ret_orig;
+  unsigned long i;
+  long long ns;
+
+  hist_init(h);
+  *total_ns = 0;
+  res = TEEC_InvokeCommand(sess, cmd, op, &ret_orig);
+  for (i = 0; (i < calls) && (res == TEEC_SUCCESS); i++) {
+    clock_gettime(CLOCK_MONOTONIC, &ti);
+    res = TEEC_InvokeCommand(sess, cmd, op, &ret_orig);
+    clock_gettime(CLOCK_MONOTONIC, &tj);
+    ns = elapsed_ns(&ti, &tj);
+    hist_record(h, ns);
+    *total_ns += ns;
+  }
+  if (res != TEEC_SUCCESS)
+    fprintf(stderr, "TEEC_InvokeCommand failed with code %#" PRIx32 " origin %#" PRIx32 "\n", res, ret_orig);
+
+  return res;
+}
+
+/* Echo size bytes from in to out, both at least size bytes of CA memory */
+static TEEC_Result bench_echo(TEEC_Context *ctx,
+			      TEEC_Session *sess,
+			      enum bench_mem mem,
+			      size_t size,
+			      void *in,
+			      void *out,
+			      unsigned long calls,
+			      struct iptz_hist *h,
+			      long long *total_ns)
+{
+  TEEC_SharedMemory in_sm, out_sm;
   TEEC_Operation op;
   TEEC_Result res;
-  TEEC_Session sess;
-  TEEC_SharedMemory args_sm, results_sm;
+
+  memset(&op, 0, sizeof(op));
+  if (mem == BENCH_TEMP) {
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, TEEC_MEMREF_TEMP_OUTPUT,
+				     TEEC_NONE, TEEC_NONE);
+    op.params[0].tmpref.buffer = in;
+    op.params[0].tmpref.size = size;
+    op.params[1].tmpref.buffer = out;
+    op.params[1].tmpref.size = size;
+    return bench_loop(sess, IPERFTZ_TA_ECHO, &op, calls, h, total_ns);
+  }
+
+  memset(&in_sm, 0, sizeof(in_sm));
+  memset(&out_sm, 0, sizeof(out_sm));
+  in_sm.size = size;
+  in_sm.flags = TEEC_MEM_INPUT;
+  out_sm.size = size;
+  out_sm.flags = TEEC_MEM_OUTPUT;
+  if (mem == BENCH_WHOLE) {
+    res = TEEC_AllocateSharedMemory(ctx, &in_sm);
+    if (res == TEEC_SUCCESS) {
+      res = TEEC_AllocateSharedMemory(ctx, &out_sm);
+      if (res != TEEC_SUCCESS)
+	TEEC_ReleaseSharedMemory(&in_sm);
+    }
+    if (res != TEEC_SUCCESS) {
+      fprintf(stderr, "TEEC_AllocateSharedMemory failed with code %#" PRIx32 "\n", res);
+      return res;
+    }
+    memcpy(in_sm.buffer, in, size);
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_WHOLE, TEEC_MEMREF_WHOLE,
+				     TEEC_NONE, TEEC_NONE);
+  } else {
+    in_sm.buffer = in;
+    out_sm.buffer = out;
+    res = TEEC_RegisterSharedMemory(ctx, &in_sm);
+    if (res == TEEC_SUCCESS) {
+      res = TEEC_RegisterSharedMemory(ctx, &out_sm);
+      if (res != TEEC_SUCCESS)
+	TEEC_ReleaseSharedMemory(&in_sm);
+    }
+    if (res != TEEC_SUCCESS) {
+      fprintf(stderr, "TEEC_RegisterSharedMemory failed with code %#" PRIx32 "\n", res);
+      return res;
+    }
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INPUT, TEEC_MEMREF_PARTIAL_OUTPUT,
+				     TEEC_NONE, TEEC_NONE);
+  }
+  op.params[0].memref.parent = &in_sm;
+  op.params[0].memref.offset = 0;
+  op.params[0].memref.size = size;
+  op.params[1].memref.parent = &out_sm;
+  op.params[1].memref.offset = 0;
+  op.params[1].memref.size = size;
+
+  res = bench_loop(sess, IPERFTZ_TA_ECHO, &op, calls, h, total_ns);
+  TEEC_ReleaseSharedMemory(&out_sm);
+  TEEC_ReleaseSharedMemory(&in_sm);
+
+  return res;
+}
+
+/*
+ * The cost of entering the TA and of passing it parameters, without any
+ * network: the null command, then the echo command for every kind of
+ * memory with sizes growing fourfold up to the largest.
+ */
+static int run_bench(TEEC_Context *ctx, struct ca_args *ca)
+{
   TEEC_UUID uuid = IPERFTZ_TA_UUID;
-  uint32_t command_id = IPERFTZ_TA_SEND;
+  TEEC_Session sess;
+  TEEC_Operation op;
+  TEEC_Result res;
+  struct iptz_hist *h;
   uint32_t ret_orig;
+  long long total_ns;
+  void *in = NULL, *out = NULL;
+  unsigned int mem;
+  size_t size, i;
+  int rc;
+
+  h = (struct iptz_hist *)malloc(sizeof(*h));
+  if ((h == NULL) ||
+      (posix_memalign(&in, sysconf(_SC_PAGESIZE), ca->bench_size) != 0) ||
+      (posix_memalign(&out, sysconf(_SC_PAGESIZE), ca->bench_size) != 0)) {
+    fprintf(stderr, "Out of memory for the benchmark\n");
+    rc = EXIT_FAILURE;
+    goto out;
+  }
+  for (i = 0; i < ca->bench_size; i++)
+    ((unsigned char *)in)[i] = rand();
+
+  res = TEEC_OpenSession(ctx, &sess, &uuid, TEEC_LOGIN_PUBLIC, NULL, NULL, &ret_orig);
+  if (res != TEEC_SUCCESS) {
+    fprintf(stderr, "TEEC_Opensession failed with code %#" PRIx32 " origin %#" PRIx32 "\n",
+	    res, ret_orig);
+    rc = EXIT_FAILURE;
+    goto out;
+  }
+
+  memset(&op, 0, sizeof(op));
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_NONE, TEEC_NONE, TEEC_NONE, TEEC_NONE);
+  res = bench_loop(&sess, IPERFTZ_TA_NULL, &op, ca->bench_calls, h, &total_ns);
+  if (res == TEEC_SUCCESS)
+    print_bench("null", 0, h, total_ns);
+
+  for (mem = BENCH_TEMP; (mem <= BENCH_REGISTERED) && (res == TEEC_SUCCESS); mem++) {
+    for (size = BENCH_SIZE_MIN; (size <= ca->bench_size) && (res == TEEC_SUCCESS); size *= 4) {
+      res = bench_echo(ctx, &sess, mem, size, in, out, ca->bench_calls, h, &total_ns);
+      if (res == TEEC_SUCCESS)
+	print_bench(bench_names[mem], size, h, total_ns);
+    }
+  }
+  /* The last echo went straight into out */
+  if ((res == TEEC_SUCCESS) && (memcmp(in, out, BENCH_SIZE_MIN) != 0)) {
+    fprintf(stderr, "The TA echoed other bytes than it was passed\n");
+    res = TEEC_ERROR_GENERIC;
+  }
+  rc = res == TEEC_SUCCESS ? 0 : EXIT_FAILURE;
+  TEEC_CloseSession(&sess);
+
+ out:
+  free(out);
+  free(in);
+  free(h);
+  return rc;
+}
+
+/* Two-sided 95 % quantiles of Student's t-distribution by degrees of freedom */
+static const double t95[] = {
+  12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+  2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+  2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+/* Mean, sample standard deviation and half width of the 95 % CI */
+static void sweep_stats(double *v, unsigned int n, double *mean, double *sd, double *ci)
+{
+  double sum = 0, sq = 0;
+  unsigned int i;
+
+  for (i = 0; i < n; i++)
+    sum += v[i];
+  *mean = sum / n;
+  *sd = 0;
+  *ci = 0;
+  if (n < 2)
+    return;
+  for (i = 0; i < n; i++)
+    sq += (v[i] - *mean) * (v[i] - *mean);
+  *sd = sqrt(sq / (n - 1));
+  *ci = (n - 1 <= sizeof(t95) / sizeof(t95[0]) ? t95[n - 2] : 1.96) * *sd / sqrt(n);
+}
+
+static void sweep_default(struct sweep_list *list, uint32_t v)
+{
+  if (list->n == 0) {
+    list->v[0] = v;
+    list->n = 1;
+  }
+}
+
+/*
+ * Run every combination of the swept block sizes, socket buffer sizes,
+ * protocols and directions a number of times within one session, so that
+ * the points differ in nothing but their parameters. Each point reports
+ * the mean throughput with its spread and appends a row to the sweep's CSV.
+ */
+static int run_sweep(TEEC_Context *ctx, struct iptz_args *defaults, struct ca_args *ca)
+{
+  struct sweep *sw = &ca->sweep;
+  struct session t;
   struct iptz_args *args;
   struct iptz_results *results;
-  struct timespec ta, to;
+  unsigned int il, iw, iu, ir, run;
+  double *mbps, mean, sd, ci;
+  FILE *fp;
+  int rc = 0;
+
+  sweep_default(&sw->l, defaults->blksize);
+  sweep_default(&sw->w, defaults->socket_bufsize);
+  sweep_default(&sw->u, defaults->protocol == IPERFTZ_UDP);
+  sweep_default(&sw->r, defaults->reverse);
+
+  mbps = (double *)calloc(ca->runs, sizeof(*mbps));
+  if (mbps == NULL) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+  fp = fopen("./iperfTZ-sweep.csv", "a");
+  if (fp == NULL) {
+    perror("fopen");
+    free(mbps);
+    return EXIT_FAILURE;
+  }
+
+  memset(&t, 0, sizeof(t));
+  t.ctx = ctx;
+  t.defaults = defaults;
+  if (session_open(&t) != TEEC_SUCCESS) {
+    session_close(&t);
+    fclose(fp);
+    free(mbps);
+    return EXIT_FAILURE;
+  }
+  args = (struct iptz_args *)t.args_sm.buffer;
+  results = (struct iptz_results *)t.results_sm.buffer;
+
+  /*
+   * CSV format:
+   * 1. Block size in bytes
+   * 2. Socket buffer size in bytes
+   * 3. Protocol, 0 for TCP and 1 for UDP
+   * 4. Direction, 0 for the TA sending and 1 for the TA receiving
+   * 5. Number of runs
+   * 6. Mean throughput in Mbit/s
+   * 7. Sample standard deviation in Mbit/s
+   * 8. Half width of the 95 % confidence interval in Mbit/s
+   */
+  for (il = 0; il < sw->l.n; il++)
+    for (iw = 0; iw < sw->w.n; iw++)
+      for (iu = 0; iu < sw->u.n; iu++)
+	for (ir = 0; ir < sw->r.n; ir++) {
+	  memcpy(args, defaults, sizeof(*args));
+	  args->blksize = sw->l.v[il];
+	  args->socket_bufsize = sw->w.v[iw];
+	  args->protocol = sw->u.v[iu] ? IPERFTZ_UDP : IPERFTZ_TCP;
+	  args->reverse = sw->r.v[ir];
+	  for (run = 0; run < ca->runs; run++) {
+	    t.res = TEEC_InvokeCommand(&t.sess, args->reverse ? IPERFTZ_TA_RECV : IPERFTZ_TA_SEND,
+				       &t.op, &t.ret_orig);
+	    if (t.res != TEEC_SUCCESS) {
+	      fprintf(stderr, "TEEC_InvokeCommand failed with code %#" PRIx32 " origin %#" PRIx32 "\n", t.res, t.ret_orig);
+	      rc = EXIT_FAILURE;
+	      goto out;
+	    }
+	    mbps[run] = results->runtime_ns > 0 ? results->bytes_transmitted * 8e3 / results->runtime_ns : 0.0;
+	  }
+	  sweep_stats(mbps, ca->runs, &mean, &sd, &ci);
+	  printf("blksize = %" PRIu32 ", window = %" PRIu32 ", %s %s, runs = %u: %.3f Mbit/s, stddev = %.3f Mbit/s, 95 %% CI = [%.3f, %.3f] Mbit/s\n",
+		 args->blksize, args->socket_bufsize,
+		 args->protocol == IPERFTZ_UDP ? "UDP" : "TCP",
+		 args->reverse ? "receive" : "send",
+		 ca->runs, mean, sd, mean - ci, mean + ci);
+	  fprintf(fp, "%" PRIu32 ",%" PRIu32 ",%u,%u,%u,%.3f,%.3f,%.3f\n",
+		  args->blksize, args->socket_bufsize, sw->u.v[iu] ? 1 : 0, args->reverse ? 1 : 0,
+		  ca->runs, mean, sd, ci);
+	  fflush(fp);
+	}
+
+ out:
+  session_close(&t);
+  fclose(fp);
+  free(mbps);
+  return rc;
+}
+
+int main(int argc, char *argv[])
+{
+  int rc = 0;
+  TEEC_Context ctx;
+  TEEC_Result res;
+  pthread_barrier_t barrier;
+  struct iptz_args args;
+  struct ca_args ca;
+  struct session *threads;
+  struct live live;
+  unsigned int i, started;
+
+  init_args(&args, &ca);
+  if (parse_args(&args, &ca, argv, argc) != 0)
+    return EINVAL;
 
   res = TEEC_InitializeContext(NULL, &ctx);
   if (res != TEEC_SUCCESS) {
     fprintf(stderr, "TEEC_InitializeContext failed with code %#" PRIx32 "\n", res);
     return EXIT_FAILURE;
   }
+  if (ca.bench_calls > 0) {
+    rc = run_bench(&ctx, &ca);
+    TEEC_FinalizeContext(&ctx);
+    return rc;
+  }
+  if (ca.sweeping) {
+    rc = run_sweep(&ctx, &args, &ca);
+    TEEC_FinalizeContext(&ctx);
+    return rc;
+  }
 
-  args_sm.size = sizeof(*args);
-  args_sm.flags = TEEC_MEM_INPUT;
-  res = TEEC_AllocateSharedMemory(&ctx, &args_sm);
-  if (res != TEEC_SUCCESS) {
-    fprintf(stderr, "TEEC_AllocateSharedMemory failed with code %#" PRIx32 "\n", res);
-    rc = EXIT_FAILURE;
-    goto shared_args_err;
+  threads = (struct session *)calloc(ca.threads, sizeof(*threads));
+  if (threads == NULL) {
+    perror("calloc");
+    TEEC_FinalizeContext(&ctx);
+    return EXIT_FAILURE;
   }
-  
-  results_sm.size = sizeof(*results);
-  results_sm.flags = TEEC_MEM_OUTPUT;
-  res = TEEC_AllocateSharedMemory(&ctx, &results_sm);
-  if (res != TEEC_SUCCESS) {
-    fprintf(stderr, "TEEC_AllocateSharedMemory failed with code %#" PRIx32 "\n", res);
-    rc = EXIT_FAILURE;
-    goto shared_results_err;
+  rc = pthread_barrier_init(&barrier, NULL, ca.threads);
+  if (rc != 0) {
+    fprintf(stderr, "pthread_barrier_init: %s\n", strerror(rc));
+    free(threads);
+    TEEC_FinalizeContext(&ctx);
+    return EXIT_FAILURE;
   }
 
-  args = (struct iptz_args *)args_sm.buffer;
-  init_args(args);
-  rc = parse_args(args, argv, argc);
-  if (rc != 0)
-    goto session_err;
+  for (started = 0; started < ca.threads; started++) {
+    threads[started].index = started;
+    threads[started].cpu = ca.ncpus > 0 ? ca.cpus[started % ca.ncpus] : -1;
+    threads[started].ctx = &ctx;
+    threads[started].barrier = &barrier;
+    threads[started].defaults = &args;
+    threads[started].command_id = args.reverse ? IPERFTZ_TA_RECV : IPERFTZ_TA_SEND;
+    threads[started].blocks = ca.blocks;
+    threads[started].runs = ca.runs;
+    threads[started].payload_alloc = ca.payload_alloc;
+    threads[started].payload_size = ca.payload_size;
+    threads[started].counters = ca.counters;
+    rc = pthread_create(&threads[started].thread, NULL, session_thread, &threads[started]);
+    if (rc != 0) {
+      /* The barrier would never fill up */
+      fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+      exit(EXIT_FAILURE);
+    }
+  }
+  rc = 0;
 
-  if (args->reverse)
-    command_id = IPERFTZ_TA_RECV;
-  
-  results = (struct iptz_results *)results_sm.buffer;
-    
-  res = TEEC_OpenSession(&ctx, &sess, &uuid,
-			 TEEC_LOGIN_PUBLIC, NULL, NULL, &ret_orig);
-  if (res != TEEC_SUCCESS) {
-    fprintf(stderr, "TEEC_Opensession failed with code %#" PRIx32 " origin %#" PRIx32 "\n",
-            res, ret_orig);
-    rc = EXIT_FAILURE;
-    goto session_err;
+  live.threads = threads;
+  live.n = ca.threads;
+  live.args = &args;
+  live.stall = ca.stall;
+  live.stop = 0;
+  if (args.telemetry_msec > 0) {
+    rc = pthread_create(&live.thread, NULL, live_thread, &live);
+    if (rc != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+      args.telemetry_msec = 0;
+    }
+    rc = 0;
   }
 
-  memset(&op, 0, sizeof(op));
-  op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_WHOLE, TEEC_MEMREF_WHOLE,
-				   TEEC_NONE, TEEC_NONE);
-  op.params[0].memref.parent = &args_sm;
-  op.params[0].memref.offset = 0;
-  op.params[0].memref.size = args_sm.size;
-  op.params[1].memref.parent = &results_sm;
-  op.params[1].memref.offset = 0;
-  op.params[1].memref.size = results_sm.size;
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i].thread, NULL);
+  if (args.telemetry_msec > 0) {
+    __atomic_store_n(&live.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(live.thread, NULL);
+  }
 
-  clock_gettime(CLOCK_REALTIME, &ta);
-  res = TEEC_InvokeCommand(&sess, command_id, &op, &ret_orig);
-  clock_gettime(CLOCK_REALTIME, &to);
-  if (res != TEEC_SUCCESS) {
-    fprintf(stderr, "TEEC_InvokeCommand failed with code %#" PRIx32 " origin %#" PRIx32, res, ret_orig);
-    rc = EXIT_FAILURE;
-  } else {
-    rc = print_results(results, args, &ta, &to);
+  for (i = 0; i < ca.threads; i++) {
+    if (threads[i].res != TEEC_SUCCESS) {
+      rc = EXIT_FAILURE;
+    } else {
+      if (ca.threads > 1)
+	printf("Thread %u:\n", i);
+      if (threads[i].stalled) {
+	printf("The test was stopped after a stall\n");
+	rc = EXIT_FAILURE;
+      }
+      if (print_results((struct iptz_results *)threads[i].results_sm.buffer, &args,
+			&threads[i].ta, &threads[i].to) != 0)
+	rc = EXIT_FAILURE;
+      if (print_overhead((struct iptz_results *)threads[i].results_sm.buffer, &args,
+			 &threads[i].ta, &threads[i].to) != 0)
+	rc = EXIT_FAILURE;
+      print_cpu(&threads[i], (struct iptz_results *)threads[i].results_sm.buffer);
+      if (threads[i].blocks > 0)
+	print_invokes(&threads[i]);
+      if (threads[i].runs > 1)
+	print_runs(&threads[i]);
+    }
   }
+  if (ca.threads > 1)
+    print_threads(threads, ca.threads);
+  if (args.payload != IPERFTZ_PAYLOAD_TA)
+    printf("payload = %zu B of %s shared memory, %s\n", ca.payload_size,
+	   ca.payload_alloc ? "allocated" : "registered",
+	   args.payload == IPERFTZ_PAYLOAD_COPY ? "copied by the TA" : "used in place by the TA");
 
-  TEEC_CloseSession(&sess);
- session_err:
-  TEEC_ReleaseSharedMemory(&results_sm);
- shared_results_err:
-  TEEC_ReleaseSharedMemory(&args_sm);
- shared_args_err:
+  for (i = 0; i < ca.threads; i++)
+    session_close(&threads[i]);
+  pthread_barrier_destroy(&barrier);
+  free(threads);
   TEEC_FinalizeContext(&ctx);
   
   return rc;
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: glue between the host TEE Client and Internal APIs
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef IPERFTZ_HOST_H
+#define IPERFTZ_HOST_H
+
+/* Cancellation flag of the invocation the calling thread runs, or NULL */
+void host_cancel_flag(int *flag);
+
+#endif /* IPERFTZ_HOST_H */
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: host emulation of the OP-TEE TCP socket ioctls
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef __TEE_TCPSOCKET_DEFINES_EXTENSIONS_H
+#define __TEE_TCPSOCKET_DEFINES_EXTENSIONS_H
+
+/* Socket buffer sizes, set through setsockopt() on the host */
+#define TEE_TCP_SET_RECVBUF 0x65f00000
+#define TEE_TCP_SET_SENDBUF 0x65f00001
+
+#endif /* __TEE_TCPSOCKET_DEFINES_EXTENSIONS_H */
@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: host emulation of the TEE Client API
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TEE_CLIENT_API_H
+#define TEE_CLIENT_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The subset of the GlobalPlatform TEE Client API the CA uses, implemented
+ * in host/teec.c by calling the TA's entry points within the same process.
+ * Shared memory is passed in place, nothing is copied between "worlds".
+ */
+
+typedef uint32_t TEEC_Result;
+
+#define TEEC_SUCCESS               0x00000000
+#define TEEC_ERROR_GENERIC         0xFFFF0000
+#define TEEC_ERROR_ACCESS_DENIED   0xFFFF0001
+#define TEEC_ERROR_CANCEL          0xFFFF0002
+#define TEEC_ERROR_BAD_PARAMETERS  0xFFFF0006
+#define TEEC_ERROR_BAD_STATE       0xFFFF0007
+#define TEEC_ERROR_ITEM_NOT_FOUND  0xFFFF0008
+#define TEEC_ERROR_NOT_SUPPORTED   0xFFFF000A
+#define TEEC_ERROR_OUT_OF_MEMORY   0xFFFF000C
+#define TEEC_ERROR_COMMUNICATION   0xFFFF000E
+
+#define TEEC_ORIGIN_API          0x00000001
+#define TEEC_ORIGIN_COMMS        0x00000002
+#define TEEC_ORIGIN_TEE          0x00000003
+#define TEEC_ORIGIN_TRUSTED_APP  0x00000004
+
+#define TEEC_MEM_INPUT  0x00000001
+#define TEEC_MEM_OUTPUT 0x00000002
+
+#define TEEC_NONE                  0x00000000
+#define TEEC_VALUE_INPUT           0x00000001
+#define TEEC_VALUE_OUTPUT          0x00000002
+#define TEEC_VALUE_INOUT           0x00000003
+#define TEEC_MEMREF_TEMP_INPUT     0x00000005
+#define TEEC_MEMREF_TEMP_OUTPUT    0x00000006
+#define TEEC_MEMREF_TEMP_INOUT     0x00000007
+#define TEEC_MEMREF_WHOLE          0x0000000C
+#define TEEC_MEMREF_PARTIAL_INPUT  0x0000000D
+#define TEEC_MEMREF_PARTIAL_OUTPUT 0x0000000E
+#define TEEC_MEMREF_PARTIAL_INOUT  0x0000000F
+
+#define TEEC_LOGIN_PUBLIC 0x00000000
+
+#define TEEC_PARAM_TYPES(p0, p1, p2, p3) \
+  ((p0) | ((p1) << 4) | ((p2) << 8) | ((p3) << 12))
+#define TEEC_PARAM_TYPE_GET(p, i) (((p) >> ((i) * 4)) & 0xF)
+
+typedef struct {
+  int sessions;
+} TEEC_Context;
+
+typedef struct {
+  uint32_t timeLow;
+  uint16_t timeMid;
+  uint16_t timeHiAndVersion;
+  uint8_t clockSeqAndNode[8];
+} TEEC_UUID;
+
+typedef struct {
+  void *buffer;
+  size_t size;
+  uint32_t flags;
+  int allocated; /* by TEEC_AllocateSharedMemory() */
+} TEEC_SharedMemory;
+
+typedef struct {
+  void *buffer;
+  size_t size;
+} TEEC_TempMemoryReference;
+
+typedef struct {
+  TEEC_SharedMemory *parent;
+  size_t size;
+  size_t offset;
+} TEEC_RegisteredMemoryReference;
+
+typedef struct {
+  uint32_t a;
+  uint32_t b;
+} TEEC_Value;
+
+typedef union {
+  TEEC_TempMemoryReference tmpref;
+  TEEC_RegisteredMemoryReference memref;
+  TEEC_Value value;
+} TEEC_Parameter;
+
+typedef struct {
+  TEEC_Context *ctx;
+  void *ta_session; /* the TA's session context */
+  int cancel;       /* set by TEEC_RequestCancellation() */
+} TEEC_Session;
+
+typedef struct {
+  uint32_t started;
+  uint32_t paramTypes;
+  TEEC_Parameter params[4];
+  TEEC_Session *session;
+} TEEC_Operation;
+
+TEEC_Result TEEC_InitializeContext(const char *name, TEEC_Context *context);
+void TEEC_FinalizeContext(TEEC_Context *context);
+TEEC_Result TEEC_OpenSession(TEEC_Context *context,
+			     TEEC_Session *session,
+			     const TEEC_UUID *destination,
+			     uint32_t connectionMethod,
+			     const void *connectionData,
+			     TEEC_Operation *operation,
+			     uint32_t *returnOrigin);
+void TEEC_CloseSession(TEEC_Session *session);
+TEEC_Result TEEC_InvokeCommand(TEEC_Session *session,
+			       uint32_t commandID,
+			       TEEC_Operation *operation,
+			       uint32_t *returnOrigin);
+TEEC_Result TEEC_RegisterSharedMemory(TEEC_Context *context,
+				      TEEC_SharedMemory *sharedMem);
+TEEC_Result TEEC_AllocateSharedMemory(TEEC_Context *context,
+				      TEEC_SharedMemory *sharedMem);
+void TEEC_ReleaseSharedMemory(TEEC_SharedMemory *sharedMemory);
+void TEEC_RequestCancellation(TEEC_Operation *operation);
+
+#endif /* TEE_CLIENT_API_H */
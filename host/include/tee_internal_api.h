@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: host emulation of the TEE Internal Core API
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TEE_INTERNAL_API_H
+#define TEE_INTERNAL_API_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <trace.h>
+
+/*
+ * The subset of the GlobalPlatform TEE Internal Core API the TA uses,
+ * implemented in host/tee.c on top of libc so that ta/main.c builds and
+ * runs as a normal Linux process.
+ */
+
+typedef uint32_t TEE_Result;
+
+#define TEE_SUCCESS                0x00000000
+#define TEE_ERROR_CANCEL           0xFFFF0002
+#define TEE_ERROR_GENERIC          0xFFFF0000
+#define TEE_ERROR_ACCESS_DENIED    0xFFFF0001
+#define TEE_ERROR_BAD_FORMAT       0xFFFF0005
+#define TEE_ERROR_BAD_PARAMETERS   0xFFFF0006
+#define TEE_ERROR_BAD_STATE        0xFFFF0007
+#define TEE_ERROR_ITEM_NOT_FOUND   0xFFFF0008
+#define TEE_ERROR_NOT_IMPLEMENTED  0xFFFF0009
+#define TEE_ERROR_NOT_SUPPORTED    0xFFFF000A
+#define TEE_ERROR_OUT_OF_MEMORY    0xFFFF000C
+#define TEE_ERROR_COMMUNICATION    0xFFFF000E
+#define TEE_ERROR_SHORT_BUFFER     0xFFFF0010
+#define TEE_ERROR_TIMEOUT          0xFFFF3001
+#define TEE_ERROR_OVERFLOW         0xFFFF300F
+
+#define TEE_PARAM_TYPE_NONE          0
+#define TEE_PARAM_TYPE_VALUE_INPUT   1
+#define TEE_PARAM_TYPE_VALUE_OUTPUT  2
+#define TEE_PARAM_TYPE_VALUE_INOUT   3
+#define TEE_PARAM_TYPE_MEMREF_INPUT  5
+#define TEE_PARAM_TYPE_MEMREF_OUTPUT 6
+#define TEE_PARAM_TYPE_MEMREF_INOUT  7
+
+#define TEE_PARAM_TYPES(t0, t1, t2, t3) \
+  ((t0) | ((t1) << 4) | ((t2) << 8) | ((t3) << 12))
+#define TEE_PARAM_TYPE_GET(t, i) (((t) >> ((i) * 4)) & 0xF)
+
+#define TEE_MALLOC_FILL_ZERO 0x00000000
+#define TEE_MALLOC_NO_FILL   0x00000001
+
+#define TEE_TIMEOUT_INFINITE 0xFFFFFFFF
+
+#ifndef __maybe_unused
+#define __maybe_unused __attribute__((unused))
+#endif
+
+typedef union {
+  struct {
+    void *buffer;
+    uint32_t size;
+  } memref;
+  struct {
+    uint32_t a;
+    uint32_t b;
+  } value;
+} TEE_Param;
+
+typedef struct {
+  uint32_t seconds;
+  uint32_t millis;
+} TEE_Time;
+
+void *TEE_Malloc(uint32_t size, uint32_t hint);
+void *TEE_Realloc(void *buffer, uint32_t newSize);
+void TEE_Free(void *buffer);
+void TEE_MemMove(void *dest, const void *src, uint32_t size);
+void TEE_MemFill(void *buffer, uint32_t x, uint32_t size);
+void TEE_GetSystemTime(TEE_Time *time);
+TEE_Result TEE_Wait(uint32_t timeout);
+bool TEE_GetCancellationFlag(void);
+void TEE_Panic(TEE_Result panicCode) __attribute__((noreturn));
+
+/* Entry points of the TA, called by the host TEE Client API */
+TEE_Result TA_CreateEntryPoint(void);
+void TA_DestroyEntryPoint(void);
+TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
+				    TEE_Param params[4],
+				    void **sess_ctx);
+void TA_CloseSessionEntryPoint(void *sess_ctx);
+TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx,
+				      uint32_t cmd_id,
+				      uint32_t param_types,
+				      TEE_Param params[4]);
+
+#endif /* TEE_INTERNAL_API_H */
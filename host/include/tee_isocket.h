@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: host emulation of the GP Generic Socket interface
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TEE_ISOCKET_H
+#define TEE_ISOCKET_H
+
+#include <stdint.h>
+
+#include <tee_internal_api.h>
+
+typedef void *TEE_iSocketHandle;
+
+typedef struct TEE_iSocket_s {
+  uint32_t TEE_iSocketVersion;
+  uint8_t protocolID;
+  TEE_Result (*open)(TEE_iSocketHandle *ctx, void *setup, uint32_t *protocolError);
+  TEE_Result (*close)(TEE_iSocketHandle ctx);
+  TEE_Result (*send)(TEE_iSocketHandle ctx, const void *buf, uint32_t *length,
+		     uint32_t timeout);
+  TEE_Result (*recv)(TEE_iSocketHandle ctx, void *buf, uint32_t *length,
+		     uint32_t timeout);
+  uint32_t (*error)(TEE_iSocketHandle ctx);
+  TEE_Result (*ioctl)(TEE_iSocketHandle ctx, uint32_t commandCode, void *buf,
+		      uint32_t *length);
+} TEE_iSocket;
+
+#define TEE_ISOCKET_VERSION 0x01000000
+
+#define TEE_ISOCKET_ERROR_PROTOCOL         0xF1007001
+#define TEE_ISOCKET_ERROR_REMOTE_CLOSED    0xF1007002
+#define TEE_ISOCKET_ERROR_TIMEOUT          0xF1007003
+#define TEE_ISOCKET_ERROR_OUT_OF_RESOURCES 0xF1007004
+#define TEE_ISOCKET_ERROR_LARGE_BUFFER     0xF1007005
+#define TEE_ISOCKET_WARNING_PROTOCOL       0xF1007006
+#define TEE_ISOCKET_ERROR_HOSTNAME         0xF1007007
+
+typedef enum TEE_ipSocket_ipVersion_e {
+  TEE_IP_VERSION_DC = 0, /* don't care */
+  TEE_IP_VERSION_4 = 1,
+  TEE_IP_VERSION_6 = 2
+} TEE_ipSocket_ipVersion;
+
+#endif /* TEE_ISOCKET_H */
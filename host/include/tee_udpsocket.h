@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: host emulation of the GP UDP socket
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TEE_UDPSOCKET_H
+#define TEE_UDPSOCKET_H
+
+#include <tee_isocket.h>
+
+typedef struct TEE_udpSocket_Setup_s {
+  TEE_ipSocket_ipVersion ipVersion;
+  char *server_addr;
+  uint16_t server_port;
+} TEE_udpSocket_Setup;
+
+#define TEE_ISOCKET_PROTOCOLID_UDP 0x66
+
+extern TEE_iSocket *const TEE_udpSocket;
+
+#endif /* TEE_UDPSOCKET_H */
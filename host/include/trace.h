@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: host emulation of the TA trace macros
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#ifndef CFG_TEE_TA_LOG_LEVEL
+#define CFG_TEE_TA_LOG_LEVEL 1
+#endif
+
+/* Messages go to stderr, filtered by the TA's log level like in OP-TEE */
+#define TRACE_MSG(level, tag, ...)					\
+  do {									\
+    if (CFG_TEE_TA_LOG_LEVEL >= (level)) {				\
+      fprintf(stderr, tag "/TA: %s:%d ", __func__, __LINE__);		\
+      fprintf(stderr, __VA_ARGS__);					\
+      fputc('\n', stderr);						\
+    }									\
+  } while (0)
+
+#define EMSG(...) TRACE_MSG(1, "E", __VA_ARGS__)
+#define IMSG(...) TRACE_MSG(2, "I", __VA_ARGS__)
+#define DMSG(...) TRACE_MSG(3, "D", __VA_ARGS__)
+#define FMSG(...) TRACE_MSG(4, "F", __VA_ARGS__)
+
+#endif /* TRACE_H */
@@ -0,0 +1,354 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: host emulation of the TEE Internal Core and Socket APIs
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include <tee_internal_api.h>
+#include <tee_tcpsocket.h>
+#include <__tee_tcpsocket_defines_extensions.h>
+#include <tee_udpsocket.h>
+
+#include "host.h"
+
+/* TEE_Wait() checks for cancellation this often */
+#define WAIT_SLICE_MSEC 100
+
+/* A GP socket handle is a connected POSIX socket */
+struct host_socket {
+  int fd;
+  int type;       /* SOCK_STREAM or SOCK_DGRAM */
+  uint32_t error; /* errno of the last failed call */
+};
+
+static __thread int *cancel;
+
+void host_cancel_flag(int *flag)
+{
+  cancel = flag;
+}
+
+void *TEE_Malloc(uint32_t size, uint32_t hint)
+{
+  if (size == 0)
+    size = 1;
+  return hint == TEE_MALLOC_FILL_ZERO ? calloc(1, size) : malloc(size);
+}
+
+void *TEE_Realloc(void *buffer, uint32_t newSize)
+{
+  return realloc(buffer, newSize);
+}
+
+void TEE_Free(void *buffer)
+{
+  free(buffer);
+}
+
+void TEE_MemMove(void *dest, const void *src, uint32_t size)
+{
+  memmove(dest, src, size);
+}
+
+void TEE_MemFill(void *buffer, uint32_t x, uint32_t size)
+{
+  memset(buffer, (int)x, size);
+}
+
+/* Milliseconds since an arbitrary origin, like OP-TEE's system time */
+void TEE_GetSystemTime(TEE_Time *time)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  time->seconds = ts.tv_sec;
+  time->millis = ts.tv_nsec / 1000000;
+}
+
+bool TEE_GetCancellationFlag(void)
+{
+  return (cancel != NULL) && __atomic_load_n(cancel, __ATOMIC_ACQUIRE);
+}
+
+TEE_Result TEE_Wait(uint32_t timeout)
+{
+  struct timespec ts;
+  uint32_t slice;
+
+  while (timeout > 0) {
+    if (TEE_GetCancellationFlag())
+      return TEE_ERROR_CANCEL;
+    slice = timeout < WAIT_SLICE_MSEC ? timeout : WAIT_SLICE_MSEC;
+    ts.tv_sec = 0;
+    ts.tv_nsec = slice * 1000000L;
+    while ((nanosleep(&ts, &ts) == -1) && (errno == EINTR))
+      ;
+    if (timeout != TEE_TIMEOUT_INFINITE)
+      timeout -= slice;
+  }
+
+  return TEE_SUCCESS;
+}
+
+void TEE_Panic(TEE_Result panicCode)
+{
+  fprintf(stderr, "TA panicked with code %#x\n", panicCode);
+  abort();
+}
+
+static TEE_Result sock_fail(struct host_socket *s, int err)
+{
+  s->error = err;
+  switch (err) {
+  case EPIPE:
+  case ECONNRESET:
+    return TEE_ISOCKET_ERROR_REMOTE_CLOSED;
+  case EAGAIN:
+  case ETIMEDOUT:
+    return TEE_ISOCKET_ERROR_TIMEOUT;
+  case ENOBUFS:
+  case ENOMEM:
+    return TEE_ISOCKET_ERROR_OUT_OF_RESOURCES;
+  case EMSGSIZE:
+    return TEE_ISOCKET_ERROR_LARGE_BUFFER;
+  default:
+    return TEE_ISOCKET_ERROR_PROTOCOL;
+  }
+}
+
+static TEE_Result sock_open(TEE_iSocketHandle *ctx,
+			    int type,
+			    TEE_ipSocket_ipVersion version,
+			    const char *addr,
+			    uint16_t port,
+			    uint32_t *protocolError)
+{
+  struct host_socket *s;
+  struct addrinfo hints, *res, *ai;
+  char service[8];
+  int fd = -1;
+  int err = 0;
+  int rc;
+
+  *protocolError = 0;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = version == TEE_IP_VERSION_4 ? AF_INET :
+    (version == TEE_IP_VERSION_6 ? AF_INET6 : AF_UNSPEC);
+  hints.ai_socktype = type;
+  snprintf(service, sizeof(service), "%u", port);
+  rc = getaddrinfo(addr, service, &hints, &res);
+  if (rc != 0) {
+    *protocolError = rc;
+    return TEE_ISOCKET_ERROR_HOSTNAME;
+  }
+
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) {
+      err = errno;
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    err = errno;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd == -1) {
+    *protocolError = err;
+    return TEE_ERROR_COMMUNICATION;
+  }
+
+  s = (struct host_socket *)calloc(1, sizeof(*s));
+  if (s == NULL) {
+    close(fd);
+    return TEE_ERROR_OUT_OF_MEMORY;
+  }
+  s->fd = fd;
+  s->type = type;
+  *ctx = s;
+
+  return TEE_SUCCESS;
+}
+
+static TEE_Result tcp_open(TEE_iSocketHandle *ctx, void *setup, uint32_t *protocolError)
+{
+  TEE_tcpSocket_Setup *tcp = (TEE_tcpSocket_Setup *)setup;
+
+  return sock_open(ctx, SOCK_STREAM, tcp->ipVersion, tcp->server_addr,
+		   tcp->server_port, protocolError);
+}
+
+static TEE_Result udp_open(TEE_iSocketHandle *ctx, void *setup, uint32_t *protocolError)
+{
+  TEE_udpSocket_Setup *udp = (TEE_udpSocket_Setup *)setup;
+
+  return sock_open(ctx, SOCK_DGRAM, udp->ipVersion, udp->server_addr,
+		   udp->server_port, protocolError);
+}
+
+static TEE_Result sock_close(TEE_iSocketHandle ctx)
+{
+  struct host_socket *s = (struct host_socket *)ctx;
+
+  if (s == NULL)
+    return TEE_ERROR_BAD_PARAMETERS;
+  close(s->fd);
+  free(s);
+
+  return TEE_SUCCESS;
+}
+
+/*
+ * Like tee-supplicant, only a finite, non-zero timeout is waited for, the
+ * call itself then blocks on the socket.
+ */
+static TEE_Result sock_wait(struct host_socket *s, short events, uint32_t timeout)
+{
+  struct pollfd pfd;
+  int rc;
+
+  if ((timeout == 0) || (timeout == TEE_TIMEOUT_INFINITE))
+    return TEE_SUCCESS;
+  pfd.fd = s->fd;
+  pfd.events = events;
+  rc = poll(&pfd, 1, timeout);
+  if (rc == -1)
+    return sock_fail(s, errno);
+  if (rc == 0)
+    return TEE_ISOCKET_ERROR_TIMEOUT;
+
+  return TEE_SUCCESS;
+}
+
+static TEE_Result sock_send(TEE_iSocketHandle ctx,
+			    const void *buf,
+			    uint32_t *length,
+			    uint32_t timeout)
+{
+  struct host_socket *s = (struct host_socket *)ctx;
+  TEE_Result res;
+  ssize_t n;
+
+  res = sock_wait(s, POLLOUT, timeout);
+  if (res != TEE_SUCCESS) {
+    *length = 0;
+    return res;
+  }
+  n = send(s->fd, buf, *length, MSG_NOSIGNAL);
+  if (n == -1) {
+    *length = 0;
+    return sock_fail(s, errno);
+  }
+  *length = n;
+
+  return TEE_SUCCESS;
+}
+
+static TEE_Result sock_recv(TEE_iSocketHandle ctx,
+			    void *buf,
+			    uint32_t *length,
+			    uint32_t timeout)
+{
+  struct host_socket *s = (struct host_socket *)ctx;
+  TEE_Result res;
+  ssize_t n;
+
+  res = sock_wait(s, POLLIN, timeout);
+  if (res != TEE_SUCCESS) {
+    *length = 0;
+    return res;
+  }
+  n = recv(s->fd, buf, *length, 0);
+  if (n == -1) {
+    *length = 0;
+    return sock_fail(s, errno);
+  }
+  /* A TCP peer that closed the connection has nothing left to read */
+  if ((n == 0) && (*length > 0) && (s->type == SOCK_STREAM))
+    return TEE_ISOCKET_ERROR_REMOTE_CLOSED;
+  *length = n;
+
+  return TEE_SUCCESS;
+}
+
+static uint32_t sock_error(TEE_iSocketHandle ctx)
+{
+  return ((struct host_socket *)ctx)->error;
+}
+
+static TEE_Result sock_ioctl(TEE_iSocketHandle ctx,
+			     uint32_t commandCode,
+			     void *buf,
+			     uint32_t *length)
+{
+  struct host_socket *s = (struct host_socket *)ctx;
+  int size;
+
+  switch (commandCode) {
+  case TEE_TCP_SET_RECVBUF:
+  case TEE_TCP_SET_SENDBUF:
+    if ((s->type != SOCK_STREAM) || (*length < sizeof(uint32_t)))
+      return TEE_ERROR_BAD_PARAMETERS;
+    size = *(uint32_t *)buf;
+    if (setsockopt(s->fd, SOL_SOCKET,
+		   commandCode == TEE_TCP_SET_RECVBUF ? SO_RCVBUF : SO_SNDBUF,
+		   &size, sizeof(size)) == -1)
+      return sock_fail(s, errno);
+    return TEE_SUCCESS;
+  default:
+    return TEE_ERROR_NOT_SUPPORTED;
+  }
+}
+
+static TEE_iSocket tcp_socket = {
+  TEE_ISOCKET_VERSION,
+  TEE_ISOCKET_PROTOCOLID_TCP,
+  tcp_open,
+  sock_close,
+  sock_send,
+  sock_recv,
+  sock_error,
+  sock_ioctl
+};
+
+static TEE_iSocket udp_socket = {
+  TEE_ISOCKET_VERSION,
+  TEE_ISOCKET_PROTOCOLID_UDP,
+  udp_open,
+  sock_close,
+  sock_send,
+  sock_recv,
+  sock_error,
+  sock_ioctl
+};
+
+TEE_iSocket *const TEE_tcpSocket = &tcp_socket;
+TEE_iSocket *const TEE_udpSocket = &udp_socket;
@@ -0,0 +1,288 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: host emulation of the TEE Client API
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tee_client_api.h>
+#include <tee_internal_api.h>
+
+#include <iperfTZ_ta.h>
+
+#include "host.h"
+
+/*
+ * The TA is linked into the CA's process. Its entry points are called
+ * directly, TA_CreateEntryPoint() once for the process, and each session
+ * keeps its own context like a TA instance on OP-TEE does.
+ */
+static pthread_once_t ta_once = PTHREAD_ONCE_INIT;
+static TEE_Result ta_created;
+
+static void ta_create(void)
+{
+  ta_created = TA_CreateEntryPoint();
+  if (ta_created == TEE_SUCCESS)
+    atexit(TA_DestroyEntryPoint);
+}
+
+TEEC_Result TEEC_InitializeContext(const char *name, TEEC_Context *context)
+{
+  (void)name;
+  if (context == NULL)
+    return TEEC_ERROR_BAD_PARAMETERS;
+  context->sessions = 0;
+
+  return TEEC_SUCCESS;
+}
+
+void TEEC_FinalizeContext(TEEC_Context *context)
+{
+  (void)context;
+}
+
+/* A memory reference of the TA, whose direction follows the shared memory */
+static int memref_type(TEEC_SharedMemory *shm)
+{
+  switch (shm->flags & (TEEC_MEM_INPUT | TEEC_MEM_OUTPUT)) {
+  case TEEC_MEM_INPUT:
+    return TEE_PARAM_TYPE_MEMREF_INPUT;
+  case TEEC_MEM_OUTPUT:
+    return TEE_PARAM_TYPE_MEMREF_OUTPUT;
+  default:
+    return TEE_PARAM_TYPE_MEMREF_INOUT;
+  }
+}
+
+/* Hand the operation's parameters to the TA in place */
+static TEEC_Result params_in(TEEC_Operation *op, uint32_t *types, TEE_Param *params)
+{
+  TEEC_Parameter *p;
+  uint32_t type;
+  size_t size;
+  char *buffer;
+  int i;
+
+  *types = 0;
+  memset(params, 0, 4 * sizeof(*params));
+  if (op == NULL)
+    return TEEC_SUCCESS;
+
+  for (i = 0; i < 4; i++) {
+    p = &op->params[i];
+    type = TEEC_PARAM_TYPE_GET(op->paramTypes, i);
+    switch (type) {
+    case TEEC_NONE:
+      continue;
+    case TEEC_VALUE_INPUT:
+    case TEEC_VALUE_OUTPUT:
+    case TEEC_VALUE_INOUT:
+      params[i].value.a = p->value.a;
+      params[i].value.b = p->value.b;
+      break;
+    case TEEC_MEMREF_TEMP_INPUT:
+    case TEEC_MEMREF_TEMP_OUTPUT:
+    case TEEC_MEMREF_TEMP_INOUT:
+      buffer = (char *)p->tmpref.buffer;
+      size = p->tmpref.size;
+      break;
+    case TEEC_MEMREF_WHOLE:
+      if (p->memref.parent == NULL)
+	return TEEC_ERROR_BAD_PARAMETERS;
+      buffer = (char *)p->memref.parent->buffer;
+      size = p->memref.parent->size;
+      type = memref_type(p->memref.parent);
+      break;
+    case TEEC_MEMREF_PARTIAL_INPUT:
+    case TEEC_MEMREF_PARTIAL_OUTPUT:
+    case TEEC_MEMREF_PARTIAL_INOUT:
+      if ((p->memref.parent == NULL) ||
+	  (p->memref.offset + p->memref.size > p->memref.parent->size))
+	return TEEC_ERROR_BAD_PARAMETERS;
+      buffer = (char *)p->memref.parent->buffer + p->memref.offset;
+      size = p->memref.size;
+      type -= TEEC_MEMREF_PARTIAL_INPUT - TEE_PARAM_TYPE_MEMREF_INPUT;
+      break;
+    default:
+      return TEEC_ERROR_BAD_PARAMETERS;
+    }
+    if (type >= TEE_PARAM_TYPE_MEMREF_INPUT) {
+      if (size > UINT32_MAX)
+	return TEEC_ERROR_BAD_PARAMETERS;
+      params[i].memref.buffer = buffer;
+      params[i].memref.size = size;
+    }
+    *types |= type << (i * 4);
+  }
+
+  return TEEC_SUCCESS;
+}
+
+/* Return what the TA wrote of values and sizes */
+static void params_out(TEEC_Operation *op, TEE_Param *params)
+{
+  TEEC_Parameter *p;
+  int i;
+
+  if (op == NULL)
+    return;
+  for (i = 0; i < 4; i++) {
+    p = &op->params[i];
+    switch (TEEC_PARAM_TYPE_GET(op->paramTypes, i)) {
+    case TEEC_VALUE_OUTPUT:
+    case TEEC_VALUE_INOUT:
+      p->value.a = params[i].value.a;
+      p->value.b = params[i].value.b;
+      break;
+    case TEEC_MEMREF_TEMP_OUTPUT:
+    case TEEC_MEMREF_TEMP_INOUT:
+      p->tmpref.size = params[i].memref.size;
+      break;
+    case TEEC_MEMREF_WHOLE:
+    case TEEC_MEMREF_PARTIAL_OUTPUT:
+    case TEEC_MEMREF_PARTIAL_INOUT:
+      p->memref.size = params[i].memref.size;
+      break;
+    }
+  }
+}
+
+TEEC_Result TEEC_OpenSession(TEEC_Context *context,
+			     TEEC_Session *session,
+			     const TEEC_UUID *destination,
+			     uint32_t connectionMethod,
+			     const void *connectionData,
+			     TEEC_Operation *operation,
+			     uint32_t *returnOrigin)
+{
+  TEEC_UUID uuid = IPERFTZ_TA_UUID;
+  TEE_Param params[4];
+  uint32_t types;
+  TEEC_Result res;
+
+  (void)connectionMethod;
+  (void)connectionData;
+  if (returnOrigin != NULL)
+    *returnOrigin = TEEC_ORIGIN_API;
+  if ((context == NULL) || (session == NULL) || (destination == NULL))
+    return TEEC_ERROR_BAD_PARAMETERS;
+  if (returnOrigin != NULL)
+    *returnOrigin = TEEC_ORIGIN_TEE;
+  if (memcmp(destination, &uuid, sizeof(uuid)) != 0)
+    return TEEC_ERROR_ITEM_NOT_FOUND;
+  pthread_once(&ta_once, ta_create);
+  if (ta_created != TEE_SUCCESS)
+    return ta_created;
+
+  res = params_in(operation, &types, params);
+  if (res != TEEC_SUCCESS)
+    return res;
+  if (returnOrigin != NULL)
+    *returnOrigin = TEEC_ORIGIN_TRUSTED_APP;
+  session->ctx = context;
+  session->ta_session = NULL;
+  session->cancel = 0;
+  res = TA_OpenSessionEntryPoint(types, params, &session->ta_session);
+  if (res != TEEC_SUCCESS)
+    return res;
+  params_out(operation, params);
+  __atomic_add_fetch(&context->sessions, 1, __ATOMIC_RELAXED);
+
+  return TEEC_SUCCESS;
+}
+
+void TEEC_CloseSession(TEEC_Session *session)
+{
+  if (session == NULL)
+    return;
+  TA_CloseSessionEntryPoint(session->ta_session);
+  __atomic_sub_fetch(&session->ctx->sessions, 1, __ATOMIC_RELAXED);
+}
+
+TEEC_Result TEEC_InvokeCommand(TEEC_Session *session,
+			       uint32_t commandID,
+			       TEEC_Operation *operation,
+			       uint32_t *returnOrigin)
+{
+  TEE_Param params[4];
+  uint32_t types;
+  TEEC_Result res;
+
+  if (returnOrigin != NULL)
+    *returnOrigin = TEEC_ORIGIN_API;
+  if (session == NULL)
+    return TEEC_ERROR_BAD_PARAMETERS;
+  res = params_in(operation, &types, params);
+  if (res != TEEC_SUCCESS)
+    return res;
+
+  if (operation != NULL) {
+    operation->session = session;
+    operation->started = 1;
+  }
+  __atomic_store_n(&session->cancel, 0, __ATOMIC_RELEASE);
+  host_cancel_flag(&session->cancel);
+  if (returnOrigin != NULL)
+    *returnOrigin = TEEC_ORIGIN_TRUSTED_APP;
+  res = TA_InvokeCommandEntryPoint(session->ta_session, commandID, types, params);
+  host_cancel_flag(NULL);
+  params_out(operation, params);
+
+  return res;
+}
+
+TEEC_Result TEEC_RegisterSharedMemory(TEEC_Context *context,
+				      TEEC_SharedMemory *sharedMem)
+{
+  if ((context == NULL) || (sharedMem == NULL) || (sharedMem->buffer == NULL))
+    return TEEC_ERROR_BAD_PARAMETERS;
+  sharedMem->allocated = 0;
+
+  return TEEC_SUCCESS;
+}
+
+TEEC_Result TEEC_AllocateSharedMemory(TEEC_Context *context,
+				      TEEC_SharedMemory *sharedMem)
+{
+  if ((context == NULL) || (sharedMem == NULL))
+    return TEEC_ERROR_BAD_PARAMETERS;
+  sharedMem->buffer = calloc(1, sharedMem->size > 0 ? sharedMem->size : 1);
+  if (sharedMem->buffer == NULL)
+    return TEEC_ERROR_OUT_OF_MEMORY;
+  sharedMem->allocated = 1;
+
+  return TEEC_SUCCESS;
+}
+
+void TEEC_ReleaseSharedMemory(TEEC_SharedMemory *sharedMem)
+{
+  if ((sharedMem == NULL) || (sharedMem->buffer == NULL))
+    return;
+  if (sharedMem->allocated)
+    free(sharedMem->buffer);
+  sharedMem->buffer = NULL;
+}
+
+void TEEC_RequestCancellation(TEEC_Operation *operation)
+{
+  if ((operation != NULL) && (operation->session != NULL))
+    __atomic_store_n(&operation->session->cancel, 1, __ATOMIC_RELEASE);
+}
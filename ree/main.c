@@ -18,7 +18,6 @@
  */
 
 #include <errno.h>
-#include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,87 +25,53 @@
 #include <time.h>
 #include <unistd.h>
 
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-
-#include <netinet/tcp.h>
-
-#include <errno.h>
-#include <inttypes.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
+#include <tee_internal_api.h>
 
+#include <iperfTZ_payload.h>
 #include <iperfTZ_ta.h>
 
-struct args {
-  size_t blksize;
-  size_t socket_bufsize;
-  unsigned long int transmit_bytes;
-  unsigned int protocol;
-  unsigned long int bitrate;
-  unsigned int reverse;
-};
+/*
+ * The normal world baseline runs the TA's own test code, ta/main.c, as a
+ * Linux program: its GP sockets map onto POSIX sockets through host/tee.c
+ * and its entry points are called directly. Sending, receiving, pacing
+ * and timing are thus the same code paths in both worlds, and the results
+ * and CSV rows compare one to one with those of the CA.
+ */
 
-static void init_args(struct args *args)
+static void init_args(struct iptz_args *args)
 {
+  memset(args, 0, sizeof(*args));
   args->blksize = TCP_WINDOW_DEFAULT;
   args->socket_bufsize = TCP_WINDOW_DEFAULT;
+  args->port = IPERFTZ_PORT;
+  args->streams = 1;
   args->protocol = IPERFTZ_TCP;
-  args->reverse = 0;
-}
-
-static int rand_fill(struct args *args, void *buffer) {
-  FILE *f;
-
-  f = fopen("/dev/urandom", "r");
-  if (f == NULL) {
-    perror("fopen");
-    return -1;
-  }
-  if (fread(buffer, sizeof(char), args->blksize, f) < args->blksize) {
-    perror("fread");
-    return -1;
-  }
-  if (fclose(f) == EOF) {
-    perror("fclose");
-    return -1;
-  }
-  return 0;
+  args->payload = IPERFTZ_PAYLOAD_TA;
+  args->seed = IPERFTZ_SEED;
 }
 
-static char *init_buffer(struct args *args)
-{
-  char *buffer = (char *)calloc(args->blksize, sizeof(char));
-  if (buffer == NULL)
-    perror("calloc");
-
-  if (args->reverse == 1) {
-    if (rand_fill(args, buffer) == -1) {
-      free(buffer);
-      buffer = NULL;
-    }
-  }
-  
-  return buffer;
-}
-
-static int parse_args(struct args *args,
+static int parse_args(struct iptz_args *args,
 		      char *argv[],
 		      int argc)
 {
   int c;
   int errflg = 0;
+  unsigned long long br;
+  char *end;
   
-  while ((c = getopt(argc, argv, "b:i:l:n:ruw:")) != -1) {
+  while ((c = getopt(argc, argv, "b:ci:l:n:P:p:ruVw:x:")) != -1) {
     switch (c) {
     case 'b':
-      args->bitrate = strtoul(optarg, (char **)NULL, 10);
+      br = strtoull(optarg, &end, 10);
+      args->bitrate = br > UINT32_MAX ? UINT32_MAX : br;
+      if (*end == '/')
+	args->burst = strtoul(end + 1, (char **)NULL, 10);
+      break;
+    case 'c':
+      args->control = 1;
       break;
     case 'i':
-      strncpy(args->ip, optarg, IPERFTZ_ADDRSTRLEN);
+      strncpy(args->ip, optarg, IPERFTZ_ADDRSTRLEN - 1);
       break;
     case 'l':
       args->blksize = strtoul(optarg, (char **)NULL, 10);
@@ -114,12 +79,29 @@ static int parse_args(struct args *args,
     case 'n':
       args->transmit_bytes = strtoul(optarg, (char **)NULL, 10);
       break;
+    case 'P':
+      args->streams = strtoul(optarg, (char **)NULL, 10);
+      if ((args->streams == 0) || (args->streams > IPERFTZ_STREAMS_MAX)) {
+	fprintf(stderr, "Streams must be between 1 and %d\n", IPERFTZ_STREAMS_MAX);
+	errflg++;
+      }
+      break;
+    case 'p':
+      args->port = strtoul(optarg, (char **)NULL, 10);
+      if ((args->port == 0) || (args->port > 65535)) {
+	fprintf(stderr, "Port must be between 1 and 65535\n");
+	errflg++;
+      }
+      break;
     case 'r':
       args->reverse = 1;
       break;
     case 'u':
       args->protocol = IPERFTZ_UDP;
       break;
+    case 'V':
+      args->verify = 1;
+      break;
     case 'w':
       args->socket_bufsize = strtoul(optarg, (char **)NULL, 10);
       if (args->socket_bufsize > ((1L<<30)-(1<<14))) {
@@ -127,6 +109,9 @@ static int parse_args(struct args *args,
 	errflg++;
       }
       break;
+    case 'x':
+      args->seed = strtoul(optarg, (char **)NULL, 0);
+      break;
     case ':':
       fprintf(stderr, "Option -%c requires an operand\n", optopt);
       errflg++;
@@ -136,125 +121,119 @@ static int parse_args(struct args *args,
       errflg++;
     }
   }
+  if (args->ip[0] == '\0') {
+    fprintf(stderr, "The server's address is missing\n");
+    errflg++;
+  }
   if (errflg) {
     errno = EINVAL;
-    fprintf(stderr, "usage: %s -b size -i IP -l size -n size -ru -w size\n", argv[0]);
+    fprintf(stderr, "usage: %s -b rate[/burst] -c -i IP -l size -n size -P streams -p port -r -u -V -w size -x seed\n", argv[0]);
     return EINVAL;
   }
 
   return 0;
 }
 
-static int print_results(struct iptz_results *results, struct args *args)
+/* Same output as the CA, the CSV columns are those of iperfTZ-ca.csv */
+static int print_results(struct iptz_results *results,
+			 struct iptz_args *args,
+			 struct timespec *ta,
+			 struct timespec *to)
 {
+  struct iptz_latency *l = &results->latency;
+  struct iptz_loss *loss = &results->loss;
+  double achieved;
   FILE *fp;
 
-  printf("cycles = %" PRIu32 ", zcycles = %" PRIu32 ", bytes transmitted = %" PRIu32 ", worlds_time = %" PRIu32 ".%.3" PRIu32 " s, runtime = %" PRIu32 ".%.3" PRIu32 " s\n", results->cycles, results->zcycles, results->bytes_transmitted, results->worlds_sec, results->worlds_msec, results->runtime_sec, results->runtime_msec);
+  printf("cycles = %" PRIu32 ", zcycles = %" PRIu32 ", bytes transmitted = %" PRIu32 ", worlds_time = %.9f s, runtime = %.9f s\n", results->cycles, results->zcycles, results->bytes_transmitted, results->worlds_ns / 1e9, results->runtime_ns / 1e9);
+  printf("worlds_time per cycle = %.3f us, clock resolution %" PRIu32 " ns\n",
+	 results->cycles > 0 ? results->worlds_ns / 1e3 / results->cycles : 0.0,
+	 results->clock_res_ns);
+  if (l->count > 0)
+    printf("latency per block: min = %.3f ms, p50 = %.3f ms, p90 = %.3f ms, p99 = %.3f ms, p99.9 = %.3f ms, max = %.3f ms (%" PRIu64 " blocks)\n",
+	   l->min / 1e6, l->p50 / 1e6, l->p90 / 1e6, l->p99 / 1e6, l->p999 / 1e6, l->max / 1e6, l->count);
+  if ((args->protocol == IPERFTZ_UDP) && args->reverse)
+    printf("datagrams: received = %" PRIu64 ", lost = %" PRIu64 "/%" PRIu64 " (%.3f %%), duplicates = %" PRIu64 ", reordered = %" PRIu64 ", jitter = %.3f ms\n",
+	   loss->datagrams, loss->lost, loss->expected,
+	   loss->expected > 0 ? loss->lost * 100.0 / loss->expected : 0.0,
+	   loss->duplicates, loss->reordered, loss->jitter / 1e6);
+  if ((args->bitrate > 0) && !args->reverse) {
+    achieved = results->runtime_ns > 0 ? results->bytes_transmitted * 8e9 / results->runtime_ns : 0;
+    printf("bitrate: target %" PRIu32 " bit/s, achieved %.0f bit/s, error %+.2f %%, pacer slept %" PRIu32 " times for %" PRIu32 " ms\n",
+	   args->bitrate, achieved, (achieved - args->bitrate) * 100 / args->bitrate,
+	   results->pacer_waits, results->pacer_wait_msec);
+  }
+  if (args->verify && args->reverse)
+    printf("verified %s = %" PRIu64 ", mismatches = %" PRIu64 ", verify time = %.3f ms\n",
+	   args->protocol == IPERFTZ_UDP ? "datagrams" : "blocks",
+	   results->verify_blocks, results->verify_errors, results->verify_ns / 1e6);
 
   fp = fopen("./iperfTZ-ree.csv", "a");
   if (fp == NULL) {
     perror("fopen");
     return errno;
   }
-  fprintf(fp, "%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ".%.3" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n", args->blksize >> 10, args->socket_bufsize >> 10, results->bytes_transmitted, results->runtime_sec, results->runtime_msec, results->cycles, results->zcycles);
+  fprintf(fp, "%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ".%.3" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%lli.%09li,%lli.%09li,%" PRIu64 ",%" PRIu64 ",%" PRIu32 "\n", args->blksize >> 10, args->socket_bufsize >> 10, results->bytes_transmitted, results->runtime_sec, results->runtime_msec, results->cycles, results->zcycles, (long long int)ta->tv_sec, ta->tv_nsec, (long long int)to->tv_sec, to->tv_nsec, results->runtime_ns, results->worlds_ns, results->clock_res_ns);
   fclose(fp);
 
   return 0;
 }
 
-static int socket_setup(struct args *args, int *sockfd, int *connection)
-{
-  int fd, val;
-  int sock_type = SOCK_STREAM;
-  struct sockaddr_in server_addr;
-  in_port_t port = 5002;
-
-  if (args->protocol == IPERFTZ_UDP)
-    sock_type = SOCK_DGRAM;
-  
-  *sockfd = socket(AF_INET, sock_type, 0);
-  if (*sockfd == -1) {
-    perror("socket");
-    return *sockfd;
-  }
-
-  if (args->protocol == IPERFTZ_TCP) {
-    if (setsockopt(*sockfd, SOL_SOCKET, SO_SNDBUF, &args->socket_bufsize, sizeof(args->socket_bufsize)) == -1) {
-      perror("setsockopt");
-      return -1;
-    }
-  }
-  
-  memset(&server_addr, 0, sizeof(server_addr));
-
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  server_addr.sin_port = htons(port);
-  if (bind(*sockfd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
-    perror("bind");
-    return -1;
-  }
-
-  if (args->protocol == IPERFTZ_TCP) {
-    if (tcp_connect(&server_addr, connection, *sockfd) != 0)
-      return -1;
-    fd = *connection;
-  } else {
-    fd = *sockfd;
-  }
-
-  if ((val = fcntl(fd, F_GETFD, 0)) == -1) {
-    perror("fcntl");
-    return -1;
-  }
-
-  val |= O_NONBLOCK;
-  
-  if ((val = fcntl(fd, F_SETFL, val)) == -1) {
-    perror("fcntl");
-    return -1;
-  }
-
-  return 0;
-}
-
 int main(int argc, char *argv[])
 {
-  char *buffer;
-  int rc = EXIT_SUCCESS;
-  int connection, sockfd;
-  struct args args;
-  struct iptz_results results;
-  
+  int rc;
+  struct iptz_args args;
+  struct iptz_results *results;
+  struct timespec ta, to;
+  TEE_Param params[4];
+  TEE_Result res;
+  void *sess;
+
   init_args(&args);
   rc = parse_args(&args, argv, argc);
   if (rc != 0)
     return rc;
 
-  buffer = init_buffer(&args);
-  if (buffer == NULL)
+  results = (struct iptz_results *)calloc(1, sizeof(*results));
+  if (results == NULL) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+
+  res = TA_CreateEntryPoint();
+  if (res == TEE_SUCCESS) {
+    memset(params, 0, sizeof(params));
+    res = TA_OpenSessionEntryPoint(TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE, TEE_PARAM_TYPE_NONE,
+						   TEE_PARAM_TYPE_NONE, TEE_PARAM_TYPE_NONE),
+				   params, &sess);
+  }
+  if (res != TEE_SUCCESS) {
+    fprintf(stderr, "Opening the test failed with code %#" PRIx32 "\n", res);
+    free(results);
     return EXIT_FAILURE;
+  }
 
-  rc = socket_setup(&args, &sockfd, &connection);
-  if (rc != 0)
-    goto cleanup;
-  
-  if (args->reverse)
-    command_id = IPERFTZ_TA_RECV;
-  
-  res = TEEC_InvokeCommand(&sess, command_id, &op, &ret_orig);
-  if (res != TEEC_SUCCESS) {
-    fprintf(stderr, "TEEC_InvokeCommand failed with code %#" PRIx32 " origin %#" PRIx32, res, ret_orig);
+  params[0].memref.buffer = &args;
+  params[0].memref.size = sizeof(args);
+  params[1].memref.buffer = results;
+  params[1].memref.size = sizeof(*results);
+  clock_gettime(CLOCK_REALTIME, &ta);
+  res = TA_InvokeCommandEntryPoint(sess, args.reverse ? IPERFTZ_TA_RECV : IPERFTZ_TA_SEND,
+				   TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+						   TEE_PARAM_TYPE_MEMREF_OUTPUT,
+						   TEE_PARAM_TYPE_NONE, TEE_PARAM_TYPE_NONE),
+				   params);
+  clock_gettime(CLOCK_REALTIME, &to);
+  if (res != TEE_SUCCESS) {
+    fprintf(stderr, "The test failed with code %#" PRIx32 "\n", res);
     rc = EXIT_FAILURE;
   } else {
-    rc = print_results(results, args);
+    rc = print_results(results, &args, &ta, &to);
   }
 
- cleanup:
-  free(buffer);
-  if (args.protocol == IPERFTZ_TCP)
-    close(connection);
-  close(sockfd);
-  
+  TA_CloseSessionEntryPoint(sess);
+  TA_DestroyEntryPoint();
+  free(results);
+
   return rc;
 }
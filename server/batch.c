@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: batched UDP I/O
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "server.h"
+
+#define UDP_GSO_BYTES 65000  /* payload of one GSO send */
+#define UDP_GSO_SEGS  64     /* segments the kernel accepts per GSO send */
+#define UDP_GRO_BYTES 65536  /* largest coalesced datagram */
+
+/*
+ * Batched UDP I/O moves up to depth messages per recvmmsg()/sendmmsg().
+ * With GSO every sent message carries several datagrams that the kernel
+ * segments, with GRO the kernel hands over several datagrams of a peer
+ * as one message. Every message has a buffer of its own, as the header
+ * of each datagram is written before sending and read after receiving.
+ */
+int udp_batch_open(struct udp_batch *b,
+		   struct args *args,
+		   int fd,
+		   unsigned int reverse,
+		   char *block)
+{
+  int segsize = args->blksize;
+  int on = 1;
+  unsigned int i, j;
+
+  memset(b, 0, sizeof(*b));
+  b->depth = args->batch;
+  b->blksize = args->blksize;
+  b->segs = 1;
+
+  if (args->gso && reverse) {
+    b->segs = UDP_GSO_BYTES / args->blksize;
+    if (b->segs > UDP_GSO_SEGS)
+      b->segs = UDP_GSO_SEGS;
+    if (b->segs < 2) {
+      b->segs = 1;
+    } else if (setsockopt(fd, SOL_UDP, UDP_SEGMENT, &segsize, sizeof(segsize)) == -1) {
+      perror("setsockopt");
+      fprintf(stderr, "Sending without UDP GSO\n");
+      b->segs = 1;
+    }
+  } else if (args->gso) {
+    if (setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == -1) {
+      perror("setsockopt");
+      fprintf(stderr, "Receiving without UDP GRO\n");
+    } else {
+      b->gro = 1;
+    }
+  }
+
+  b->msgsize = b->gro ? UDP_GRO_BYTES : b->segs * args->blksize;
+  b->buffer = (char *)malloc(b->depth * b->msgsize);
+  b->msgs = (struct mmsghdr *)calloc(b->depth, sizeof(*b->msgs));
+  b->iovs = (struct iovec *)calloc(b->depth, sizeof(*b->iovs));
+  b->addrs = (struct sockaddr_in *)calloc(b->depth, sizeof(*b->addrs));
+  b->control = (char *)calloc(b->depth, UDP_BATCH_CMSG);
+  if ((b->buffer == NULL) || (b->msgs == NULL) || (b->iovs == NULL) ||
+      (b->addrs == NULL) || (b->control == NULL)) {
+    perror("calloc");
+    udp_batch_close(b);
+    return -1;
+  }
+
+  /* A GSO message repeats the block once per segment */
+  if (reverse)
+    for (i = 0; i < b->depth; i++)
+      for (j = 0; j < b->segs; j++)
+	memcpy(b->buffer + i * b->msgsize + j * args->blksize, block, args->blksize);
+
+  for (i = 0; i < b->depth; i++) {
+    b->iovs[i].iov_base = b->buffer + i * b->msgsize;
+    b->iovs[i].iov_len = b->msgsize;
+    b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
+    b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+  }
+
+  return 0;
+}
+
+void udp_batch_close(struct udp_batch *b)
+{
+  free(b->buffer);
+  free(b->msgs);
+  free(b->iovs);
+  free(b->addrs);
+  free(b->control);
+  b->buffer = NULL;
+  b->msgs = NULL;
+  b->iovs = NULL;
+  b->addrs = NULL;
+  b->control = NULL;
+}
+
+/*
+ * Receive a batch without blocking. Returns the number of messages, whose
+ * sizes, senders and datagram counts and the batch's total size are then
+ * available through b, or -1.
+ */
+int udp_batch_recv(struct udp_batch *b, int fd)
+{
+  unsigned int i;
+  int n;
+
+  for (i = 0; i < b->depth; i++) {
+    b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+    b->msgs[i].msg_hdr.msg_control = b->gro ? b->control + i * UDP_BATCH_CMSG : NULL;
+    b->msgs[i].msg_hdr.msg_controllen = b->gro ? UDP_BATCH_CMSG : 0;
+    b->msgs[i].msg_hdr.msg_flags = 0;
+  }
+
+  n = recvmmsg(fd, b->msgs, b->depth, MSG_DONTWAIT, NULL);
+  b->bytes = 0;
+  if (n > 0) {
+    b->syscalls++;
+    for (i = 0; i < (unsigned int)n; i++) {
+      b->bytes += b->msgs[i].msg_len;
+      b->datagrams += udp_batch_segments(b, i);
+    }
+  }
+
+  return n;
+}
+
+/* Size of the datagrams the kernel coalesced into the i-th received message */
+static unsigned int udp_batch_segsize(struct udp_batch *b, unsigned int i)
+{
+  struct cmsghdr *cm;
+  int gso_size;
+
+  if (!b->gro)
+    return b->msgs[i].msg_len;
+  for (cm = CMSG_FIRSTHDR(&b->msgs[i].msg_hdr); cm != NULL;
+       cm = CMSG_NXTHDR(&b->msgs[i].msg_hdr, cm)) {
+    if ((cm->cmsg_level == SOL_UDP) && (cm->cmsg_type == UDP_GRO)) {
+      memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+      if (gso_size > 0)
+	return gso_size;
+    }
+  }
+  return b->msgs[i].msg_len;
+}
+
+/* Datagrams the kernel coalesced into the i-th received message */
+unsigned int udp_batch_segments(struct udp_batch *b, unsigned int i)
+{
+  unsigned int segsize = udp_batch_segsize(b, i);
+
+  if (segsize == 0)
+    return 1;
+  return (b->msgs[i].msg_len + segsize - 1) / segsize;
+}
+
+/* Account the datagrams of the i-th received message */
+void udp_batch_track(struct udp_batch *b,
+		     unsigned int i,
+		     struct iptz_udp *u,
+		     long long now)
+{
+  char *msg = (char *)b->iovs[i].iov_base;
+  unsigned int len = b->msgs[i].msg_len;
+  unsigned int segsize = udp_batch_segsize(b, i);
+  unsigned int off;
+
+  if (segsize == 0)
+    return;
+  for (off = 0; off < len; off += segsize)
+    udp_track(u, msg + off, len - off < segsize ? len - off : segsize, now);
+}
+
+/* Check the datagrams of the i-th received message against the pattern */
+void udp_batch_verify(struct udp_batch *b, unsigned int i, struct iptz_verify *v)
+{
+  char *msg = (char *)b->iovs[i].iov_base;
+  unsigned int len = b->msgs[i].msg_len;
+  unsigned int segsize = udp_batch_segsize(b, i);
+  unsigned int off;
+
+  if (segsize == 0)
+    return;
+  for (off = 0; off < len; off += segsize)
+    verify_datagram(v, msg + off, len - off < segsize ? len - off : segsize);
+}
+
+/*
+ * Send up to count messages of b->segs blocks each to peer without
+ * blocking, numbering the datagrams from *seq on. Returns the number of
+ * bytes sent or -1. With MSG_ZEROCOPY a header may be rewritten while the
+ * kernel still holds the previous datagram, which the receiver then
+ * counts as one lost and one duplicate datagram.
+ */
+ssize_t udp_batch_send(struct udp_batch *b,
+		       int fd,
+		       struct zc_tx *tx,
+		       struct sockaddr_in *peer,
+		       unsigned int count,
+		       uint32_t *seq)
+{
+  ssize_t bytes = 0;
+  long long now = now_ns();
+  unsigned int i, j;
+  int n;
+
+  if (count > b->depth)
+    count = b->depth;
+  for (i = 0; i < count; i++) {
+    if (b->blksize >= UDP_HDR_LEN)
+      for (j = 0; j < b->segs; j++)
+	udp_stamp((char *)b->iovs[i].iov_base + j * b->blksize, *seq + i * b->segs + j, now);
+    b->addrs[i] = *peer;
+    b->msgs[i].msg_hdr.msg_namelen = sizeof(*peer);
+    b->msgs[i].msg_hdr.msg_control = NULL;
+    b->msgs[i].msg_hdr.msg_controllen = 0;
+  }
+
+  n = sendmmsg(fd, b->msgs, count, tx->mode == ZC_MSG ? MSG_ZEROCOPY : 0);
+  if (n == -1) {
+    if ((errno == ENOBUFS) && (tx->mode == ZC_MSG)) {
+      zc_tx_complete(tx, fd);
+      errno = EAGAIN;
+    }
+    return -1;
+  }
+
+  b->syscalls++;
+  for (i = 0; i < (unsigned int)n; i++) {
+    bytes += b->msgs[i].msg_len;
+    b->datagrams += (b->msgs[i].msg_len + b->blksize - 1) / b->blksize;
+  }
+  *seq += n * b->segs;
+  if (tx->mode == ZC_MSG) {
+    tx->sends += n;
+    zc_tx_complete(tx, fd);
+  }
+
+  return bytes;
+}
+
+void udp_print(struct iptz_udp *u)
+{
+  struct iptz_loss l;
+
+  udp_summary(u, &l);
+  printf("datagrams received: %llu, lost: %llu/%llu (%.3f %%), duplicates: %llu, reordered: %llu, jitter: %llu ns\n",
+	 (unsigned long long)l.datagrams, (unsigned long long)l.lost,
+	 (unsigned long long)l.expected, l.expected > 0 ? l.lost * 100.0 / l.expected : 0.0,
+	 (unsigned long long)l.duplicates, (unsigned long long)l.reordered,
+	 (unsigned long long)l.jitter);
+}
+
+void udp_batch_print(struct udp_batch *b)
+{
+  printf("UDP batching: depth %u, %s, %llu datagrams in %llu syscalls, %.2f datagrams/syscall\n",
+	 b->depth, b->segs > 1 ? "GSO" : (b->gro ? "GRO" : "no offload"),
+	 b->datagrams, b->syscalls,
+	 b->syscalls > 0 ? (double)b->datagrams / b->syscalls : 0.0);
+}
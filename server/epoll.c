@@ -0,0 +1,485 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: event-driven multi-client server engine
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <iperfTZ_ta.h>
+
+#include "server.h"
+
+#define MAX_EVENTS 64
+#define BURST 64           /* I/O calls per flow and wakeup */
+#define TICK_NS 1000000LL  /* housekeeping period */
+#define WAIT_NS 100000000LL /* longest wait for events */
+
+/*
+ * End the measurement of a flow. TCP senders are closed right away unless
+ * zero-copy completions are still outstanding.
+ */
+static void flow_finish(struct worker *w, struct flow *f, long long now)
+{
+  struct epoll_event ev;
+
+  flow_end(w, f, now);
+
+  if ((f->protocol != IPERFTZ_TCP) || !f->reverse)
+    return;
+  zc_tx_complete(&f->tx, f->fd);
+  if (f->tx.completions < f->tx.sends) {
+    /* Only error queue notifications and hang-ups from now on */
+    ev.events = 0;
+    ev.data.ptr = f;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, f->fd, &ev) == 0)
+      return;
+    perror("epoll_ctl");
+  }
+  flow_free(w, f);
+}
+
+static int udp_arm(struct worker *w, unsigned int out)
+{
+  struct epoll_event ev;
+
+  if (w->udp_out == out)
+    return 0;
+  ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+  ev.data.ptr = &w->udpfd;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, w->udpfd, &ev) == -1) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  w->udp_out = out;
+  return 0;
+}
+
+/* Stop polling a sender for writability until the pacer lets it send at due */
+static void flow_throttle(struct worker *w,
+			  struct flow *f,
+			  unsigned int on,
+			  long long due)
+{
+  struct epoll_event ev;
+
+  if (on) {
+    pacer_slept(&f->pacer, due - now_ns());
+    f->due_ns = due;
+    if ((w->throttled == 0) || (due < w->wake_ns))
+      w->wake_ns = due;
+  }
+  if (f->throttled == on)
+    return;
+  f->throttled = on;
+  if (on)
+    w->throttled++;
+  else
+    w->throttled--;
+
+  if (f->protocol == IPERFTZ_TCP) {
+    ev.events = EPOLLRDHUP | (on ? 0 : EPOLLOUT);
+    ev.data.ptr = f;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, f->fd, &ev) == -1)
+      perror("epoll_ctl");
+  } else if (!on) {
+    udp_arm(w, 1);
+  }
+}
+
+static void tcp_accept(struct worker *w, long long now)
+{
+  struct epoll_event ev;
+  struct flow *f;
+  struct sockaddr_in peer;
+  socklen_t addrlen;
+  int fd;
+
+  for (;;) {
+    addrlen = sizeof(peer);
+    fd = accept4(w->listenfd, (struct sockaddr *)&peer, &addrlen, SOCK_NONBLOCK);
+    if (fd == -1) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+	perror("accept4");
+      return;
+    }
+
+    f = flow_new(w, fd, IPERFTZ_TCP, &peer, now);
+    if (f == NULL) {
+      close(fd);
+      continue;
+    }
+    if (f->reverse)
+      zc_tx_open(&f->tx, w->args, fd, IPERFTZ_TCP, w->buffer);
+    else
+      zc_rx_open(&f->rx, w->args, fd, w->buffer);
+    ev.events = EPOLLRDHUP | (f->reverse ? EPOLLOUT : EPOLLIN);
+    ev.data.ptr = f;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      perror("epoll_ctl");
+      flow_free(w, f);
+    }
+  }
+}
+
+static void tcp_recv_event(struct worker *w, struct flow *f)
+{
+  long long ti, tj;
+  ssize_t n;
+  int i;
+
+  for (i = 0; i < BURST; i++) {
+    ti = now_ns();
+    n = zc_rx_read(&f->rx, f->fd);
+    tj = now_ns();
+    if (n == -1) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+	return;
+      perror("read");
+      break;
+    }
+    if (n == 0)
+      break;
+    if (f->state == FLOW_DRAIN)
+      continue;
+    flow_account(f, n, ti, tj);
+    if (flow_done(w->args, f, tj))
+      flow_finish(w, f, tj);
+  }
+  if (i == BURST)
+    return;
+
+  /* The peer closed the connection or an error occurred */
+  if (f->state == FLOW_ACTIVE)
+    flow_finish(w, f, now_ns());
+  flow_free(w, f);
+}
+
+static void tcp_send_event(struct worker *w, struct flow *f, uint32_t events)
+{
+  long long ti, tj, delay;
+  ssize_t n;
+  int i;
+
+  if (events & EPOLLERR) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    /* Zero-copy notifications raise EPOLLERR without a socket error */
+    zc_tx_complete(&f->tx, f->fd);
+    if ((getsockopt(f->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) || (err != 0))
+      events |= EPOLLHUP;
+  }
+  if (f->state == FLOW_DRAIN) {
+    if ((f->tx.completions >= f->tx.sends) || (events & EPOLLHUP))
+      flow_free(w, f);
+    return;
+  }
+  if (events & (EPOLLHUP | EPOLLRDHUP)) {
+    flow_finish(w, f, now_ns());
+    return;
+  }
+
+  for (i = 0; i < BURST; i++) {
+    ti = now_ns();
+    delay = pacer_delay(&f->pacer, w->args->blksize, ti);
+    if (delay > 0) {
+      flow_throttle(w, f, 1, ti + delay);
+      return;
+    }
+    n = zc_tx_send(&f->tx, f->fd, w->args->blksize, NULL, 0);
+    tj = now_ns();
+    if (n == -1) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+	return;
+      perror("write");
+      flow_finish(w, f, tj);
+      return;
+    }
+    pacer_consume(&f->pacer, n);
+    flow_account(f, n, ti, tj);
+    if (flow_done(w->args, f, tj)) {
+      flow_finish(w, f, tj);
+      return;
+    }
+  }
+}
+
+static void udp_recv_event(struct worker *w)
+{
+  struct flow *f;
+  struct sockaddr_in *peer;
+  long long ti, tj, share;
+  unsigned int i;
+  int j, n;
+
+  for (i = 0; i < BURST; i += n) {
+    ti = now_ns();
+    n = udp_batch_recv(&w->batch, w->udpfd);
+    tj = now_ns();
+    if (n == -1) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+	perror("recvmmsg");
+      return;
+    }
+    if (n == 0)
+      return;
+
+    /* The messages of a batch share the cost of the call */
+    share = (tj - ti) / n;
+    for (j = 0; j < n; j++) {
+      peer = &w->batch.addrs[j];
+      f = udp_lookup(w, peer);
+      if (f == NULL) {
+	f = flow_new(w, w->udpfd, IPERFTZ_UDP, peer, tj);
+	if (f == NULL)
+	  continue;
+	/* The first datagram of a sending peer only announces it */
+	if (f->reverse) {
+	  udp_arm(w, 1);
+	  continue;
+	}
+      }
+      if ((f->state == FLOW_DRAIN) || f->reverse) {
+	f->last_ns = tj;
+	continue;
+      }
+      flow_account(f, w->batch.msgs[j].msg_len, ti, ti + share);
+      f->last_ns = tj;
+      f->datagrams += udp_batch_segments(&w->batch, j);
+      udp_batch_track(&w->batch, j, &f->udp, tj);
+      if (flow_done(w->args, f, tj))
+	flow_finish(w, f, tj);
+    }
+  }
+}
+
+static void udp_send_event(struct worker *w)
+{
+  struct flow *f, *next;
+  long long ti, tj, delay;
+  unsigned int senders;
+  ssize_t n;
+  int i;
+
+  for (i = 0; i < BURST; i++) {
+    senders = 0;
+    for (f = w->flows; f != NULL; f = next) {
+      next = f->next;
+      if ((f->protocol != IPERFTZ_UDP) || !f->reverse ||
+	  (f->state != FLOW_ACTIVE) || f->throttled)
+	continue;
+      ti = now_ns();
+      delay = pacer_delay(&f->pacer, w->batch.msgsize, ti);
+      if (delay > 0) {
+	flow_throttle(w, f, 1, ti + delay);
+	continue;
+      }
+      n = udp_batch_send(&w->batch, w->udpfd, &w->udp_tx, &f->peer,
+			 pacer_count(&f->pacer, w->batch.msgsize,
+				     batch_count(w->args, &w->batch, f->bytes)),
+			 &f->seq);
+      tj = now_ns();
+      if (n == -1) {
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+	  return;
+	perror("sendmmsg");
+	flow_finish(w, f, tj);
+	continue;
+      }
+      pacer_consume(&f->pacer, n);
+      flow_account(f, n, ti, tj);
+      f->datagrams += (n + w->args->blksize - 1) / w->args->blksize;
+      if (flow_done(w->args, f, tj))
+	flow_finish(w, f, tj);
+      else
+	senders++;
+    }
+    if (senders == 0) {
+      udp_arm(w, 0);
+      return;
+    }
+  }
+}
+
+/* Time-based state changes that no socket event reports */
+static void worker_tick(struct worker *w, long long now)
+{
+  struct flow *f, *next;
+  long long wake = now + WAIT_NS;
+
+  for (f = w->flows; f != NULL; f = next) {
+    next = f->next;
+    if (f->state == FLOW_ACTIVE) {
+      if (f->reverse) {
+	if (flow_done(w->args, f, now))
+	  flow_finish(w, f, now);
+	else if (f->throttled && (now >= f->due_ns))
+	  flow_throttle(w, f, 0, 0);
+	else if (f->throttled && (f->due_ns < wake))
+	  wake = f->due_ns;
+      } else if (flow_done(w->args, f, now)) {
+	flow_finish(w, f, now);
+      } else if ((f->protocol == IPERFTZ_UDP) &&
+		 (now - f->last_ns >= DRAIN_NS)) {
+	/* The peer stopped sending before the test was over */
+	flow_finish(w, f, f->last_ns);
+      }
+    } else if (((f->protocol == IPERFTZ_TCP) && (now - f->end_ns >= DRAIN_NS)) ||
+	       ((f->protocol == IPERFTZ_UDP) && (now - f->last_ns >= DRAIN_NS))) {
+      flow_free(w, f);
+    }
+  }
+  w->wake_ns = wake;
+}
+
+static int epoll_setup(struct worker *w)
+{
+  struct epoll_event ev;
+
+  w->epfd = epoll_create1(0);
+  if (w->epfd == -1) {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  if (w->args->reverse)
+    zc_tx_open(&w->udp_tx, w->args, w->udpfd, IPERFTZ_UDP, w->buffer);
+  if (udp_batch_open(&w->batch, w->args, w->udpfd, w->args->reverse, w->buffer) == -1)
+    return -1;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &w->listenfd;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listenfd, &ev) == -1) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = &w->udpfd;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->udpfd, &ev) == -1) {
+    perror("epoll_ctl");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void epoll_cleanup(struct worker *w)
+{
+  long long now = now_ns();
+
+  while (w->flows != NULL) {
+    if (w->flows->state == FLOW_ACTIVE)
+      flow_finish(w, w->flows, now);
+    /* flow_finish() already released TCP senders */
+    if ((w->flows != NULL) && (w->flows->state == FLOW_DRAIN))
+      flow_free(w, w->flows);
+  }
+  if (w->udp_tx.sends > 0) {
+    zc_tx_finish(&w->udp_tx, w->udpfd);
+    printf("worker %u UDP ", w->index);
+    zc_tx_print(&w->udp_tx);
+  }
+  if (w->batch.syscalls > 0) {
+    printf("worker %u ", w->index);
+    udp_batch_print(&w->batch);
+  }
+  udp_batch_close(&w->batch);
+  zc_tx_close(&w->udp_tx);
+  if (w->epfd != -1)
+    close(w->epfd);
+}
+
+static int epoll_run(struct worker *w)
+{
+  struct epoll_event events[MAX_EVENTS];
+  struct timespec timeout;
+  struct flow *f;
+  long long now, wait, tick = 0;
+  int i, n, rc = 0;
+
+  while (!server_stop) {
+    /* Throttled senders wake up when their pacer is due */
+    wait = WAIT_NS;
+    if (w->throttled > 0) {
+      wait = w->wake_ns - now_ns();
+      if (wait < 0)
+	wait = 0;
+      else if (wait > WAIT_NS)
+	wait = WAIT_NS;
+    }
+    timeout.tv_sec = wait / 1000000000LL;
+    timeout.tv_nsec = wait % 1000000000LL;
+    n = epoll_pwait2(w->epfd, events, MAX_EVENTS, &timeout, NULL);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("epoll_pwait2");
+      rc = errno;
+      break;
+    }
+
+    now = now_ns();
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == &w->listenfd) {
+	tcp_accept(w, now);
+      } else if (events[i].data.ptr == &w->udpfd) {
+	if (events[i].events & EPOLLERR)
+	  zc_tx_complete(&w->udp_tx, w->udpfd);
+	if (events[i].events & EPOLLIN)
+	  udp_recv_event(w);
+	if (events[i].events & EPOLLOUT)
+	  udp_send_event(w);
+      } else {
+	f = (struct flow *)events[i].data.ptr;
+	if (f->reverse)
+	  tcp_send_event(w, f, events[i].events);
+	else
+	  tcp_recv_event(w, f);
+      }
+    }
+
+    now = now_ns();
+    if ((now - tick >= TICK_NS) || ((w->throttled > 0) && (now >= w->wake_ns))) {
+      worker_tick(w, now);
+      tick = now;
+    }
+  }
+
+  return rc;
+}
+
+static const struct engine_ops epoll_engine = {
+  .name = "epoll",
+  .setup = epoll_setup,
+  .run = epoll_run,
+  .cleanup = epoll_cleanup,
+};
+
+int epoll_serve(struct args *args)
+{
+  return workers_serve(args, &epoll_engine);
+}
@@ -0,0 +1,482 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: flows and worker threads of the multi-client engines
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <iperfTZ_ta.h>
+
+#include "server.h"
+
+volatile sig_atomic_t server_stop;
+
+static void on_signal(int sig)
+{
+  (void)sig;
+  server_stop = 1;
+}
+
+static unsigned int udp_hash(struct sockaddr_in *peer)
+{
+  uint32_t h = peer->sin_addr.s_addr ^ ((uint32_t)peer->sin_port << 16);
+
+  h ^= h >> 16;
+  h *= 0x45d9f3bU;
+  h ^= h >> 16;
+  return h % UDP_HASH_SIZE;
+}
+
+struct flow *udp_lookup(struct worker *w, struct sockaddr_in *peer)
+{
+  struct flow *f;
+
+  for (f = w->udp_hash[udp_hash(peer)]; f != NULL; f = f->hnext)
+    if ((f->peer.sin_addr.s_addr == peer->sin_addr.s_addr) &&
+	(f->peer.sin_port == peer->sin_port))
+      return f;
+  return NULL;
+}
+
+struct flow *flow_new(struct worker *w,
+		      int fd,
+		      unsigned int protocol,
+		      struct sockaddr_in *peer,
+		      long long now)
+{
+  struct flow *f;
+
+  f = (struct flow *)calloc(1, sizeof(*f));
+  if (f == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  f->fd = fd;
+  f->worker = w->index;
+  f->id = w->nflows++;
+  f->protocol = protocol;
+  f->reverse = w->args->reverse;
+  f->state = FLOW_ACTIVE;
+  f->peer = *peer;
+  f->start_ns = now;
+  f->last_ns = now;
+  hist_init(&f->hist);
+  udp_init(&f->udp);
+  if (w->args->interval_ns > 0) {
+    char tag[32];
+
+    snprintf(tag, sizeof(tag), "[%u.%u] ", f->worker, f->id);
+    interval_init(&f->iv, w->args, tag);
+    if ((protocol == IPERFTZ_UDP) && !f->reverse)
+      f->iv.udp = &f->udp;
+  }
+  if (f->reverse) {
+    size_t len = protocol == IPERFTZ_UDP ? w->batch.msgsize : 0;
+
+    /* One GSO message of the epoll engine has to fit into the bucket */
+    if (len < w->args->blksize)
+      len = w->args->blksize;
+    pacer_init(&f->pacer,
+	       (protocol == IPERFTZ_TCP) && pace_socket(w->args, fd) ? 0 : w->args->bitrate,
+	       pacer_burst(w->args->bitrate, w->args->burst, len, PACER_GRANULARITY_NS),
+	       now);
+  }
+
+  f->next = w->flows;
+  w->flows = f;
+  if (protocol == IPERFTZ_UDP) {
+    unsigned int h = udp_hash(peer);
+
+    f->hnext = w->udp_hash[h];
+    w->udp_hash[h] = f;
+  }
+
+  return f;
+}
+
+void flow_free(struct worker *w, struct flow *f)
+{
+  struct flow **p;
+
+  for (p = &w->flows; *p != NULL; p = &(*p)->next) {
+    if (*p == f) {
+      *p = f->next;
+      break;
+    }
+  }
+  if (f->protocol == IPERFTZ_UDP) {
+    for (p = &w->udp_hash[udp_hash(&f->peer)]; *p != NULL; p = &(*p)->hnext) {
+      if (*p == f) {
+	*p = f->hnext;
+	break;
+      }
+    }
+  } else if (f->reverse) {
+    zc_tx_print(&f->tx);
+    zc_tx_close(&f->tx);
+    close(f->fd);
+  } else {
+    zc_rx_close(&f->rx);
+    close(f->fd);
+  }
+  if (f->throttled)
+    w->throttled--;
+  free(f);
+}
+
+static void flow_report(struct args *args, struct flow *f)
+{
+  char addr[INET_ADDRSTRLEN];
+  long long runtime = f->end_ns - f->start_ns;
+
+  if (runtime <= 0)
+    runtime = 1;
+  inet_ntop(AF_INET, &f->peer.sin_addr, addr, sizeof(addr));
+  printf("[%u.%u] %s:%u %s %s: bytes transmitted: %llu B, calls: %llu, net time: %lli ns, runtime = %lli ns, %.3f Mbit/s\n",
+	 f->worker, f->id, addr, ntohs(f->peer.sin_port),
+	 f->protocol == IPERFTZ_TCP ? "TCP" : "UDP",
+	 f->reverse ? "send" : "recv",
+	 f->bytes, f->calls, f->net_ns, runtime,
+	 f->bytes * 8000.0 / runtime);
+  if (f->protocol == IPERFTZ_UDP)
+    printf("[%u.%u] datagrams: %llu\n", f->worker, f->id, f->datagrams);
+  if ((f->protocol == IPERFTZ_UDP) && !f->reverse) {
+    printf("[%u.%u] ", f->worker, f->id);
+    udp_print(&f->udp);
+  }
+  if (f->hist.count > 0) {
+    printf("[%u.%u] ", f->worker, f->id);
+    latency_print(&f->hist);
+  }
+  if (f->reverse && (args->bitrate > 0)) {
+    printf("[%u.%u] ", f->worker, f->id);
+    pace_print(&f->pacer, args->bitrate, f->bytes, runtime);
+  }
+  if ((f->protocol == IPERFTZ_TCP) && !f->reverse)
+    zc_rx_print(&f->rx);
+  if (f->protocol == IPERFTZ_TCP)
+    tcp_print_results(f->fd);
+}
+
+/* End the measurement of a flow and add it to the worker's totals */
+void flow_end(struct worker *w, struct flow *f, long long now)
+{
+  f->state = FLOW_DRAIN;
+  f->end_ns = now;
+  interval_finish(&f->iv, now - f->start_ns, f->bytes, f->net_ns);
+  flow_report(w->args, f);
+  w->finished++;
+  w->bytes += f->bytes;
+  w->net_ns += f->net_ns;
+}
+
+/* A TCP flow ends on a block boundary, the TA only takes whole blocks */
+int flow_done(struct args *args, struct flow *f, long long now)
+{
+  if (args->transmit_bytes > 0)
+    return (f->bytes >= args->transmit_bytes) &&
+      ((f->protocol != IPERFTZ_TCP) || (f->bytes % args->blksize == 0));
+  return now - f->start_ns >= RUNTIME_NS;
+}
+
+void flow_account(struct flow *f, ssize_t n, long long ti, long long tj)
+{
+  interval_report(&f->iv, tj - f->start_ns, f->bytes, f->net_ns);
+  f->bytes += n;
+  f->calls++;
+  f->net_ns += tj - ti;
+  f->last_ns = tj;
+  /* Engines that cannot time single calls pass ti == tj */
+  if (tj > ti)
+    hist_record(&f->hist, tj - ti);
+}
+
+/* Join the SO_REUSEPORT group of the port when running several workers */
+static int shard_socket(struct worker *w, int fd)
+{
+  int on = 1;
+
+  if (w->args->threads <= 1)
+    return 0;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+    perror("setsockopt");
+    return -1;
+  }
+  /* A hint only, the kernel prefers this socket for packets handled on cpu */
+  if (w->cpu >= 0)
+    setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &w->cpu, sizeof(w->cpu));
+
+  return 0;
+}
+
+/* Block buffer, TCP listener and UDP socket shared by all engines */
+static int worker_open(struct worker *w,
+		       struct args *args,
+		       unsigned int index,
+		       int cpu)
+{
+  struct sockaddr_in server_addr;
+  int bufsize = args->socket_bufsize;
+  int on = 1;
+
+  w->args = args;
+  w->index = index;
+  w->cpu = cpu;
+  w->epfd = -1;
+  w->listenfd = -1;
+  w->udpfd = -1;
+  w->udp_tx.memfd = -1;
+  w->udp_tx.pipefd[0] = -1;
+  w->udp_tx.pipefd[1] = -1;
+
+  w->buffer = (char *)calloc(args->blksize, sizeof(char));
+  if (w->buffer == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  if (args->reverse == 1)
+    block_fill(args, w->buffer);
+
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  server_addr.sin_port = htons(args->port);
+
+  w->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (w->listenfd == -1) {
+    perror("socket");
+    return -1;
+  }
+  if ((setsockopt(w->listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) ||
+      (setsockopt(w->listenfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) == -1)) {
+    perror("setsockopt");
+    return -1;
+  }
+  if (shard_socket(w, w->listenfd) == -1)
+    return -1;
+  if (bind(w->listenfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+    perror("bind");
+    return -1;
+  }
+  if (listen(w->listenfd, SOMAXCONN) == -1) {
+    perror("listen");
+    return -1;
+  }
+
+  w->udpfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (w->udpfd == -1) {
+    perror("socket");
+    return -1;
+  }
+  if (shard_socket(w, w->udpfd) == -1)
+    return -1;
+  if (bind(w->udpfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+    perror("bind");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void worker_close(struct worker *w)
+{
+  if (w->udpfd != -1)
+    close(w->udpfd);
+  if (w->listenfd != -1)
+    close(w->listenfd);
+  free(w->buffer);
+}
+
+static void *worker_thread(void *arg)
+{
+  struct worker *w = (struct worker *)arg;
+  cpu_set_t set;
+  int rc;
+
+  if (w->cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0)
+      fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(rc));
+  }
+  cpu_open(&w->usage, RUSAGE_THREAD, w->args->counters);
+  cpu_start(&w->usage);
+  w->rc = w->ops->run(w);
+  cpu_stop(&w->usage);
+  cpu_close(&w->usage);
+
+  return NULL;
+}
+
+/* CPU of the index-th worker, taken round-robin from the allowed CPUs */
+static int worker_cpu(unsigned int index)
+{
+  cpu_set_t set;
+  int cpu, n, count;
+
+  if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+    perror("sched_getaffinity");
+    return -1;
+  }
+  count = CPU_COUNT(&set);
+  if (count == 0)
+    return -1;
+  n = index % count;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &set) && (n-- == 0))
+      return cpu;
+  return -1;
+}
+
+/*
+ * Add a worker's CPU accounting to the sum of all workers, whose
+ * utilisation is then in CPUs of the longest worker
+ */
+static void cpu_add(struct iptz_cpu *sum, struct iptz_cpu *c)
+{
+  int i;
+
+  timeradd(&sum->ru.ru_utime, &c->ru.ru_utime, &sum->ru.ru_utime);
+  timeradd(&sum->ru.ru_stime, &c->ru.ru_stime, &sum->ru.ru_stime);
+  sum->ru.ru_nvcsw += c->ru.ru_nvcsw;
+  sum->ru.ru_nivcsw += c->ru.ru_nivcsw;
+  sum->thread_ns += c->thread_ns;
+  if (c->wall_ns > sum->wall_ns)
+    sum->wall_ns = c->wall_ns;
+  if (sum->error == 0)
+    sum->error = c->error;
+  sum->user_only |= c->user_only;
+  for (i = 0; i < CPU_COUNTERS; i++)
+    sum->count[i] += c->count[i];
+}
+
+/*
+ * Run one engine worker per thread until interrupted and print the
+ * per-worker and aggregate results.
+ */
+int workers_serve(struct args *args, const struct engine_ops *ops)
+{
+  struct sigaction sa;
+  struct worker **workers;
+  sigset_t mask, omask;
+  unsigned int i, nthreads = args->threads;
+  unsigned int started = 0, finished = 0;
+  unsigned long long bytes = 0;
+  long long net_ns = 0;
+  struct iptz_cpu cpu;
+  int rc = 0;
+
+  if (nthreads == 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  args->threads = nthreads;
+  memset(&cpu, 0, sizeof(cpu));
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  workers = (struct worker **)calloc(nthreads, sizeof(*workers));
+  if (workers == NULL) {
+    perror("calloc");
+    return errno;
+  }
+  for (i = 0; (i < nthreads) && (rc == 0); i++) {
+    /* Separate allocations keep the workers' counters on their own lines */
+    workers[i] = (struct worker *)calloc(1, sizeof(struct worker));
+    if (workers[i] == NULL) {
+      perror("calloc");
+      rc = errno;
+      break;
+    }
+    workers[i]->ops = ops;
+    if ((worker_open(workers[i], args, i, nthreads > 1 ? worker_cpu(i) : -1) == -1) ||
+	(ops->setup(workers[i]) == -1))
+      rc = -1;
+  }
+  if (rc != 0)
+    goto cleanup;
+
+  printf("Serving TCP and UDP clients on port %u with %u %s worker(s), interrupt to stop\n",
+	 args->port, nthreads, ops->name);
+  fflush(stdout);
+
+  /* Only the main thread handles signals */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, &omask);
+  for (started = 0; started < nthreads; started++) {
+    rc = pthread_create(&workers[started]->thread, NULL, worker_thread, workers[started]);
+    if (rc != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+      server_stop = 1;
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+  for (i = 0; i < started; i++) {
+    pthread_join(workers[i]->thread, NULL);
+    if (rc == 0)
+      rc = workers[i]->rc;
+  }
+
+ cleanup:
+  for (i = 0; (i < nthreads) && (workers[i] != NULL); i++) {
+    ops->cleanup(workers[i]);
+    worker_close(workers[i]);
+    if ((nthreads > 1) && (i < started)) {
+      printf("worker %u (cpu %d): flows: %u, bytes transmitted: %llu B, net time: %lli ns\n",
+	     i, workers[i]->cpu, workers[i]->finished, workers[i]->bytes, workers[i]->net_ns);
+      print_cpu(args, &workers[i]->usage, workers[i]->bytes);
+    }
+    finished += workers[i]->finished;
+    bytes += workers[i]->bytes;
+    net_ns += workers[i]->net_ns;
+    if (i < started)
+      cpu_add(&cpu, &workers[i]->usage);
+    free(workers[i]);
+  }
+  free(workers);
+  if (started == 0)
+    return rc;
+
+  printf("flows: %u, bytes transmitted: %llu B, net time: %lli ns\n",
+	 finished, bytes, net_ns);
+  if (args->engine == ENGINE_EPOLL)
+    printf("%s path: %s\n", args->reverse ? "tx" : "rx", zc_mode_name(args->zerocopy));
+  print_cpu(args, &cpu, bytes);
+
+  return rc;
+}
@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: per-interval reports
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "server.h"
+
+void interval_init(struct interval *iv, struct args *args, const char *tag)
+{
+  memset(iv, 0, sizeof(*iv));
+  iv->period_ns = args->interval_ns;
+  iv->next_ns = args->interval_ns;
+  strncpy(iv->tag, tag, sizeof(iv->tag) - 1);
+}
+
+static void interval_print(struct interval *iv,
+			   long long end,
+			   unsigned long long bytes,
+			   long long net_ns)
+{
+  long long length = end - iv->start_ns;
+
+  printf("%s[%7.3f-%7.3f s] bytes: %llu B, %.3f Mbit/s, net time: %lli ns",
+	 iv->tag, iv->start_ns / 1e9, end / 1e9, bytes - iv->bytes,
+	 length > 0 ? (bytes - iv->bytes) * 8000.0 / length : 0.0,
+	 net_ns - iv->net_ns);
+  if (iv->udp != NULL) {
+    printf(", lost: %llu/%llu datagrams, jitter: %llu ns",
+	   (unsigned long long)(udp_lost(iv->udp) - iv->lost),
+	   (unsigned long long)(iv->udp->next - iv->expected),
+	   (unsigned long long)(iv->udp->jitter / 16));
+    iv->lost = udp_lost(iv->udp);
+    iv->expected = iv->udp->next;
+  }
+  putchar('\n');
+  iv->start_ns = end;
+  iv->bytes = bytes;
+  iv->net_ns = net_ns;
+}
+
+/*
+ * Close every interval that ended before t, the time since the start of
+ * the test. Callers pass the counters from before the I/O that completed
+ * at t, so a stall shows up as empty intervals.
+ */
+void interval_report(struct interval *iv,
+		     long long t,
+		     unsigned long long bytes,
+		     long long net_ns)
+{
+  if (iv->period_ns == 0)
+    return;
+  while (t >= iv->next_ns) {
+    interval_print(iv, iv->next_ns, bytes, net_ns);
+    iv->next_ns += iv->period_ns;
+  }
+}
+
+/*
+ * Close the remaining intervals at the end of the test, the last one only
+ * if it is not an idle sliver left over by the test's own end condition.
+ */
+void interval_finish(struct interval *iv,
+		     long long t,
+		     unsigned long long bytes,
+		     long long net_ns)
+{
+  if (iv->period_ns == 0)
+    return;
+  interval_report(iv, t, bytes, net_ns);
+  if ((bytes > iv->bytes) || (t - iv->start_ns >= iv->period_ns / 10))
+    interval_print(iv, t, bytes, net_ns);
+}
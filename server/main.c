@@ -17,6 +17,8 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -26,40 +28,35 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <poll.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
 #include <netinet/tcp.h>
 
+#include <iperfTZ_ctrl.h>
 #include <iperfTZ_ta.h>
 
-struct args {
-  size_t blksize;
-  size_t socket_bufsize;
-  unsigned long int transmit_bytes;
-  unsigned int protocol;
-  unsigned long int bitrate;
-  unsigned int reverse;
-};
+#include "server.h"
 
-static int rand_fill(struct args *args, void *buffer) {
-  FILE *f;
+/* One of the parallel connections of a single engine test */
+struct stream {
+  int fd;                  /* TCP */
+  struct sockaddr_in peer; /* UDP */
+  struct zc_rx rx;         /* TCP receivers */
+  int closed;              /* TCP receivers, the peer closed the connection */
+  struct zc_tx tx;         /* TCP senders */
+  struct iptz_udp udp;     /* UDP receivers */
+  uint32_t seq;            /* UDP senders, next datagram */
+  unsigned long long bytes;
+  struct iptz_verify verify; /* receivers with -V */
+};
 
-  f = fopen("/dev/urandom", "r");
-  if (f == NULL) {
-    perror("fopen");
-    return -1;
-  }
-  if (fread(buffer, sizeof(char), args->blksize, f) < args->blksize) {
-    perror("fread");
-    return -1;
-  }
-  if (fclose(f) == EOF) {
-    perror("fclose");
-    return -1;
-  }
-  return 0;
+/* A block of the payload pattern, see iperfTZ_payload.h */
+void block_fill(struct args *args, void *buffer)
+{
+  pattern_fill(buffer, args->blksize, args->seed);
 }
 
 static void init_args(struct args *args)
@@ -70,6 +67,21 @@ static void init_args(struct args *args)
   args->protocol = IPERFTZ_TCP;
   args->reverse = 0;
   args->bitrate = 0;
+  args->burst = 0;
+  args->pacing = 0;
+  args->engine = ENGINE_SINGLE;
+  args->threads = 1;
+  args->zerocopy = ZC_COPY;
+  args->batch = 1;
+  args->gso = 0;
+  args->interval_ns = 0;
+  args->port = IPERFTZ_PORT;
+  args->daemon = 0;
+  args->ctrlfd = -1;
+  args->streams = 1;
+  args->seed = IPERFTZ_SEED;
+  args->verify = 0;
+  args->counters = 0;
 }
 
 static char *init_buffer(struct args *args)
@@ -77,13 +89,8 @@ static char *init_buffer(struct args *args)
   char *buffer = (char *)calloc(args->blksize, sizeof(char));
   if (buffer == NULL)
     perror("calloc");
-
-  if (args->reverse == 1) {
-    if (rand_fill(args, buffer) == -1) {
-      free(buffer);
-      buffer = NULL;
-    }
-  }
+  else if (args->reverse == 1)
+    block_fill(args, buffer);
   
   return buffer;
 }
@@ -94,27 +101,101 @@ static int parse_args(struct args *args,
 {
   int c;
   int errflg = 0;
+  double interval;
+  char *end;
 
-  while ((c = getopt(argc, argv, "b:l:n:ruw:")) != -1) {
+  while ((c = getopt(argc, argv, "b:de:gHi:l:m:n:P:prs:t:uVw:x:z:")) != -1) {
     switch (c) {
     case 'b':
-      args->bitrate = strtoul(optarg, (char **)NULL, 10);
+      args->bitrate = strtoul(optarg, &end, 10);
+      /* An optional bucket size follows the rate as in -b rate/burst */
+      if (*end == '/')
+	args->burst = strtoul(end + 1, (char **)NULL, 10);
+      break;
+    case 'd':
+      args->daemon = 1;
+      break;
+    case 'e':
+      if (strcmp(optarg, "single") == 0) {
+	args->engine = ENGINE_SINGLE;
+      } else if (strcmp(optarg, "epoll") == 0) {
+	args->engine = ENGINE_EPOLL;
+      } else if (strcmp(optarg, "uring") == 0) {
+	args->engine = ENGINE_URING;
+      } else {
+	fprintf(stderr, "Unknown engine: '%s'\n", optarg);
+	errflg++;
+      }
+      break;
+    case 'g':
+      args->gso = 1;
+      break;
+    case 'H':
+      args->counters = 1;
+      break;
+    case 'i':
+      interval = strtod(optarg, (char **)NULL);
+      if ((interval < 0.001) || (interval > 3600)) {
+	fprintf(stderr, "Interval must be between 0.001 and 3600 seconds\n");
+	errflg++;
+      } else {
+	args->interval_ns = interval * 1000000000LL;
+      }
       break;
     case 'l':
       args->blksize = strtoul(optarg, (char **)NULL, 10);
       break;
+    case 'm':
+      args->batch = strtoul(optarg, (char **)NULL, 10);
+      if ((args->batch == 0) || (args->batch > UDP_BATCH_MAX)) {
+	fprintf(stderr, "UDP batch depth must be between 1 and %d\n", UDP_BATCH_MAX);
+	errflg++;
+      }
+      break;
     case 'n':
       args->transmit_bytes = strtoul(optarg, (char **)NULL, 10);
       break;
+    case 'P':
+      args->port = strtoul(optarg, (char **)NULL, 10);
+      if ((args->port == 0) || (args->port > 65535)) {
+	fprintf(stderr, "Port must be between 1 and 65535\n");
+	errflg++;
+      }
+      break;
+    case 'p':
+      args->pacing = 1;
+      break;
     case 'r':
       args->reverse = 1;
       break;
+    case 's':
+      args->streams = strtoul(optarg, (char **)NULL, 10);
+      if ((args->streams == 0) || (args->streams > IPERFTZ_STREAMS_MAX)) {
+	fprintf(stderr, "Streams must be between 1 and %d\n", IPERFTZ_STREAMS_MAX);
+	errflg++;
+      }
+      break;
+    case 't':
+      args->threads = strtoul(optarg, (char **)NULL, 10);
+      break;
     case 'u':
       args->protocol = IPERFTZ_UDP;
       break;
+    case 'V':
+      args->verify = 1;
+      break;
     case 'w':
       args->socket_bufsize = strtoul(optarg, (char **)NULL, 10);
       break;
+    case 'x':
+      args->seed = strtoul(optarg, (char **)NULL, 0);
+      break;
+    case 'z':
+      if (zc_mode_parse(optarg, &args->zerocopy) != 0) {
+	fprintf(stderr, "Unknown zero-copy mode: '%s'\n", optarg);
+	errflg++;
+      }
+      break;
     case ':':
       fprintf(stderr, "Option -%c requires an operand\n", optopt);
       errflg++;
@@ -124,9 +205,35 @@ static int parse_args(struct args *args,
       errflg++;
     }
   }
+  if ((args->reverse && (args->zerocopy == ZC_MMAP)) ||
+      (!args->reverse && ((args->zerocopy == ZC_MSG) || (args->zerocopy == ZC_SENDFILE)))) {
+    fprintf(stderr, "Zero-copy mode '%s' is not available in this direction\n", zc_mode_name(args->zerocopy));
+    errflg++;
+  }
+  if ((args->threads != 1) && (args->engine == ENGINE_SINGLE)) {
+    fprintf(stderr, "Option -t requires an event-driven engine\n");
+    errflg++;
+  }
+  if ((args->streams != 1) && (args->engine != ENGINE_SINGLE)) {
+    fprintf(stderr, "Option -s requires the single engine\n");
+    errflg++;
+  }
+  if (args->verify && ((args->engine != ENGINE_SINGLE) || (args->zerocopy != ZC_COPY))) {
+    fprintf(stderr, "Option -V requires the single engine and the copying receive path\n");
+    errflg++;
+  }
+  if (args->daemon && (args->engine != ENGINE_SINGLE)) {
+    fprintf(stderr, "Option -d requires the single engine\n");
+    errflg++;
+  }
+  if ((args->engine == ENGINE_URING) &&
+      ((args->zerocopy != ZC_COPY) || (args->batch != 1) || args->gso)) {
+    fprintf(stderr, "Options -g, -m and -z are not available with the io_uring engine\n");
+    errflg++;
+  }
   if (errflg) {
     errno = EINVAL;
-    fprintf(stderr, "usage: %s -b rate -l size -n size -ru -w size\n", argv[0]);
+    fprintf(stderr, "usage: %s -b rate[/burst] -d -e single|epoll|uring -g -H -i interval -l size -m depth -n size -P port -p -r -s streams -t threads -u -V -w size -x seed -z copy|splice|mmap|msg|sendfile\n", argv[0]);
     return EINVAL;
   }
 
@@ -135,26 +242,133 @@ static int parse_args(struct args *args,
 
 static int tcp_connect(struct sockaddr_in *server_addr,
 		       int *connection,
+		       unsigned int streams,
 		       int sockfd)
 {
   socklen_t addrlen;
+  unsigned int i;
   
-  if (listen(sockfd, 5) == -1) {
+  if (listen(sockfd, streams > 5 ? streams : 5) == -1) {
     perror("listen");
     return -1;
   }
   
-  addrlen = sizeof(struct sockaddr);
-  if ((*connection = accept(sockfd, (struct sockaddr *)server_addr, &addrlen)) == -1) {
-    perror("accept");
-    close(sockfd);
-    return -1;
+  for (i = 0; i < streams; i++) {
+    addrlen = sizeof(struct sockaddr);
+    if ((connection[i] = accept(sockfd, (struct sockaddr *)server_addr, &addrlen)) == -1) {
+      perror("accept");
+      close(sockfd);
+      return -1;
+    }
   }
 
   return 0;
 }
 
-static int tcp_print_results(int connection)
+/* CPU time and hardware counters of a data loop, see iperfTZ_cpu.h */
+void print_cpu(struct args *args, struct iptz_cpu *c, unsigned long long bytes)
+{
+  long long cpu = cpu_time_ns(c);
+
+  printf("CPU time: %lli ns, %.3f s/GB\n", cpu, bytes > 0 ? cpu / (double)bytes : 0.0);
+  printf("CPU: user %lli ns, system %lli ns, thread %lli ns, utilisation %.1f %%, context switches: %ld voluntary, %ld involuntary\n",
+	 tv_ns(&c->ru.ru_utime), tv_ns(&c->ru.ru_stime), c->thread_ns,
+	 c->wall_ns > 0 ? cpu * 100.0 / c->wall_ns : 0.0, c->ru.ru_nvcsw, c->ru.ru_nivcsw);
+  if (!args->counters)
+    return;
+  if (!cpu_counted(c)) {
+    printf("hardware counters: not available (%s)\n", strerror(c->error));
+    return;
+  }
+  printf("hardware counters%s: cycles %" PRIu64 ", %.3f cycles/B, instructions %" PRIu64 ", %.2f per cycle, cache misses %" PRIu64 "\n",
+	 c->user_only ? " (user space)" : "",
+	 c->count[CPU_CYCLES], bytes > 0 ? (double)c->count[CPU_CYCLES] / bytes : 0.0,
+	 c->count[CPU_INSTRUCTIONS],
+	 c->count[CPU_CYCLES] > 0 ? (double)c->count[CPU_INSTRUCTIONS] / c->count[CPU_CYCLES] : 0.0,
+	 c->count[CPU_CACHE_MISSES]);
+}
+
+/*
+ * Tell the TA of a daemon's test what the server measured, right after
+ * the data loop and before draining, see iperfTZ_ctrl.h
+ */
+static void ctrl_report(struct args *args,
+			unsigned long long bytes,
+			long long runtime,
+			long long net_ns,
+			long long cpu)
+{
+  unsigned char msg[CTRL_REPORT_LEN];
+  struct iptz_report r;
+
+  if (args->ctrlfd == -1)
+    return;
+  r.bytes = bytes;
+  r.runtime_ns = runtime;
+  r.net_ns = net_ns;
+  r.cpu_ns = cpu;
+  ctrl_report_encode(msg, &r);
+  if (send(args->ctrlfd, msg, sizeof(msg), 0) != sizeof(msg))
+    perror("send");
+}
+
+/*
+ * Hand the pacing of a TCP sender to the kernel with SO_MAX_PACING_RATE,
+ * which TCP honours by itself and the fq qdisc for any socket. Parallel
+ * streams share the rate. Returns 1 if the kernel paces the socket.
+ */
+int pace_socket(struct args *args, int fd)
+{
+  uint64_t rate = args->bitrate / 8 / args->streams;
+  uint32_t rate32 = rate > UINT32_MAX ? UINT32_MAX : rate;
+
+  if (!args->pacing || (args->bitrate == 0))
+    return 0;
+  if ((setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == -1) &&
+      (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate32, sizeof(rate32)) == -1)) {
+    perror("setsockopt");
+    fprintf(stderr, "Pacing in user space\n");
+    return 0;
+  }
+  return 1;
+}
+
+void pace_sleep(struct iptz_pacer *p, long long ns)
+{
+  struct timespec t;
+
+  t.tv_sec = ns / 1000000000LL;
+  t.tv_nsec = ns % 1000000000LL;
+  clock_nanosleep(CLOCK_MONOTONIC, 0, &t, NULL);
+  pacer_slept(p, ns);
+}
+
+void latency_print(struct iptz_hist *h)
+{
+  struct iptz_latency l;
+
+  hist_summary(h, &l);
+  printf("latency per call: min %" PRIu64 " ns, p50 %" PRIu64 " ns, p90 %" PRIu64 " ns, p99 %" PRIu64 " ns, p99.9 %" PRIu64 " ns, max %" PRIu64 " ns (%" PRIu64 " calls)\n",
+	 l.min, l.p50, l.p90, l.p99, l.p999, l.max, l.count);
+}
+
+void pace_print(struct iptz_pacer *p,
+		unsigned long bitrate,
+		unsigned long long bytes,
+		long long runtime)
+{
+  double achieved = runtime > 0 ? bytes * 8e9 / runtime : 0;
+
+  printf("bitrate: target %lu bit/s, achieved %.0f bit/s, error %+.2f %%, ",
+	 bitrate, achieved, (achieved - bitrate) * 100 / bitrate);
+  if (p->rate == 0)
+    puts("paced by the kernel");
+  else
+    printf("pacer slept %llu times for %llu ns\n",
+	   (unsigned long long)p->waits, (unsigned long long)p->wait_ns);
+}
+
+int tcp_print_results(int connection)
 {
   FILE *fp;
   struct tcp_info info;
@@ -180,99 +394,284 @@ static int tcp_print_results(int connection)
   return rc;
 }
 
-static int tcp_recv(struct args *args, int connection, char *buffer)
+/* Per-stream counters of a test with several connections */
+static void streams_print(struct args *args,
+			  struct stream *streams,
+			  long long td)
+{
+  unsigned int i;
+
+  if (args->streams == 1)
+    return;
+  for (i = 0; i < args->streams; i++)
+    printf("[stream %u] bytes: %llu B, %.3f Mbit/s\n", i, streams[i].bytes,
+	   td > 0 ? streams[i].bytes * 8e3 / td : 0.0);
+}
+
+/* What checking the received blocks found and cost */
+static void verify_print(struct args *args,
+			 struct stream *streams,
+			 long long verify_ns,
+			 unsigned long long bytes)
+{
+  unsigned long long blocks = 0, errors = 0;
+  unsigned int i;
+
+  if (!args->verify)
+    return;
+  for (i = 0; i < args->streams; i++) {
+    blocks += streams[i].verify.blocks;
+    errors += streams[i].verify.errors;
+  }
+  printf("verified %s: %llu, mismatches: %llu, verify time: %lli ns, %.3f GB/s\n",
+	 args->protocol == IPERFTZ_UDP ? "datagrams" : "blocks", blocks, errors, verify_ns,
+	 verify_ns > 0 ? (double)bytes / verify_ns : 0.0);
+}
+
+static void streams_rx_close(struct args *args, struct stream *streams)
+{
+  unsigned int i;
+
+  for (i = 0; i < args->streams; i++)
+    zc_rx_close(&streams[i].rx);
+}
+
+static void streams_tx_close(struct args *args, struct stream *streams)
+{
+  unsigned int i;
+
+  for (i = 0; i < args->streams; i++)
+    zc_tx_close(&streams[i].tx);
+}
+
+/* The connections are read in turn, a read that would block moves on */
+static int tcp_recv(struct args *args, struct stream *streams, char *buffer)
 {
   ssize_t bytes_transmitted = 0;
   ssize_t n;
   long long net_ns = 0;
+  struct interval iv;
+  struct iptz_hist hist;
+  long long dt;
+  struct iptz_cpu cpu;
   struct timespec ta, ti, tj, to;
+  struct stream *st;
+  unsigned int i, next = 0, closed = 0;
   long long td;
+  long long verify_ns = 0;
   
+  for (i = 0; i < args->streams; i++)
+    zc_rx_open(&streams[i].rx, args, streams[i].fd, buffer);
+  interval_init(&iv, args, "");
+  hist_init(&hist);
+  cpu_open(&cpu, RUSAGE_SELF, args->counters);
+  cpu_start(&cpu);
   clock_gettime(CLOCK_REALTIME, &ta);
   do {
+    st = &streams[next];
+    next = (next + 1) % args->streams;
+    if (st->closed)
+      goto again;
     clock_gettime(CLOCK_REALTIME, &ti);
-    n = read(connection, buffer, args->blksize);
+    n = zc_rx_read(&st->rx, st->fd);
     clock_gettime(CLOCK_REALTIME, &tj);
+    /* Only reads that moved data are calls, the test ends with the last stream */
+    if (n == 0) {
+      st->closed = 1;
+      closed++;
+      goto again;
+    }
     if (n == -1) {
       switch (errno) {
       case EAGAIN:
 	goto again;
       case ETIMEDOUT:
 	puts("Transmission timeout occurred");
+	streams_rx_close(args, streams);
+	cpu_close(&cpu);
 	return errno;
       default:
 	perror("read");
+	streams_rx_close(args, streams);
+	cpu_close(&cpu);
 	return errno;
       }
     }
-    net_ns += (tj.tv_sec - ti.tv_sec) * 1000000000LL + tj.tv_nsec - ti.tv_nsec;
+    interval_report(&iv, (tj.tv_sec - ta.tv_sec) * 1000000000LL + tj.tv_nsec - ta.tv_nsec,
+		    bytes_transmitted, net_ns);
+    dt = (tj.tv_sec - ti.tv_sec) * 1000000000LL + tj.tv_nsec - ti.tv_nsec;
+    hist_record(&hist, dt);
+    net_ns += dt;
     bytes_transmitted += n;
+    st->bytes += n;
+    if (args->verify) {
+      verify_stream(&st->verify, buffer, n);
+      clock_gettime(CLOCK_REALTIME, &ti);
+      verify_ns += (ti.tv_sec - tj.tv_sec) * 1000000000LL + ti.tv_nsec - tj.tv_nsec;
+    }
   again:
     clock_gettime(CLOCK_REALTIME, &to);
     td = (to.tv_sec - ta.tv_sec) * 1000000000LL + to.tv_nsec - ta.tv_nsec;
-  } while (((args->transmit_bytes == 0) && (td < 10000000000LL)) ||
-	   ((args->transmit_bytes > 0) && (bytes_transmitted < args->transmit_bytes)));
+  } while ((closed < args->streams) &&
+	   (((args->transmit_bytes == 0) && (td < 10000000000LL)) ||
+	    ((args->transmit_bytes > 0) && (bytes_transmitted < args->transmit_bytes))));
+  cpu_stop(&cpu);
+  cpu_close(&cpu);
   
+  interval_finish(&iv, td, bytes_transmitted, net_ns);
   printf("bytes transmitted: %zd B\nnet time: %lli ns\nruntime = %lli ns\n", bytes_transmitted, net_ns, td);
+  streams_print(args, streams, td);
+  latency_print(&hist);
+  verify_print(args, streams, verify_ns, bytes_transmitted);
+  for (i = 0; i < args->streams; i++)
+    zc_rx_print(&streams[i].rx);
+  print_cpu(args, &cpu, bytes_transmitted);
+  ctrl_report(args, bytes_transmitted, td, net_ns, cpu_time_ns(&cpu));
 
   // Drain the connection
   puts("Draining the connection for 2 seconds");
   clock_gettime(CLOCK_REALTIME, &ta);
   do {
-    n = read(connection, buffer, args->blksize);
+    n = 0;
+    for (i = 0; i < args->streams; i++)
+      if (zc_rx_read(&streams[i].rx, streams[i].fd) > 0)
+	n = 1;
     clock_gettime(CLOCK_REALTIME, &to);
     td = (to.tv_sec - ta.tv_sec) * 1000000000LL + to.tv_nsec - ta.tv_nsec;
   } while ((td < 2000000000LL) || (n > 0));
+  streams_rx_close(args, streams);
 
   return 0;
 }  
 
-static int tcp_send(struct args *args, int connection, char *buffer)
+/* Whether every stream ended on a block boundary, the TA takes whole blocks */
+static int streams_whole(struct args *args, struct stream *streams)
+{
+  unsigned int i;
+
+  for (i = 0; i < args->streams; i++)
+    if (streams[i].bytes % args->blksize != 0)
+      return 0;
+  return 1;
+}
+
+/* Blocks go to the connections in turn, the pacer limits them all */
+static int tcp_send(struct args *args, struct stream *streams, char *buffer)
 {
   ssize_t bytes_transmitted = 0;
   ssize_t n;
   long long net_ns = 0;
+  struct interval iv;
+  struct iptz_hist hist;
+  long long dt;
+  struct iptz_cpu cpu;
   struct timespec ta, ti, tj, to;
+  struct iptz_pacer pacer;
+  struct stream *st;
+  unsigned int i, next = 0;
+  int paced = 1;
+  long long delay;
   long long td = 1;
 
+  for (i = 0; i < args->streams; i++) {
+    zc_tx_open(&streams[i].tx, args, streams[i].fd, IPERFTZ_TCP, buffer);
+    if (!pace_socket(args, streams[i].fd))
+      paced = 0;
+  }
+  pacer_init(&pacer, paced ? 0 : args->bitrate,
+	     pacer_burst(args->bitrate, args->burst, args->blksize, PACER_GRANULARITY_NS),
+	     now_ns());
+  interval_init(&iv, args, "");
+  hist_init(&hist);
+  cpu_open(&cpu, RUSAGE_SELF, args->counters);
+  cpu_start(&cpu);
   clock_gettime(CLOCK_REALTIME, &ta);
   do {
     ssize_t bytes = 0;
 
-    if ((args->bitrate == 0) || (args->bitrate > ((bytes_transmitted + args->blksize) * 8 / td * 1000000000LL))) {
+    delay = pacer_delay(&pacer, args->blksize, now_ns());
+    if (delay > 0) {
+      pace_sleep(&pacer, delay);
+    } else {
+      st = &streams[next];
+      next = (next + 1) % args->streams;
       clock_gettime(CLOCK_REALTIME, &ti);
+      /* Up to the end of the block, a short send left off within it */
       do {
-	n = write(connection, buffer, args->blksize);
-	bytes += n;
-      } while ((bytes < args->blksize) && (n != -1));
+	n = zc_tx_send(&st->tx, st->fd, args->blksize, NULL, 0);
+	if (n > 0)
+	  bytes += n;
+      } while ((st->tx.pos != 0) && (n != -1));
       clock_gettime(CLOCK_REALTIME, &tj);
+      interval_report(&iv, (tj.tv_sec - ta.tv_sec) * 1000000000LL + tj.tv_nsec - ta.tv_nsec,
+		      bytes_transmitted, net_ns);
+      bytes_transmitted += bytes;
+      st->bytes += bytes;
+      pacer_consume(&pacer, bytes);
       if ((n == -1) && (errno == EAGAIN)) {
 	goto again;
       } else if (n == -1) {
 	perror("write");
+	streams_tx_close(args, streams);
+	cpu_close(&cpu);
 	return errno;
       }
-      net_ns += (tj.tv_sec - ti.tv_sec) * 1000000000LL + tj.tv_nsec - ti.tv_nsec;
-      bytes_transmitted += bytes;
+      dt = (tj.tv_sec - ti.tv_sec) * 1000000000LL + tj.tv_nsec - ti.tv_nsec;
+      hist_record(&hist, dt);
+      net_ns += dt;
     }
 
   again:
     clock_gettime(CLOCK_REALTIME, &to);
     td = (to.tv_sec - ta.tv_sec) * 1000000000LL + to.tv_nsec - ta.tv_nsec;
   } while (((args->transmit_bytes == 0) && (td < 10000000000LL)) ||
-	   ((args->transmit_bytes > 0) && (bytes_transmitted < args->transmit_bytes)));
+	   ((args->transmit_bytes > 0) &&
+	    ((bytes_transmitted < args->transmit_bytes) || !streams_whole(args, streams))));
+  for (i = 0; i < args->streams; i++)
+    zc_tx_finish(&streams[i].tx, streams[i].fd);
+  cpu_stop(&cpu);
+  cpu_close(&cpu);
 
+  interval_finish(&iv, td, bytes_transmitted, net_ns);
   printf("bytes transmitted: %zd B\nnet time: %lli ns\nruntime = %lli ns\n", bytes_transmitted, net_ns, td);
+  streams_print(args, streams, td);
+  latency_print(&hist);
+  for (i = 0; i < args->streams; i++)
+    zc_tx_print(&streams[i].tx);
+  if (args->bitrate > 0)
+    pace_print(&pacer, args->bitrate, bytes_transmitted, td);
+  print_cpu(args, &cpu, bytes_transmitted);
+  ctrl_report(args, bytes_transmitted, td, net_ns, cpu_time_ns(&cpu));
+  streams_tx_close(args, streams);
+
+  return 0;
+}
+
+static int set_nonblock(int fd)
+{
+  int val;
+
+  if ((val = fcntl(fd, F_GETFD, 0)) == -1) {
+    perror("fcntl");
+    return -1;
+  }
+
+  val |= O_NONBLOCK;
+  
+  if ((val = fcntl(fd, F_SETFL, val)) == -1) {
+    perror("fcntl");
+    return -1;
+  }
 
   return 0;
 }
 
 static int socket_setup(struct args *args, int *sockfd, int *connection)
 {
-  int fd, val;
+  unsigned int i;
   int sock_type = SOCK_STREAM;
   struct sockaddr_in server_addr;
-  in_port_t port = 5002;
+  in_port_t port = args->port;
 
   if (args->protocol == IPERFTZ_UDP)
     sock_type = SOCK_DGRAM;
@@ -300,62 +699,126 @@ static int socket_setup(struct args *args, int *sockfd, int *connection)
     return -1;
   }
 
-  if (args->protocol == IPERFTZ_TCP) {
-    if (tcp_connect(&server_addr, connection, *sockfd) != 0)
-      return -1;
-    fd = *connection;
-  } else {
-    fd = *sockfd;
-  }
+  if (args->protocol == IPERFTZ_UDP)
+    return set_nonblock(*sockfd);
 
-  if ((val = fcntl(fd, F_GETFD, 0)) == -1) {
-    perror("fcntl");
+  if (tcp_connect(&server_addr, connection, args->streams, *sockfd) != 0)
     return -1;
-  }
-
-  val |= O_NONBLOCK;
-  
-  if ((val = fcntl(fd, F_SETFL, val)) == -1) {
-    perror("fcntl");
-    return -1;
-  }
+  for (i = 0; i < args->streams; i++)
+    if (set_nonblock(connection[i]) == -1)
+      return -1;
 
   return 0;
 }
 
-static int udp_send(struct args *args, int sockfd, char *buffer)
+/* Messages of the next UDP batch, so that -n is not overshot by a batch */
+unsigned int batch_count(struct args *args,
+			 struct udp_batch *batch,
+			 unsigned long long bytes_transmitted)
+{
+  unsigned long long left, msgs;
+
+  if (args->transmit_bytes == 0)
+    return batch->depth;
+  if (bytes_transmitted >= args->transmit_bytes)
+    return 1;
+  left = args->transmit_bytes - bytes_transmitted;
+  msgs = (left + batch->msgsize - 1) / batch->msgsize;
+  return msgs < batch->depth ? msgs : batch->depth;
+}
+
+/*
+ * The stream of a UDP peer, new peers take the next free stream. Returns
+ * NULL for peers beyond the streams of the test.
+ */
+static struct stream *udp_stream(struct args *args,
+				 struct stream *streams,
+				 unsigned int *npeers,
+				 struct sockaddr_in *peer)
+{
+  unsigned int i;
+
+  for (i = 0; i < *npeers; i++)
+    if ((streams[i].peer.sin_addr.s_addr == peer->sin_addr.s_addr) &&
+	(streams[i].peer.sin_port == peer->sin_port))
+      return &streams[i];
+  if (*npeers == args->streams)
+    return NULL;
+  streams[*npeers].peer = *peer;
+  return &streams[(*npeers)++];
+}
+
+/* Batches go to the peers in turn, each peer numbers its own datagrams */
+static int udp_send(struct args *args, struct stream *streams, int sockfd, char *buffer)
 {
   socklen_t addrlen;
   ssize_t bytes_transmitted = 0;
   struct sockaddr_in client_addr;
+  struct udp_batch batch;
   ssize_t n;
   long long net_ns = 0;
+  struct interval iv;
+  struct iptz_hist hist;
+  long long dt;
+  struct iptz_cpu cpu;
   struct timespec ta, ti, tj, to;
+  struct zc_tx tx;
+  struct iptz_pacer pacer;
+  struct stream *st;
+  unsigned int npeers = 0, next = 0;
+  long long delay;
   long long td = 1;
 
-  /* Wait for some datagrams before sending */
+  /* Wait for some datagrams of every stream before sending */
   do {
+    addrlen = sizeof(client_addr);
     n = recvfrom(sockfd, buffer, args->blksize, 0, (struct sockaddr *)&client_addr, &addrlen);
-  } while (n <= 0);
+    if (n > 0)
+      udp_stream(args, streams, &npeers, &client_addr);
+  } while (npeers < args->streams);
+  zc_tx_open(&tx, args, sockfd, IPERFTZ_UDP, buffer);
+  if (udp_batch_open(&batch, args, sockfd, 1, buffer) == -1) {
+    zc_tx_close(&tx);
+    return -1;
+  }
+  /* A GSO message goes out at once, so the bucket holds at least one */
+  pacer_init(&pacer, args->bitrate,
+	     pacer_burst(args->bitrate, args->burst, batch.msgsize, PACER_GRANULARITY_NS),
+	     now_ns());
+  interval_init(&iv, args, "");
+  hist_init(&hist);
+  cpu_open(&cpu, RUSAGE_SELF, args->counters);
+  cpu_start(&cpu);
   clock_gettime(CLOCK_REALTIME, &ta);
   do {
-    ssize_t bytes = 0;
-
-    if ((args->bitrate == 0) || (args->bitrate > ((bytes_transmitted + args->blksize) * 8 / td * 1000000000LL))) {
+    delay = pacer_delay(&pacer, batch.msgsize, now_ns());
+    if (delay > 0) {
+      pace_sleep(&pacer, delay);
+    } else {
+      st = &streams[next];
+      next = (next + 1) % args->streams;
       clock_gettime(CLOCK_REALTIME, &ti);
-      do {
-	n = sendto(sockfd, buffer, args->blksize, 0, (struct sockaddr *)&client_addr, addrlen);
-	bytes += n;
-      } while ((bytes < args->blksize) && (n != -1));
+      n = udp_batch_send(&batch, sockfd, &tx, &st->peer,
+			 pacer_count(&pacer, batch.msgsize, batch_count(args, &batch, bytes_transmitted)),
+			 &st->seq);
       clock_gettime(CLOCK_REALTIME, &tj);
       if ((n == -1) && (errno == EAGAIN)) {
 	goto again;
-      } else {
-	perror("sendto");
+      } else if (n == -1) {
+	perror("sendmmsg");
+	udp_batch_close(&batch);
+	zc_tx_close(&tx);
+	cpu_close(&cpu);
 	return errno;
       }
-      net_ns += (tj.tv_sec - ti.tv_sec) * 1000000000LL + tj.tv_nsec - ti.tv_nsec;
-      bytes_transmitted += bytes;
+      interval_report(&iv, (tj.tv_sec - ta.tv_sec) * 1000000000LL + tj.tv_nsec - ta.tv_nsec,
+		      bytes_transmitted, net_ns);
+      dt = (tj.tv_sec - ti.tv_sec) * 1000000000LL + tj.tv_nsec - ti.tv_nsec;
+      hist_record(&hist, dt);
+      net_ns += dt;
+      bytes_transmitted += n;
+      st->bytes += n;
+      pacer_consume(&pacer, n);
     }
 
   again:
@@ -363,29 +826,66 @@ static int udp_send(struct args *args, int sockfd, char *buffer)
     td = (to.tv_sec - ta.tv_sec) * 1000000000LL + to.tv_nsec - ta.tv_nsec;
   } while (((args->transmit_bytes == 0) && (td < 10000000000LL)) ||
 	   ((args->transmit_bytes > 0) && (bytes_transmitted < args->transmit_bytes)));
+  zc_tx_finish(&tx, sockfd);
+  cpu_stop(&cpu);
+  cpu_close(&cpu);
 
+  interval_finish(&iv, td, bytes_transmitted, net_ns);
   printf("bytes transmitted: %zd B\nnet time: %lli ns\nruntime = %lli ns\n", bytes_transmitted, net_ns, td);
+  streams_print(args, streams, td);
+  latency_print(&hist);
+  zc_tx_print(&tx);
+  udp_batch_print(&batch);
+  if (args->bitrate > 0)
+    pace_print(&pacer, args->bitrate, bytes_transmitted, td);
+  print_cpu(args, &cpu, bytes_transmitted);
+  ctrl_report(args, bytes_transmitted, td, net_ns, cpu_time_ns(&cpu));
+  udp_batch_close(&batch);
+  zc_tx_close(&tx);
 
   return 0;
 }
 
-static int udp_recv(struct args *args, int sockfd, char *buffer)
+/*
+ * Datagrams are tracked per peer, a single stream takes all of them.
+ * Datagrams of peers beyond the streams of the test are only counted.
+ */
+static int udp_recv(struct args *args, struct stream *streams, int sockfd, char *buffer)
 {
   socklen_t addrlen;
   ssize_t bytes_transmitted = 0;
   struct sockaddr_in client_addr;
+  struct udp_batch batch;
   ssize_t n;
   long long net_ns = 0;
+  struct interval iv;
+  struct iptz_hist hist;
+  long long dt;
+  struct iptz_cpu cpu;
   struct timespec ta, ti, tj, to;
+  struct stream *st;
+  unsigned int npeers = 0;
   long long td;
+  long long last = 0; /* the last datagram, since the start */
+  long long verify_ns = 0;
+  int i;
 
+  if (udp_batch_open(&batch, args, sockfd, 0, buffer) == -1)
+    return -1;
   do {
+    addrlen = sizeof(client_addr);
     n = recvfrom(sockfd, buffer, args->blksize, MSG_PEEK, (struct sockaddr *)&client_addr, &addrlen);
   } while (n <= 0);
+  interval_init(&iv, args, "");
+  if (args->streams == 1)
+    iv.udp = &streams[0].udp;
+  hist_init(&hist);
+  cpu_open(&cpu, RUSAGE_SELF, args->counters);
+  cpu_start(&cpu);
   clock_gettime(CLOCK_REALTIME, &ta);
   do {
     clock_gettime(CLOCK_REALTIME, &ti);
-    n = recvfrom(sockfd, buffer, args->blksize, 0, (struct sockaddr *)&client_addr, &addrlen);
+    n = udp_batch_recv(&batch, sockfd);
     clock_gettime(CLOCK_REALTIME, &tj);
     if (n == -1) {
       switch (errno) {
@@ -393,39 +893,364 @@ static int udp_recv(struct args *args, int sockfd, char *buffer)
 	goto again;
       case ETIMEDOUT:
 	puts("Transmission timeout occurred");
+	udp_batch_close(&batch);
+	cpu_close(&cpu);
 	return errno;
       default:
-	perror("recvfrom");
+	perror("recvmmsg");
+	udp_batch_close(&batch);
+	cpu_close(&cpu);
 	return errno;
       }
     }
-    net_ns += (tj.tv_sec - ti.tv_sec) * 1000000000LL + tj.tv_nsec - ti.tv_nsec;
-    bytes_transmitted += n;
+    interval_report(&iv, (tj.tv_sec - ta.tv_sec) * 1000000000LL + tj.tv_nsec - ta.tv_nsec,
+		    bytes_transmitted, net_ns);
+    dt = (tj.tv_sec - ti.tv_sec) * 1000000000LL + tj.tv_nsec - ti.tv_nsec;
+    hist_record(&hist, dt);
+    net_ns += dt;
+    bytes_transmitted += batch.bytes;
+    last = (tj.tv_sec - ta.tv_sec) * 1000000000LL + tj.tv_nsec - ta.tv_nsec;
+    for (i = 0; i < n; i++) {
+      st = args->streams == 1 ? &streams[0] : udp_stream(args, streams, &npeers, &batch.addrs[i]);
+      if (st == NULL)
+	continue;
+      st->bytes += batch.msgs[i].msg_len;
+      udp_batch_track(&batch, i, &st->udp, tj.tv_sec * 1000000000LL + tj.tv_nsec);
+      if (args->verify)
+	udp_batch_verify(&batch, i, &st->verify);
+    }
+    if (args->verify) {
+      clock_gettime(CLOCK_REALTIME, &ti);
+      verify_ns += (ti.tv_sec - tj.tv_sec) * 1000000000LL + ti.tv_nsec - tj.tv_nsec;
+    }
   again:
     clock_gettime(CLOCK_REALTIME, &to);
     td = (to.tv_sec - ta.tv_sec) * 1000000000LL + to.tv_nsec - ta.tv_nsec;
-  } while (((args->transmit_bytes == 0) && (td < 10000000000LL)) ||
-	   ((args->transmit_bytes > 0) && (bytes_transmitted < args->transmit_bytes)));
+  } while ((td - last < DRAIN_NS) &&
+	   (((args->transmit_bytes == 0) && (td < 10000000000LL)) ||
+	    ((args->transmit_bytes > 0) && (bytes_transmitted < args->transmit_bytes))));
+  cpu_stop(&cpu);
+  cpu_close(&cpu);
+  /* Lost datagrams never make up the bytes, the test ends with the last one */
+  if (td - last >= DRAIN_NS) {
+    puts("The client stopped sending before the test was over");
+    td = last;
+  }
   
+  interval_finish(&iv, td, bytes_transmitted, net_ns);
   printf("bytes transmitted: %zd B\nnet time: %lli ns\nruntime = %lli ns\n", bytes_transmitted, net_ns, td);
+  streams_print(args, streams, td);
+  latency_print(&hist);
+  verify_print(args, streams, verify_ns, bytes_transmitted);
+  udp_batch_print(&batch);
+  for (i = 0; i < (int)args->streams; i++) {
+    if (args->streams > 1)
+      printf("[stream %d] ", i);
+    udp_print(&streams[i].udp);
+  }
+  print_cpu(args, &cpu, bytes_transmitted);
+  ctrl_report(args, bytes_transmitted, td, net_ns, cpu_time_ns(&cpu));
 
   // Drain the connection
   puts("Draining the connection for 2 seconds");
   clock_gettime(CLOCK_REALTIME, &ta);
   do {
-    n = recvfrom(sockfd, buffer, args->blksize, 0, (struct sockaddr *)&client_addr, &addrlen);
+    n = udp_batch_recv(&batch, sockfd);
     clock_gettime(CLOCK_REALTIME, &to);
     td = (to.tv_sec - ta.tv_sec) * 1000000000LL + to.tv_nsec - ta.tv_nsec;
   } while ((td < 2000000000LL) || (n > 0));
+  udp_batch_close(&batch);
+
+  return 0;
+}
+
+static int run_test(struct args *args, int *connection, int sockfd, char *buffer)
+{
+  struct stream streams[IPERFTZ_STREAMS_MAX];
+  unsigned int i;
+  int rc;
+
+  memset(streams, 0, sizeof(streams));
+  for (i = 0; i < args->streams; i++) {
+    streams[i].fd = connection[i];
+    udp_init(&streams[i].udp);
+    verify_init(&streams[i].verify, args->seed, args->blksize, args->protocol);
+  }
+
+  if (args->protocol == IPERFTZ_TCP) {
+    if (args->reverse == 0)
+      rc = tcp_recv(args, streams, buffer);
+    else
+      rc = tcp_send(args, streams, buffer);
+    for (i = 0; (i < args->streams) && (rc == 0); i++) {
+      if (args->streams > 1)
+	printf("Stream %u:\n", i);
+      rc = tcp_print_results(connection[i]);
+    }
+  } else {
+    if (args->reverse == 0)
+      rc = udp_recv(args, streams, sockfd, buffer);
+    else
+      rc = udp_send(args, streams, sockfd, buffer);
+  }
+
+  return rc;
+}
+
+static int recv_all(int fd, unsigned char *msg, size_t len)
+{
+  ssize_t n;
+  size_t bytes = 0;
+
+  while (bytes < len) {
+    n = recv(fd, msg + bytes, len - bytes, 0);
+    if ((n == -1) && (errno == EINTR))
+      continue;
+    if (n <= 0)
+      return -1;
+    bytes += n;
+  }
+  return 0;
+}
+
+/* Take over what the TA negotiated, returns 0 or the status for the TA */
+static int ctrl_configure(struct args *args, struct iptz_args *ta)
+{
+  if ((ta->blksize == 0) || (ta->socket_bufsize == 0) ||
+      (ta->protocol > IPERFTZ_UDP) || (ta->reverse > 1) ||
+      (ta->streams == 0) || (ta->streams > IPERFTZ_STREAMS_MAX)) {
+    fprintf(stderr, "Invalid test parameters\n");
+    return EINVAL;
+  }
+  args->blksize = ta->blksize;
+  args->socket_bufsize = ta->socket_bufsize;
+  args->bitrate = ta->bitrate;
+  args->burst = ta->burst;
+  args->transmit_bytes = ta->transmit_bytes;
+  if (ta->interval_msec > 0)
+    args->interval_ns = ta->interval_msec * 1000000LL;
+  args->protocol = ta->protocol;
+  args->reverse = ta->reverse;
+  args->streams = ta->streams;
+  args->seed = ta->seed;
+  if ((args->reverse && (args->zerocopy == ZC_MMAP)) ||
+      (!args->reverse && ((args->zerocopy == ZC_MSG) || (args->zerocopy == ZC_SENDFILE)))) {
+    fprintf(stderr, "Zero-copy mode '%s' is not available in this direction\n", zc_mode_name(args->zerocopy));
+    return EINVAL;
+  }
+  return 0;
+}
 
+/*
+ * Set up the data sockets of a negotiated test: a UDP socket on the
+ * port, or the next TCP connections from the TA's address on the
+ * listener, one per stream. Connections from elsewhere are refused
+ * meanwhile. The TA connects only after the reply, so the reply is sent
+ * from here. A TA that gives up closes the control connection instead.
+ */
+static int ctrl_accept(struct args *args,
+		       int listenfd,
+		       int ctrlfd,
+		       int *connection,
+		       int *sockfd)
+{
+  struct sockaddr_in addr, peer;
+  struct pollfd pfd[2];
+  unsigned char reply[CTRL_REPLY_LEN];
+  socklen_t addrlen;
+  unsigned int i = 0;
+  int fd;
+
+  addrlen = sizeof(peer);
+  if (getpeername(ctrlfd, (struct sockaddr *)&peer, &addrlen) == -1) {
+    perror("getpeername");
+    return -1;
+  }
+
+  if (args->protocol == IPERFTZ_UDP) {
+    *sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (*sockfd == -1) {
+      perror("socket");
+      return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(args->port);
+    if (bind(*sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+      perror("bind");
+      goto fail;
+    }
+  } else if (setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF, &args->socket_bufsize, sizeof(args->socket_bufsize)) == -1) {
+    perror("setsockopt");
+    return -1;
+  }
+
+  iptz_put32(reply, 0);
+  if (send(ctrlfd, reply, sizeof(reply), 0) != sizeof(reply)) {
+    perror("send");
+    goto fail;
+  }
+
+  if (args->protocol == IPERFTZ_UDP) {
+    if (set_nonblock(*sockfd) == -1)
+      goto fail;
+    return 0;
+  }
+
+  while (i < args->streams) {
+    pfd[0].fd = listenfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = ctrlfd;
+    pfd[1].events = POLLIN;
+    if (poll(pfd, 2, -1) == -1) {
+      perror("poll");
+      goto fail;
+    }
+    if (!(pfd[0].revents & POLLIN)) {
+      fprintf(stderr, "The client closed the control connection\n");
+      goto fail;
+    }
+    addrlen = sizeof(addr);
+    fd = accept(listenfd, (struct sockaddr *)&addr, &addrlen);
+    if (fd == -1) {
+      perror("accept");
+      goto fail;
+    }
+    if (addr.sin_addr.s_addr != peer.sin_addr.s_addr) {
+      fprintf(stderr, "Refusing a connection from %s during a test\n", inet_ntoa(addr.sin_addr));
+      close(fd);
+      continue;
+    }
+    connection[i++] = fd;
+    if (set_nonblock(fd) == -1)
+      goto fail;
+  }
   return 0;
+
+ fail:
+  while (i > 0) {
+    i--;
+    close(connection[i]);
+    connection[i] = -1;
+  }
+  if (*sockfd != -1) {
+    close(*sockfd);
+    *sockfd = -1;
+  }
+  return -1;
+}
+
+/*
+ * Serve one test after another, each negotiated by the TA through a
+ * control handshake (see iperfTZ_ctrl.h). Options the TA does not send,
+ * like the data path or the UDP batch depth, come from the command line.
+ */
+static int daemon_serve(struct args *defaults)
+{
+  struct sockaddr_in addr;
+  struct iptz_args ta;
+  struct args args;
+  unsigned char msg[CTRL_LEN];
+  unsigned char reply[CTRL_REPLY_LEN];
+  socklen_t addrlen;
+  char *buffer;
+  int connection[IPERFTZ_STREAMS_MAX];
+  int listenfd, ctrlfd, sockfd;
+  unsigned int i;
+  int on = 1;
+  int status;
+
+  signal(SIGPIPE, SIG_IGN);
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenfd == -1) {
+    perror("socket");
+    return EXIT_FAILURE;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(defaults->port);
+  if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) ||
+      (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+      (listen(listenfd, IPERFTZ_STREAMS_MAX + 1) == -1)) {
+    perror("listen");
+    close(listenfd);
+    return EXIT_FAILURE;
+  }
+
+  printf("Waiting for tests on port %u\n", defaults->port);
+  fflush(stdout);
+  for (;;) {
+    addrlen = sizeof(addr);
+    ctrlfd = accept(listenfd, (struct sockaddr *)&addr, &addrlen);
+    if (ctrlfd == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("accept");
+      break;
+    }
+    if ((recv_all(ctrlfd, msg, sizeof(msg)) == -1) || (ctrl_decode(msg, &ta) == -1)) {
+      fprintf(stderr, "Dropping a client without a valid handshake\n");
+      close(ctrlfd);
+      continue;
+    }
+
+    args = *defaults;
+    args.ctrlfd = ctrlfd;
+    status = ctrl_configure(&args, &ta);
+    buffer = NULL;
+    if (status == 0) {
+      buffer = init_buffer(&args);
+      if (buffer == NULL)
+	status = ENOMEM;
+    }
+    if (status != 0) {
+      iptz_put32(reply, status);
+      send(ctrlfd, reply, sizeof(reply), 0);
+      free(buffer);
+      close(ctrlfd);
+      continue;
+    }
+
+    printf("Test: %s %s, block size = %zd, buffer size = %zd",
+	   args.protocol == IPERFTZ_TCP ? "TCP" : "UDP",
+	   args.reverse ? "send" : "recv", args.blksize, args.socket_bufsize);
+    if (args.transmit_bytes > 0)
+      printf(", bytes to transmit = %ld", args.transmit_bytes);
+    if (args.bitrate > 0)
+      printf(", bitrate = %lu bit/s", args.bitrate);
+    if (args.streams > 1)
+      printf(", streams = %u", args.streams);
+    putchar('\n');
+
+    for (i = 0; i < IPERFTZ_STREAMS_MAX; i++)
+      connection[i] = -1;
+    sockfd = -1;
+    if (ctrl_accept(&args, listenfd, ctrlfd, connection, &sockfd) == 0)
+      run_test(&args, connection, sockfd, buffer);
+
+    free(buffer);
+    for (i = 0; i < IPERFTZ_STREAMS_MAX; i++)
+      if (connection[i] != -1)
+	close(connection[i]);
+    if (sockfd != -1)
+      close(sockfd);
+    close(ctrlfd);
+    fflush(stdout);
+  }
+
+  close(listenfd);
+  return EXIT_FAILURE;
 }
 
 int main(int argc, char *argv[])
 {
   char *buffer;
   int rc = EXIT_SUCCESS;
-  int connection, sockfd;
+  int connection[IPERFTZ_STREAMS_MAX];
+  int sockfd;
+  unsigned int i;
   struct args args;
 
   init_args(&args);
@@ -433,36 +1258,37 @@ int main(int argc, char *argv[])
   if (rc != 0)
     return rc;
   
+  if (args.daemon)
+    return daemon_serve(&args);
+
   printf("Block size = %zd\nBuffer size = %zd\n", args.blksize, args.socket_bufsize);
   if (args.transmit_bytes > 0)
     printf("Bytes to transmit = %ld\n", args.transmit_bytes);
+  if (args.streams > 1)
+    printf("Streams = %u\n", args.streams);
+
+  if (args.engine == ENGINE_EPOLL)
+    return epoll_serve(&args);
+  if (args.engine == ENGINE_URING)
+    return uring_serve(&args);
   
   buffer = init_buffer(&args);
   if (buffer == NULL)
     return EXIT_FAILURE;
 
-  rc = socket_setup(&args, &sockfd, &connection);
+  for (i = 0; i < IPERFTZ_STREAMS_MAX; i++)
+    connection[i] = -1;
+  rc = socket_setup(&args, &sockfd, connection);
   if (rc != 0)
     goto cleanup;
   
-  if (args.protocol == IPERFTZ_TCP) {
-    if (args.reverse == 0)
-      rc = tcp_recv(&args, connection, buffer);
-    else
-      rc = tcp_send(&args, connection, buffer);
-    if (rc == 0)
-      rc = tcp_print_results(connection);
-  } else {
-    if (args.reverse == 0)
-      rc = udp_recv(&args, sockfd, buffer);
-    else
-      rc = udp_send(&args, sockfd, buffer);
-  }
+  rc = run_test(&args, connection, sockfd, buffer);
   
  cleanup:
   free(buffer);
-  if (args.protocol == IPERFTZ_TCP)
-    close(connection);
+  for (i = 0; i < IPERFTZ_STREAMS_MAX; i++)
+    if (connection[i] != -1)
+      close(connection[i]);
   close(sockfd);
   
   return rc;
@@ -0,0 +1,278 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: server application header
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef IPERFTZ_SERVER_H
+#define IPERFTZ_SERVER_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <iperfTZ_cpu.h>
+#include <iperfTZ_hist.h>
+#include <iperfTZ_pacer.h>
+#include <iperfTZ_payload.h>
+#include <iperfTZ_udp.h>
+
+/* Server engines, selected with -e */
+enum engine {
+  ENGINE_SINGLE, /* one client, blocking loop (default) */
+  ENGINE_EPOLL,  /* many TCP and UDP clients, event loop */
+  ENGINE_URING   /* many TCP and UDP clients, io_uring completions */
+};
+
+/* Socket data paths, selected with -z */
+enum zc_mode {
+  ZC_COPY,    /* read()/write() on the buffer (default) */
+  ZC_SPLICE,  /* splice() through a pipe from a memfd or into /dev/null */
+  ZC_MMAP,    /* receive: TCP_ZEROCOPY_RECEIVE into a mapped window */
+  ZC_MSG,     /* transmit: MSG_ZEROCOPY with error queue completions */
+  ZC_SENDFILE /* transmit: sendfile() from a memfd */
+};
+
+struct args {
+  size_t blksize;
+  size_t socket_bufsize;
+  unsigned long int transmit_bytes;
+  unsigned int protocol;
+  unsigned long int bitrate;
+  size_t burst;         /* pacer bucket size, 0 for the default */
+  unsigned int pacing;  /* TCP senders paced by the kernel */
+  unsigned int reverse;
+  unsigned int engine;
+  unsigned int threads; /* epoll or io_uring workers, 0 for one per CPU */
+  unsigned int zerocopy;
+  unsigned int batch; /* UDP messages per syscall */
+  unsigned int gso;   /* UDP segmentation and receive offload */
+  long long interval_ns; /* report period, 0 for none */
+  unsigned int port;
+  unsigned int daemon;   /* tests negotiated by the TA, one after another */
+  int ctrlfd;            /* control connection of a daemon's test, or -1 */
+  unsigned int streams;  /* parallel connections of the single engine */
+  uint32_t seed;         /* of the payload pattern */
+  unsigned int verify;   /* check the pattern of received blocks */
+  unsigned int counters; /* hardware counters around the data loop */
+};
+
+struct zc_rx {
+  unsigned int mode;
+  size_t blksize;
+  char *buffer;
+  int pipefd[2];
+  int devnull;
+  void *addr;
+  size_t len;
+  unsigned long long mapped;
+  unsigned long long spliced;
+  unsigned long long copied;
+};
+
+struct zc_tx {
+  unsigned int mode;
+  size_t blksize;
+  char *buffer;
+  int memfd;
+  int pipefd[2];
+  size_t piped;
+  size_t pos;                     /* offset in the block of the next byte sent */
+  unsigned long long sends;       /* MSG_ZEROCOPY calls */
+  unsigned long long completions;
+  unsigned long long copied;      /* completions the kernel had to copy */
+  unsigned long long file_bytes;  /* sent with sendfile() or splice() */
+};
+
+#define RUNTIME_NS 10000000000LL /* default test duration */
+#define DRAIN_NS   2000000000LL  /* time to drain a connection after a test */
+#define PACER_GRANULARITY_NS 250000ULL /* nanosleep() and timer slack */
+
+static inline long long now_ns(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* Counters at the start of the running report interval */
+struct interval {
+  char tag[32];        /* printed in front of every report */
+  long long period_ns; /* 0 when disabled */
+  long long start_ns;  /* since the start of the test */
+  long long next_ns;
+  unsigned long long bytes;
+  long long net_ns;
+  struct iptz_udp *udp; /* UDP receivers */
+  uint64_t expected;
+  uint64_t lost;
+};
+
+#define UDP_BATCH_MAX 1024 /* UIO_MAXIOV */
+#define UDP_BATCH_CMSG CMSG_SPACE(sizeof(int))
+
+struct udp_batch {
+  unsigned int depth;
+  unsigned int segs; /* blocks per sent message, > 1 with GSO */
+  unsigned int gro;
+  size_t blksize;
+  size_t msgsize;
+  size_t bytes;      /* size of the last received batch */
+  char *buffer;
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct sockaddr_in *addrs;
+  char *control;
+  unsigned long long syscalls;
+  unsigned long long datagrams;
+};
+
+void block_fill(struct args *args, void *buffer);
+int tcp_print_results(int connection);
+void print_cpu(struct args *args, struct iptz_cpu *c, unsigned long long bytes);
+int pace_socket(struct args *args, int fd);
+void pace_sleep(struct iptz_pacer *p, long long ns);
+void latency_print(struct iptz_hist *h);
+void pace_print(struct iptz_pacer *p, unsigned long bitrate, unsigned long long bytes, long long runtime);
+void interval_init(struct interval *iv, struct args *args, const char *tag);
+void interval_report(struct interval *iv, long long t, unsigned long long bytes, long long net_ns);
+void interval_finish(struct interval *iv, long long t, unsigned long long bytes, long long net_ns);
+unsigned int batch_count(struct args *args, struct udp_batch *batch, unsigned long long bytes_transmitted);
+
+const char *zc_mode_name(unsigned int mode);
+int zc_mode_parse(const char *name, unsigned int *mode);
+int zc_rx_open(struct zc_rx *rx, struct args *args, int fd, char *buffer);
+ssize_t zc_rx_read(struct zc_rx *rx, int fd);
+void zc_rx_print(struct zc_rx *rx);
+void zc_rx_close(struct zc_rx *rx);
+int zc_tx_open(struct zc_tx *tx, struct args *args, int fd, unsigned int protocol, char *buffer);
+ssize_t zc_tx_send(struct zc_tx *tx, int fd, size_t len, const struct sockaddr *addr, socklen_t addrlen);
+int zc_tx_complete(struct zc_tx *tx, int fd);
+void zc_tx_finish(struct zc_tx *tx, int fd);
+void zc_tx_print(struct zc_tx *tx);
+void zc_tx_close(struct zc_tx *tx);
+
+int udp_batch_open(struct udp_batch *b, struct args *args, int fd, unsigned int reverse, char *block);
+int udp_batch_recv(struct udp_batch *b, int fd);
+unsigned int udp_batch_segments(struct udp_batch *b, unsigned int i);
+ssize_t udp_batch_send(struct udp_batch *b, int fd, struct zc_tx *tx, struct sockaddr_in *peer, unsigned int count, uint32_t *seq);
+void udp_batch_track(struct udp_batch *b, unsigned int i, struct iptz_udp *u, long long now);
+void udp_batch_verify(struct udp_batch *b, unsigned int i, struct iptz_verify *v);
+void udp_print(struct iptz_udp *u);
+void udp_batch_print(struct udp_batch *b);
+void udp_batch_close(struct udp_batch *b);
+
+enum flow_state {
+  FLOW_ACTIVE, /* measuring */
+  FLOW_DRAIN   /* test over, discarding leftovers */
+};
+
+/*
+ * A flow is one TCP connection or the datagrams of one UDP peer. UDP
+ * flows share the worker's socket and are demultiplexed by peer address.
+ */
+struct flow {
+  struct flow *next;  /* worker flow list */
+  struct flow *hnext; /* UDP peer hash chain */
+  int fd;
+  unsigned int worker;
+  unsigned int id;
+  unsigned int protocol;
+  unsigned int reverse;
+  unsigned int throttled;
+  enum flow_state state;
+  struct sockaddr_in peer;
+  struct zc_rx rx; /* TCP receivers */
+  struct zc_tx tx; /* TCP senders */
+  struct uring_flow *uring; /* io_uring engine requests */
+  struct iptz_pacer pacer;  /* senders */
+  long long due_ns;         /* throttled until */
+  struct interval iv;
+  struct iptz_hist hist;    /* time per call */
+  struct iptz_udp udp;      /* UDP receivers */
+  uint32_t seq;             /* UDP senders, next datagram */
+  unsigned long long bytes;
+  unsigned long long calls;
+  unsigned long long datagrams;
+  long long net_ns;
+  long long start_ns;
+  long long last_ns; /* last I/O */
+  long long end_ns;
+};
+
+#define UDP_HASH_SIZE 256
+
+/*
+ * Every worker owns a TCP listener and a UDP socket and an instance of its
+ * engine. With several workers the sockets share the port through
+ * SO_REUSEPORT and the kernel spreads connections and UDP peers across
+ * them, so a worker's flows and counters are only ever touched by its own
+ * thread.
+ */
+struct worker {
+  const struct engine_ops *ops;
+  struct args *args;
+  unsigned int index;
+  int cpu;
+  pthread_t thread;
+  int rc;
+  int listenfd;
+  int udpfd;
+  unsigned int throttled;
+  char *buffer;
+  struct flow *flows;
+  struct flow *udp_hash[UDP_HASH_SIZE];
+  unsigned int nflows;
+  unsigned int finished;
+  unsigned long long bytes;
+  long long net_ns;
+  struct iptz_cpu usage;  /* of the worker's thread */
+  /* epoll engine */
+  int epfd;
+  struct udp_batch batch;
+  struct zc_tx udp_tx;
+  unsigned int udp_out; /* EPOLLOUT armed on udpfd */
+  long long wake_ns;    /* earliest end of a throttle */
+  /* io_uring engine */
+  struct uring *ring;
+};
+
+struct engine_ops {
+  const char *name;
+  int (*setup)(struct worker *w);
+  int (*run)(struct worker *w);   /* until server_stop is set */
+  void (*cleanup)(struct worker *w);
+};
+
+extern volatile sig_atomic_t server_stop;
+
+struct flow *udp_lookup(struct worker *w, struct sockaddr_in *peer);
+struct flow *flow_new(struct worker *w, int fd, unsigned int protocol, struct sockaddr_in *peer, long long now);
+void flow_free(struct worker *w, struct flow *f);
+void flow_end(struct worker *w, struct flow *f, long long now);
+int flow_done(struct args *args, struct flow *f, long long now);
+void flow_account(struct flow *f, ssize_t n, long long ti, long long tj);
+int workers_serve(struct args *args, const struct engine_ops *ops);
+
+int epoll_serve(struct args *args);
+int uring_serve(struct args *args);
+
+#endif /* IPERFTZ_SERVER_H */
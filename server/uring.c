@@ -0,0 +1,986 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: io_uring multi-client server engine
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include <iperfTZ_ta.h>
+
+#include "server.h"
+
+#define URING_ENTRIES 256
+#define URING_SLOTS 1024   /* registered files: listener, UDP socket, TCP flows */
+#define URING_BUFS 64      /* provided receive buffers per group, power of 2 */
+#define TICK_NS 10000000LL /* housekeeping period */
+
+/* Registered files */
+#define SLOT_LISTEN 0
+#define SLOT_UDP    1
+
+/* Provided buffer groups */
+#define BGID_TCP 0
+#define BGID_UDP 1
+
+/*
+ * The low bits of a request's user_data name the operation, the others
+ * point at its flow. Worker requests carry no flow.
+ */
+enum uring_op {
+  OP_ACCEPT = 1, /* worker */
+  OP_UDP_RECV,   /* worker */
+  OP_CANCEL,     /* worker, completion ignored */
+  OP_RECV,       /* TCP receivers */
+  OP_SEND,       /* TCP and UDP senders */
+  OP_TIMER       /* throttled senders */
+};
+
+#define UD_OP_MASK 7ULL
+#define UD(f, op) ((uint64_t)(uintptr_t)(f) | (op))
+
+struct uring_flow {
+  int slot;              /* registered file, -1 for a plain descriptor */
+  unsigned int inflight; /* requests whose last completion is pending */
+  unsigned int closing;  /* released once inflight drops to 0 */
+  struct msghdr msg;     /* UDP senders */
+  struct iovec iov;
+  char *block;           /* stamped while the previous send completes */
+  size_t pos;            /* offset in the block of the next byte a TCP sender writes */
+  struct __kernel_timespec delay; /* throttled senders */
+};
+
+struct uring_pbuf {
+  struct io_uring_buf_ring *ring;
+  char *bufs;
+  size_t buflen;
+  unsigned short tail;
+};
+
+/*
+ * A ring set up with the raw system calls. All sockets live in the
+ * registered file table and the block buffer is registered for fixed
+ * writes. Receivers use multishot requests fed from provided buffer rings
+ * when the kernel has them and re-arm single-shot requests otherwise.
+ */
+struct uring {
+  int fd;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int sq_entries;
+  unsigned int sq_local; /* tail including unpublished entries */
+  struct io_uring_sqe *sqes;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_len;
+  size_t cq_ring_len;
+  size_t sqes_len;
+  int files[URING_SLOTS];
+  int free_slots[URING_SLOTS];
+  unsigned int nfree;
+  struct uring_pbuf pbuf[2];
+  unsigned int multishot; /* provided buffers and multishot receives */
+  unsigned int draining;  /* shutting down, nothing is re-armed */
+  unsigned int inflight;
+  /* Single-shot and template UDP receive */
+  struct msghdr udp_msg;
+  struct iovec udp_iov;
+  struct sockaddr_in udp_addr;
+  char *udp_buffer;
+  unsigned long long submissions;
+  unsigned long long enters;
+  unsigned long long completions;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd,
+			      unsigned int to_submit,
+			      unsigned int min_complete,
+			      unsigned int flags,
+			      void *arg,
+			      size_t argsz)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_open(struct uring *r)
+{
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = 4 * URING_ENTRIES;
+  r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+  if (r->fd == -1) {
+    perror("io_uring_setup");
+    return -1;
+  }
+  if (!(p.features & IORING_FEAT_EXT_ARG)) {
+    fprintf(stderr, "io_uring lacks timed waits, Linux 5.11 or later required\n");
+    return -1;
+  }
+
+  r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_ring_len > r->sq_ring_len)
+      r->sq_ring_len = r->cq_ring_len;
+    r->cq_ring_len = r->sq_ring_len;
+  }
+  r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_ring = r->sq_ring;
+  } else {
+    r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+      perror("mmap");
+      return -1;
+    }
+  }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+
+  r->sq_head = (unsigned int *)((char *)r->sq_ring + p.sq_off.head);
+  r->sq_tail = (unsigned int *)((char *)r->sq_ring + p.sq_off.tail);
+  r->sq_mask = (unsigned int *)((char *)r->sq_ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned int *)((char *)r->sq_ring + p.sq_off.array);
+  r->sq_entries = p.sq_entries;
+  r->sq_local = *r->sq_tail;
+  r->cq_head = (unsigned int *)((char *)r->cq_ring + p.cq_off.head);
+  r->cq_tail = (unsigned int *)((char *)r->cq_ring + p.cq_off.tail);
+  r->cq_mask = (unsigned int *)((char *)r->cq_ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+  return 0;
+}
+
+static void uring_close(struct uring *r)
+{
+  unsigned int i;
+
+  if ((r->sqes != NULL) && (r->sqes != MAP_FAILED))
+    munmap(r->sqes, r->sqes_len);
+  if ((r->cq_ring != NULL) && (r->cq_ring != MAP_FAILED) && (r->cq_ring != r->sq_ring))
+    munmap(r->cq_ring, r->cq_ring_len);
+  if ((r->sq_ring != NULL) && (r->sq_ring != MAP_FAILED))
+    munmap(r->sq_ring, r->sq_ring_len);
+  if (r->fd != -1) {
+    /* Ring teardown is asynchronous, let go of the sockets right away */
+    sys_io_uring_register(r->fd, IORING_UNREGISTER_FILES, NULL, 0);
+    close(r->fd);
+  }
+  for (i = 0; i < 2; i++) {
+    if (r->pbuf[i].ring != NULL)
+      munmap(r->pbuf[i].ring, URING_BUFS * sizeof(struct io_uring_buf));
+    free(r->pbuf[i].bufs);
+  }
+  free(r->udp_buffer);
+}
+
+/*
+ * Publish the queued submissions and optionally wait up to timeout for a
+ * completion.
+ */
+static int uring_enter(struct uring *r, unsigned int wait, long long timeout)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned int submit;
+  int n;
+
+  __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+  submit = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if ((submit == 0) && !wait)
+    return 0;
+
+  memset(&arg, 0, sizeof(arg));
+  ts.tv_sec = timeout / 1000000000LL;
+  ts.tv_nsec = timeout % 1000000000LL;
+  arg.ts = (uint64_t)(uintptr_t)&ts;
+  n = sys_io_uring_enter(r->fd, submit, wait ? 1 : 0,
+			 wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0,
+			 wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+  r->enters++;
+  if (n == -1) {
+    /* Timeouts, signals and a full completion queue end the wait early */
+    if ((errno == ETIME) || (errno == EINTR) || (errno == EBUSY) || (errno == EAGAIN))
+      return 0;
+    perror("io_uring_enter");
+    return -1;
+  }
+  r->submissions += n;
+
+  return 0;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r, int slot, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int idx;
+
+  if (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+    if (uring_enter(r, 0, 0) == -1)
+      return NULL;
+    if (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+      fprintf(stderr, "io_uring submission queue full\n");
+      return NULL;
+    }
+  }
+  idx = r->sq_local & *r->sq_mask;
+  sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = slot;
+  sqe->flags = slot >= 0 ? IOSQE_FIXED_FILE : 0;
+  sqe->user_data = user_data;
+  r->sq_array[idx] = idx;
+  r->sq_local++;
+  if ((user_data & UD_OP_MASK) != OP_CANCEL)
+    r->inflight++;
+
+  return sqe;
+}
+
+static void uring_pbuf_put(struct uring_pbuf *pb, unsigned short bid)
+{
+  struct io_uring_buf *buf = &pb->ring->bufs[pb->tail & (URING_BUFS - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t)(pb->bufs + bid * pb->buflen);
+  buf->len = pb->buflen;
+  buf->bid = bid;
+  pb->tail++;
+  __atomic_store_n(&pb->ring->tail, pb->tail, __ATOMIC_RELEASE);
+}
+
+static int uring_pbuf_open(struct uring *r, unsigned int bgid, size_t buflen)
+{
+  struct uring_pbuf *pb = &r->pbuf[bgid];
+  struct io_uring_buf_reg reg;
+  unsigned short i;
+
+  pb->buflen = buflen;
+  pb->ring = (struct io_uring_buf_ring *)mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+					      PROT_READ | PROT_WRITE,
+					      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pb->ring == MAP_FAILED) {
+    perror("mmap");
+    pb->ring = NULL;
+    return -1;
+  }
+  pb->bufs = (char *)malloc(URING_BUFS * buflen);
+  if (pb->bufs == NULL) {
+    perror("malloc");
+    return -1;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)pb->ring;
+  reg.ring_entries = URING_BUFS;
+  reg.bgid = bgid;
+  if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    return -1;
+  for (i = 0; i < URING_BUFS; i++)
+    uring_pbuf_put(pb, i);
+
+  return 0;
+}
+
+/* Hand the buffer of a completion back to its group */
+static void uring_pbuf_recycle(struct uring *r, unsigned int bgid, struct io_uring_cqe *cqe)
+{
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+    uring_pbuf_put(&r->pbuf[bgid], cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+static int uring_file_set(struct uring *r, int slot, int fd)
+{
+  struct io_uring_rsrc_update up;
+
+  memset(&up, 0, sizeof(up));
+  up.offset = slot;
+  up.data = (uint64_t)(uintptr_t)&fd;
+  if (sys_io_uring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) == -1) {
+    perror("io_uring_register");
+    return -1;
+  }
+  r->files[slot] = fd;
+  return 0;
+}
+
+static int uring_accept(struct worker *w)
+{
+  struct uring *r = w->ring;
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_sqe(r, SLOT_LISTEN, UD(NULL, OP_ACCEPT));
+  if (sqe == NULL)
+    return -1;
+  sqe->opcode = IORING_OP_ACCEPT;
+  if (r->multishot)
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  return 0;
+}
+
+static int uring_udp_recv(struct worker *w)
+{
+  struct uring *r = w->ring;
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_sqe(r, SLOT_UDP, UD(NULL, OP_UDP_RECV));
+  if (sqe == NULL)
+    return -1;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->addr = (uint64_t)(uintptr_t)&r->udp_msg;
+  sqe->len = 1;
+  r->udp_msg.msg_namelen = sizeof(r->udp_addr);
+  if (r->multishot) {
+    /* The buffer carries io_uring_recvmsg_out, name and payload */
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID_UDP;
+  }
+  return 0;
+}
+
+/* A TCP flow's registered file or, if none was free, its descriptor */
+static struct io_uring_sqe *uring_flow_sqe(struct uring *r, struct flow *f, unsigned int op)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_sqe(r, f->uring->slot, UD(f, op));
+  if ((sqe != NULL) && (f->uring->slot < 0))
+    sqe->fd = f->fd;
+  return sqe;
+}
+
+static int uring_recv(struct worker *w, struct flow *f)
+{
+  struct uring *r = w->ring;
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_flow_sqe(r, f, OP_RECV);
+  if (sqe == NULL)
+    return -1;
+  if (r->multishot) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID_TCP;
+  } else {
+    /* Every receiver reads into the registered block buffer */
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->addr = (uint64_t)(uintptr_t)w->buffer;
+    sqe->len = w->args->blksize;
+    sqe->buf_index = 0;
+  }
+  f->uring->inflight++;
+  return 0;
+}
+
+static int uring_send(struct worker *w, struct flow *f)
+{
+  struct uring *r = w->ring;
+  struct io_uring_sqe *sqe;
+
+  if (f->protocol == IPERFTZ_UDP) {
+    sqe = uring_sqe(r, SLOT_UDP, UD(f, OP_SEND));
+    if (sqe == NULL)
+      return -1;
+    if (w->args->blksize >= UDP_HDR_LEN)
+      udp_stamp(f->uring->block, f->seq, now_ns());
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uint64_t)(uintptr_t)&f->uring->msg;
+    sqe->len = 1;
+  } else {
+    sqe = uring_flow_sqe(r, f, OP_SEND);
+    if (sqe == NULL)
+      return -1;
+    /* A short write is continued, the stream repeats the block whole */
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->addr = (uint64_t)(uintptr_t)(w->buffer + f->uring->pos);
+    sqe->len = w->args->blksize - f->uring->pos;
+    sqe->buf_index = 0;
+  }
+  f->uring->inflight++;
+  return 0;
+}
+
+/* Sleep in the kernel until the pacer lets the sender go on */
+static int uring_throttle(struct worker *w, struct flow *f, long long delay)
+{
+  struct io_uring_sqe *sqe;
+
+  f->uring->delay.tv_sec = delay / 1000000000LL;
+  f->uring->delay.tv_nsec = delay % 1000000000LL;
+  sqe = uring_sqe(w->ring, -1, UD(f, OP_TIMER));
+  if (sqe == NULL)
+    return -1;
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uint64_t)(uintptr_t)&f->uring->delay;
+  sqe->len = 1;
+  pacer_slept(&f->pacer, delay);
+  f->uring->inflight++;
+  f->throttled = 1;
+  w->throttled++;
+  return 0;
+}
+
+/* Send the next block now or once the bitrate allows it */
+static int uring_pace(struct worker *w, struct flow *f, long long now)
+{
+  long long delay = pacer_delay(&f->pacer, w->args->blksize, now);
+
+  if (delay == 0)
+    return uring_send(w, f);
+  return uring_throttle(w, f, delay);
+}
+
+static void uring_cancel(struct uring *r, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_sqe(r, -1, UD(NULL, OP_CANCEL));
+  if (sqe == NULL)
+    return;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = user_data;
+}
+
+static struct flow *uring_flow_new(struct worker *w,
+				   int fd,
+				   unsigned int protocol,
+				   struct sockaddr_in *peer,
+				   long long now)
+{
+  struct uring *r = w->ring;
+  struct uring_flow *uf;
+  struct flow *f;
+
+  uf = (struct uring_flow *)calloc(1, sizeof(*uf));
+  if (uf == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  /* Every UDP sender numbers its datagrams in a block of its own */
+  if ((protocol == IPERFTZ_UDP) && w->args->reverse) {
+    uf->block = (char *)malloc(w->args->blksize);
+    if (uf->block == NULL) {
+      perror("malloc");
+      free(uf);
+      return NULL;
+    }
+    memcpy(uf->block, w->buffer, w->args->blksize);
+  }
+  f = flow_new(w, fd, protocol, peer, now);
+  if (f == NULL) {
+    free(uf->block);
+    free(uf);
+    return NULL;
+  }
+  f->uring = uf;
+  uf->slot = -1;
+  if (protocol == IPERFTZ_UDP) {
+    uf->iov.iov_base = uf->block;
+    uf->iov.iov_len = w->args->blksize;
+    uf->msg.msg_name = &f->peer;
+    uf->msg.msg_namelen = sizeof(f->peer);
+    uf->msg.msg_iov = &uf->iov;
+    uf->msg.msg_iovlen = 1;
+  } else if ((r->nfree > 0) && (uring_file_set(r, r->free_slots[r->nfree - 1], fd) == 0)) {
+    uf->slot = r->free_slots[--r->nfree];
+  }
+
+  return f;
+}
+
+static void uring_flow_release(struct worker *w, struct flow *f)
+{
+  struct uring *r = w->ring;
+
+  if (f->uring->slot >= 0) {
+    uring_file_set(r, f->uring->slot, -1);
+    r->free_slots[r->nfree++] = f->uring->slot;
+  }
+  free(f->uring->block);
+  free(f->uring);
+  flow_free(w, f);
+}
+
+/*
+ * Cancel the requests of a flow. It is released once none of them is in
+ * flight anymore.
+ */
+static void uring_flow_close(struct worker *w, struct flow *f)
+{
+  if (f->uring->closing)
+    return;
+  f->uring->closing = 1;
+  if (f->uring->inflight == 0)
+    return;
+  uring_cancel(w->ring, UD(f, OP_RECV));
+  uring_cancel(w->ring, UD(f, OP_SEND));
+  uring_cancel(w->ring, UD(f, OP_TIMER));
+}
+
+static void uring_flow_finish(struct worker *w, struct flow *f, long long now)
+{
+  flow_end(w, f, now);
+  /* Senders stop right away, receivers drain until the peer closes */
+  if ((f->protocol == IPERFTZ_TCP) && f->reverse)
+    uring_flow_close(w, f);
+}
+
+static void on_accept(struct worker *w, struct io_uring_cqe *cqe, long long now)
+{
+  struct uring *r = w->ring;
+  struct sockaddr_in peer;
+  socklen_t addrlen = sizeof(peer);
+  struct flow *f;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    if ((cqe->res == -EINVAL) && r->multishot) {
+      fprintf(stderr, "Multishot requests unavailable, re-arming single-shot requests\n");
+      r->multishot = 0;
+    }
+    uring_accept(w);
+  }
+  if (cqe->res < 0) {
+    if ((cqe->res != -EINVAL) && (cqe->res != -ECANCELED))
+      fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+    return;
+  }
+
+  memset(&peer, 0, sizeof(peer));
+  getpeername(cqe->res, (struct sockaddr *)&peer, &addrlen);
+  f = uring_flow_new(w, cqe->res, IPERFTZ_TCP, &peer, now);
+  if (f == NULL) {
+    close(cqe->res);
+    return;
+  }
+  if (f->reverse) {
+    zc_tx_open(&f->tx, w->args, f->fd, IPERFTZ_TCP, w->buffer);
+    uring_pace(w, f, now);
+  } else {
+    zc_rx_open(&f->rx, w->args, f->fd, w->buffer);
+    uring_recv(w, f);
+  }
+}
+
+static void on_recv(struct worker *w, struct flow *f, struct io_uring_cqe *cqe, long long now)
+{
+  struct uring *r = w->ring;
+
+  uring_pbuf_recycle(r, BGID_TCP, cqe);
+  if (cqe->res > 0) {
+    if (f->state == FLOW_ACTIVE) {
+      flow_account(f, cqe->res, now, now);
+      f->rx.copied += cqe->res;
+      if (flow_done(w->args, f, now))
+	uring_flow_finish(w, f, now);
+    }
+    if ((cqe->flags & IORING_CQE_F_MORE) || f->uring->closing)
+      return;
+    uring_recv(w, f);
+    return;
+  }
+
+  if ((cqe->res == -ENOBUFS) && !f->uring->closing) {
+    /* All provided buffers were taken, the multishot request ended */
+    uring_recv(w, f);
+    return;
+  }
+  if ((cqe->res == -EINVAL) && r->multishot && (f->calls == 0)) {
+    fprintf(stderr, "Multishot requests unavailable, re-arming single-shot requests\n");
+    r->multishot = 0;
+    uring_recv(w, f);
+    return;
+  }
+
+  /* The peer closed the connection or an error occurred */
+  if ((cqe->res < 0) && (cqe->res != -ECANCELED) && (cqe->res != -ECONNRESET))
+    fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+  if (f->state == FLOW_ACTIVE)
+    uring_flow_finish(w, f, now);
+  uring_flow_close(w, f);
+}
+
+static void on_send(struct worker *w, struct flow *f, struct io_uring_cqe *cqe, long long now)
+{
+  if (f->uring->closing)
+    return;
+  if (cqe->res < 0) {
+    if ((cqe->res != -EPIPE) && (cqe->res != -ECONNRESET))
+      fprintf(stderr, "%s: %s\n", f->protocol == IPERFTZ_UDP ? "sendmsg" : "write",
+	      strerror(-cqe->res));
+    if (f->state == FLOW_ACTIVE)
+      uring_flow_finish(w, f, now);
+    uring_flow_close(w, f);
+    return;
+  }
+  if (f->state != FLOW_ACTIVE)
+    return;
+
+  pacer_consume(&f->pacer, cqe->res);
+  flow_account(f, cqe->res, now, now);
+  if (f->protocol == IPERFTZ_UDP) {
+    f->datagrams++;
+    f->seq++;
+  } else {
+    f->uring->pos = (f->uring->pos + cqe->res) % w->args->blksize;
+  }
+  if (flow_done(w->args, f, now))
+    uring_flow_finish(w, f, now);
+  else
+    uring_pace(w, f, now);
+}
+
+static void on_timer(struct worker *w, struct flow *f, long long now)
+{
+  f->throttled = 0;
+  w->throttled--;
+  if (f->uring->closing || (f->state != FLOW_ACTIVE))
+    return;
+  if (flow_done(w->args, f, now))
+    uring_flow_finish(w, f, now);
+  else
+    uring_pace(w, f, now);
+}
+
+static void on_udp_datagram(struct worker *w,
+			    struct sockaddr_in *peer,
+			    char *payload,
+			    unsigned int len,
+			    long long now)
+{
+  struct flow *f;
+
+  f = udp_lookup(w, peer);
+  if (f == NULL) {
+    f = uring_flow_new(w, w->udpfd, IPERFTZ_UDP, peer, now);
+    if (f == NULL)
+      return;
+    /* The first datagram of a sending peer only announces it */
+    if (f->reverse) {
+      uring_pace(w, f, now);
+      return;
+    }
+  }
+  if ((f->state == FLOW_DRAIN) || f->reverse) {
+    f->last_ns = now;
+    return;
+  }
+  flow_account(f, len, now, now);
+  f->datagrams++;
+  udp_track(&f->udp, payload, len < w->args->blksize ? len : w->args->blksize, now);
+  if (flow_done(w->args, f, now))
+    uring_flow_finish(w, f, now);
+}
+
+static void on_udp_recv(struct worker *w, struct io_uring_cqe *cqe, long long now)
+{
+  struct uring *r = w->ring;
+  struct io_uring_recvmsg_out *out;
+  struct sockaddr_in peer;
+  char *buf;
+
+  if (cqe->res >= 0) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      buf = r->pbuf[BGID_UDP].bufs +
+	(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * r->pbuf[BGID_UDP].buflen;
+      out = (struct io_uring_recvmsg_out *)buf;
+      memset(&peer, 0, sizeof(peer));
+      memcpy(&peer, buf + sizeof(*out),
+	     out->namelen < sizeof(peer) ? out->namelen : sizeof(peer));
+      on_udp_datagram(w, &peer,
+		      buf + sizeof(*out) + r->udp_msg.msg_namelen + r->udp_msg.msg_controllen,
+		      out->payloadlen, now);
+      uring_pbuf_recycle(r, BGID_UDP, cqe);
+    } else {
+      on_udp_datagram(w, &r->udp_addr, r->udp_buffer, cqe->res, now);
+    }
+  } else if ((cqe->res == -EINVAL) && r->multishot) {
+    fprintf(stderr, "Multishot requests unavailable, re-arming single-shot requests\n");
+    r->multishot = 0;
+  } else if ((cqe->res != -ENOBUFS) && (cqe->res != -ECANCELED)) {
+    fprintf(stderr, "recvmsg: %s\n", strerror(-cqe->res));
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    uring_udp_recv(w);
+}
+
+static void uring_complete(struct worker *w, struct io_uring_cqe *cqe, long long now)
+{
+  struct uring *r = w->ring;
+  struct flow *f = (struct flow *)(uintptr_t)(cqe->user_data & ~UD_OP_MASK);
+  unsigned int op = cqe->user_data & UD_OP_MASK;
+
+  r->completions++;
+  if (op == OP_CANCEL)
+    return;
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    r->inflight--;
+    if (f != NULL)
+      f->uring->inflight--;
+  }
+  if (r->draining)
+    return;
+
+  switch (op) {
+  case OP_ACCEPT:
+    on_accept(w, cqe, now);
+    return;
+  case OP_UDP_RECV:
+    on_udp_recv(w, cqe, now);
+    return;
+  case OP_RECV:
+    on_recv(w, f, cqe, now);
+    break;
+  case OP_SEND:
+    on_send(w, f, cqe, now);
+    break;
+  case OP_TIMER:
+    on_timer(w, f, now);
+    break;
+  }
+  if (f->uring->closing && (f->uring->inflight == 0))
+    uring_flow_release(w, f);
+}
+
+static void uring_reap(struct worker *w)
+{
+  struct uring *r = w->ring;
+  struct io_uring_cqe cqe;
+  unsigned int head, tail;
+  long long now = now_ns();
+
+  head = *r->cq_head;
+  tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    cqe = r->cqes[head & *r->cq_mask];
+    head++;
+    /* Handlers may enter the ring, so hand the entry back first */
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    uring_complete(w, &cqe, now);
+    if (head == tail)
+      tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  }
+}
+
+/* Time-based state changes that no completion reports */
+static void uring_tick(struct worker *w, long long now)
+{
+  struct flow *f, *next;
+
+  for (f = w->flows; f != NULL; f = next) {
+    next = f->next;
+    if (f->uring->closing) {
+      /* Cancelled requests complete in a later reap */
+    } else if (f->state == FLOW_ACTIVE) {
+      if (f->reverse)
+	continue;
+      if (flow_done(w->args, f, now)) {
+	uring_flow_finish(w, f, now);
+      } else if ((f->protocol == IPERFTZ_UDP) &&
+		 (now - f->last_ns >= DRAIN_NS)) {
+	/* The peer stopped sending before the test was over */
+	uring_flow_finish(w, f, f->last_ns);
+      }
+    } else if (((f->protocol == IPERFTZ_TCP) && (now - f->end_ns >= DRAIN_NS)) ||
+	       ((f->protocol == IPERFTZ_UDP) && (now - f->last_ns >= DRAIN_NS))) {
+      uring_flow_close(w, f);
+    }
+    if (f->uring->closing && (f->uring->inflight == 0))
+      uring_flow_release(w, f);
+  }
+}
+
+static int uring_setup(struct worker *w)
+{
+  struct uring *r;
+  struct iovec iov;
+  unsigned int i;
+  int fd;
+
+  r = (struct uring *)calloc(1, sizeof(*r));
+  if (r == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  w->ring = r;
+  r->fd = -1;
+  if (uring_open(r) == -1)
+    return -1;
+
+  /* The ring waits for readiness itself, blocking sockets keep fixed reads and writes armed */
+  for (i = 0; i < 2; i++) {
+    fd = i == 0 ? w->listenfd : w->udpfd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  }
+
+  for (i = 0; i < URING_SLOTS; i++)
+    r->files[i] = -1;
+  r->files[SLOT_LISTEN] = w->listenfd;
+  r->files[SLOT_UDP] = w->udpfd;
+  if (sys_io_uring_register(r->fd, IORING_REGISTER_FILES, r->files, URING_SLOTS) == -1) {
+    perror("io_uring_register");
+    return -1;
+  }
+  for (i = URING_SLOTS; i > SLOT_UDP + 1; i--)
+    r->free_slots[r->nfree++] = i - 1;
+
+  iov.iov_base = w->buffer;
+  iov.iov_len = w->args->blksize;
+  if (sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, &iov, 1) == -1) {
+    perror("io_uring_register");
+    return -1;
+  }
+
+  r->udp_buffer = (char *)malloc(w->args->blksize);
+  if (r->udp_buffer == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  r->udp_iov.iov_base = r->udp_buffer;
+  r->udp_iov.iov_len = w->args->blksize;
+  r->udp_msg.msg_name = &r->udp_addr;
+  r->udp_msg.msg_iov = &r->udp_iov;
+  r->udp_msg.msg_iovlen = 1;
+
+  r->multishot = (uring_pbuf_open(r, BGID_TCP, w->args->blksize) == 0) &&
+    (uring_pbuf_open(r, BGID_UDP, sizeof(struct io_uring_recvmsg_out) +
+		     sizeof(struct sockaddr_in) + w->args->blksize) == 0);
+  if (!r->multishot)
+    fprintf(stderr, "Provided buffer rings unavailable, receiving with single-shot requests\n");
+
+  if ((uring_accept(w) == -1) || (uring_udp_recv(w) == -1))
+    return -1;
+
+  return 0;
+}
+
+static int uring_run(struct worker *w)
+{
+  long long now, tick = 0;
+
+  while (!server_stop) {
+    if (uring_enter(w->ring, 1, TICK_NS) == -1)
+      return errno;
+    uring_reap(w);
+
+    now = now_ns();
+    if (now - tick >= TICK_NS) {
+      uring_tick(w, now);
+      tick = now;
+    }
+  }
+
+  return 0;
+}
+
+static void uring_cleanup(struct worker *w)
+{
+  struct uring *r = w->ring;
+  struct io_uring_sqe *sqe;
+  struct flow *f;
+  long long now = now_ns(), deadline = now + DRAIN_NS;
+
+  if (r == NULL)
+    return;
+
+  for (f = w->flows; f != NULL; f = f->next)
+    if (f->state == FLOW_ACTIVE)
+      flow_end(w, f, now);
+
+  /* Cancel everything in flight before the buffers go away */
+  r->draining = 1;
+  if ((r->fd != -1) && (r->inflight > 0)) {
+    sqe = uring_sqe(r, -1, UD(NULL, OP_CANCEL));
+    if (sqe != NULL) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    }
+    while ((r->inflight > 0) && (now_ns() < deadline)) {
+      if (uring_enter(r, 1, TICK_NS) == -1)
+	break;
+      uring_reap(w);
+    }
+  }
+
+  while (w->flows != NULL) {
+    free(w->flows->uring);
+    flow_free(w, w->flows);
+  }
+  if (r->enters > 0)
+    printf("worker %u io_uring: %s receives, %llu submissions, %llu completions in %llu enters\n",
+	   w->index, r->multishot ? "multishot" : "single-shot",
+	   r->submissions, r->completions, r->enters);
+  uring_close(r);
+  free(r);
+  w->ring = NULL;
+}
+
+static const struct engine_ops uring_engine = {
+  .name = "io_uring",
+  .setup = uring_setup,
+  .run = uring_run,
+  .cleanup = uring_cleanup,
+};
+
+int uring_serve(struct args *args)
+{
+  return workers_serve(args, &uring_engine);
+}
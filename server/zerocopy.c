@@ -0,0 +1,439 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: zero-copy socket paths
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <linux/errqueue.h>
+#include <netinet/tcp.h>
+
+#include <iperfTZ_ta.h>
+
+#include "server.h"
+
+#define ZC_COMPLETE_PERIOD 64 /* zero-copy sends between error queue reads */
+
+const char *zc_mode_name(unsigned int mode)
+{
+  switch (mode) {
+  case ZC_SPLICE:
+    return "splice";
+  case ZC_MMAP:
+    return "mmap";
+  case ZC_MSG:
+    return "msg";
+  case ZC_SENDFILE:
+    return "sendfile";
+  default:
+    return "copy";
+  }
+}
+
+int zc_mode_parse(const char *name, unsigned int *mode)
+{
+  if (strcmp(name, "copy") == 0)
+    *mode = ZC_COPY;
+  else if (strcmp(name, "splice") == 0)
+    *mode = ZC_SPLICE;
+  else if (strcmp(name, "mmap") == 0)
+    *mode = ZC_MMAP;
+  else if (strcmp(name, "msg") == 0)
+    *mode = ZC_MSG;
+  else if (strcmp(name, "sendfile") == 0)
+    *mode = ZC_SENDFILE;
+  else
+    return -1;
+  return 0;
+}
+
+/*
+ * Prepare the receive path of a TCP connection. A path the kernel does
+ * not support falls back to copying, rx->mode reports the path in use.
+ */
+int zc_rx_open(struct zc_rx *rx, struct args *args, int fd, char *buffer)
+{
+  long pagesize = sysconf(_SC_PAGESIZE);
+
+  memset(rx, 0, sizeof(*rx));
+  rx->mode = args->zerocopy;
+  rx->buffer = buffer;
+  rx->blksize = args->blksize;
+  rx->pipefd[0] = -1;
+  rx->pipefd[1] = -1;
+  rx->devnull = -1;
+  rx->addr = MAP_FAILED;
+
+  switch (rx->mode) {
+  case ZC_SPLICE:
+    if (pipe2(rx->pipefd, O_NONBLOCK) == -1) {
+      perror("pipe2");
+      break;
+    }
+    /* A pipe as large as a block moves a block per splice() */
+    fcntl(rx->pipefd[1], F_SETPIPE_SZ, rx->blksize);
+    rx->devnull = open("/dev/null", O_WRONLY);
+    if (rx->devnull == -1) {
+      perror("open");
+      break;
+    }
+    return 0;
+  case ZC_MMAP:
+    rx->len = (rx->blksize + pagesize - 1) & ~(pagesize - 1);
+    rx->addr = mmap(NULL, rx->len, PROT_READ, MAP_SHARED, fd, 0);
+    if (rx->addr == MAP_FAILED) {
+      perror("mmap");
+      break;
+    }
+    return 0;
+  default:
+    return 0;
+  }
+
+  fprintf(stderr, "Falling back to copying receive path\n");
+  zc_rx_close(rx);
+  rx->mode = ZC_COPY;
+  return 0;
+}
+
+void zc_rx_close(struct zc_rx *rx)
+{
+  if (rx->pipefd[0] != -1)
+    close(rx->pipefd[0]);
+  if (rx->pipefd[1] != -1)
+    close(rx->pipefd[1]);
+  if (rx->devnull != -1)
+    close(rx->devnull);
+  if (rx->addr != MAP_FAILED)
+    munmap(rx->addr, rx->len);
+  rx->pipefd[0] = -1;
+  rx->pipefd[1] = -1;
+  rx->devnull = -1;
+  rx->addr = MAP_FAILED;
+}
+
+static ssize_t zc_rx_copy(struct zc_rx *rx, int fd, size_t len)
+{
+  ssize_t n;
+
+  n = read(fd, rx->buffer, len);
+  if (n > 0)
+    rx->copied += n;
+  return n;
+}
+
+static ssize_t zc_rx_splice(struct zc_rx *rx, int fd)
+{
+  ssize_t n, m, left;
+
+  n = splice(fd, NULL, rx->pipefd[1], NULL, rx->blksize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n <= 0)
+    return n;
+
+  for (left = n; left > 0; left -= m) {
+    m = splice(rx->pipefd[0], NULL, rx->devnull, NULL, left, SPLICE_F_MOVE);
+    if (m == -1) {
+      perror("splice");
+      return -1;
+    }
+  }
+  rx->spliced += n;
+
+  return n;
+}
+
+static ssize_t zc_rx_mmap(struct zc_rx *rx, int fd)
+{
+  struct tcp_zerocopy_receive zc;
+  socklen_t zclen = sizeof(zc);
+  ssize_t n;
+
+  memset(&zc, 0, sizeof(zc));
+  zc.address = (uint64_t)(unsigned long)rx->addr;
+  zc.length = rx->len;
+  /* Remaps the window, which also releases the pages of the previous call */
+  if (getsockopt(fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &zclen) == -1)
+    return -1;
+  rx->mapped += zc.length;
+
+  /* Data that does not fill whole pages has to be copied */
+  if (zc.recv_skip_hint > 0) {
+    n = zc_rx_copy(rx, fd, zc.recv_skip_hint < rx->blksize ? zc.recv_skip_hint : rx->blksize);
+    if (n == -1)
+      return zc.length > 0 ? (ssize_t)zc.length : -1;
+    return zc.length + n;
+  }
+  if (zc.length > 0)
+    return zc.length;
+
+  /* Nothing mapped: tells EOF apart from an empty receive queue */
+  return zc_rx_copy(rx, fd, rx->blksize);
+}
+
+/*
+ * Consume up to a block from a TCP connection without keeping the data.
+ * Same return convention as read().
+ */
+ssize_t zc_rx_read(struct zc_rx *rx, int fd)
+{
+  switch (rx->mode) {
+  case ZC_SPLICE:
+    return zc_rx_splice(rx, fd);
+  case ZC_MMAP:
+    return zc_rx_mmap(rx, fd);
+  default:
+    return zc_rx_copy(rx, fd, rx->blksize);
+  }
+}
+
+void zc_rx_print(struct zc_rx *rx)
+{
+  printf("rx path: %s (mapped %llu B, spliced %llu B, copied %llu B)\n",
+	 zc_mode_name(rx->mode), rx->mapped, rx->spliced, rx->copied);
+}
+
+/*
+ * Prepare the transmit path of a socket. MSG_ZEROCOPY sends straight from
+ * the block buffer, which is never written again and so needs no
+ * completion before reuse. sendfile() and splice() send from a memfd
+ * holding the pattern block and are only available for TCP.
+ */
+int zc_tx_open(struct zc_tx *tx,
+	       struct args *args,
+	       int fd,
+	       unsigned int protocol,
+	       char *buffer)
+{
+  void *block;
+  int on = 1;
+
+  memset(tx, 0, sizeof(*tx));
+  tx->mode = args->zerocopy;
+  tx->buffer = buffer;
+  tx->blksize = args->blksize;
+  tx->memfd = -1;
+  tx->pipefd[0] = -1;
+  tx->pipefd[1] = -1;
+
+  switch (tx->mode) {
+  case ZC_MSG:
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1) {
+      perror("setsockopt");
+      break;
+    }
+    return 0;
+  case ZC_SPLICE:
+  case ZC_SENDFILE:
+    if (protocol != IPERFTZ_TCP)
+      break;
+    tx->memfd = memfd_create("iperfTZ", 0);
+    if (tx->memfd == -1) {
+      perror("memfd_create");
+      break;
+    }
+    if (ftruncate(tx->memfd, tx->blksize) == -1) {
+      perror("ftruncate");
+      break;
+    }
+    block = mmap(NULL, tx->blksize, PROT_READ | PROT_WRITE, MAP_SHARED, tx->memfd, 0);
+    if (block == MAP_FAILED) {
+      perror("mmap");
+      break;
+    }
+    block_fill(args, block);
+    munmap(block, tx->blksize);
+    if (tx->mode == ZC_SENDFILE)
+      return 0;
+    if (pipe2(tx->pipefd, O_NONBLOCK) == -1) {
+      perror("pipe2");
+      break;
+    }
+    fcntl(tx->pipefd[1], F_SETPIPE_SZ, tx->blksize);
+    return 0;
+  default:
+    return 0;
+  }
+
+  fprintf(stderr, "Falling back to copying transmit path\n");
+  zc_tx_close(tx);
+  tx->mode = ZC_COPY;
+  return 0;
+}
+
+void zc_tx_close(struct zc_tx *tx)
+{
+  if (tx->memfd != -1)
+    close(tx->memfd);
+  if (tx->pipefd[0] != -1)
+    close(tx->pipefd[0]);
+  if (tx->pipefd[1] != -1)
+    close(tx->pipefd[1]);
+  tx->memfd = -1;
+  tx->pipefd[0] = -1;
+  tx->pipefd[1] = -1;
+}
+
+/* Read the zero-copy notifications queued so far without blocking */
+int zc_tx_complete(struct zc_tx *tx, int fd)
+{
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+  struct sock_extended_err *serr;
+  struct cmsghdr *cm;
+  struct msghdr msg;
+
+  if (tx->mode != ZC_MSG)
+    return 0;
+
+  for (;;) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+	return 0;
+      perror("recvmsg");
+      return -1;
+    }
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(((cm->cmsg_level == SOL_IP) && (cm->cmsg_type == IP_RECVERR)) ||
+	    ((cm->cmsg_level == SOL_IPV6) && (cm->cmsg_type == IPV6_RECVERR))))
+	continue;
+      serr = (struct sock_extended_err *)CMSG_DATA(cm);
+      if ((serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) || (serr->ee_errno != 0))
+	continue;
+      /* ee_info..ee_data is the range of send calls that completed */
+      tx->completions += serr->ee_data - serr->ee_info + 1;
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+	tx->copied += serr->ee_data - serr->ee_info + 1;
+    }
+  }
+}
+
+/* Wait up to a drain period for the notifications of outstanding sends */
+void zc_tx_finish(struct zc_tx *tx, int fd)
+{
+  struct pollfd pfd;
+  long long deadline = now_ns() + DRAIN_NS;
+
+  while ((tx->mode == ZC_MSG) && (tx->completions < tx->sends) &&
+	 (now_ns() < deadline)) {
+    pfd.fd = fd;
+    pfd.events = 0;
+    if (poll(&pfd, 1, 100) == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("poll");
+      return;
+    }
+    if (zc_tx_complete(tx, fd) == -1)
+      return;
+  }
+}
+
+static ssize_t zc_tx_splice(struct zc_tx *tx, int fd, size_t len)
+{
+  loff_t off = tx->pos;
+  ssize_t n;
+
+  /* Refill the pipe only after the socket took what was left in it */
+  if (tx->piped == 0) {
+    n = splice(tx->memfd, &off, tx->pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0)
+      return n;
+    tx->piped = n;
+  }
+  n = splice(tx->pipefd[0], NULL, fd, NULL, tx->piped < len ? tx->piped : len,
+	     SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+  if (n > 0) {
+    tx->piped -= n;
+    tx->file_bytes += n;
+  }
+  return n;
+}
+
+/*
+ * Send up to len bytes of the block on a socket, to addr for unconnected
+ * UDP sockets. Same return convention as sendto(). A TCP send continues
+ * the block where a short send stopped, so that the stream repeats the
+ * block whole and a receiver can verify its pattern.
+ */
+ssize_t zc_tx_send(struct zc_tx *tx,
+		   int fd,
+		   size_t len,
+		   const struct sockaddr *addr,
+		   socklen_t addrlen)
+{
+  off_t off = tx->pos;
+  ssize_t n;
+
+  if (len > tx->blksize - tx->pos)
+    len = tx->blksize - tx->pos;
+
+  switch (tx->mode) {
+  case ZC_MSG:
+    n = sendto(fd, tx->buffer + tx->pos, len, MSG_ZEROCOPY, addr, addrlen);
+    if (n == -1) {
+      /* Too many sends are pinning memory, collect completions and retry */
+      if (errno == ENOBUFS) {
+	zc_tx_complete(tx, fd);
+	errno = EAGAIN;
+      }
+      return n;
+    }
+    if ((++tx->sends % ZC_COMPLETE_PERIOD) == 0)
+      zc_tx_complete(tx, fd);
+    break;
+  case ZC_SENDFILE:
+    n = sendfile(fd, tx->memfd, &off, len);
+    if (n > 0)
+      tx->file_bytes += n;
+    break;
+  case ZC_SPLICE:
+    n = zc_tx_splice(tx, fd, len);
+    break;
+  default:
+    n = sendto(fd, tx->buffer + tx->pos, len, 0, addr, addrlen);
+  }
+
+  if (n > 0)
+    tx->pos = (tx->pos + n) % tx->blksize;
+  return n;
+}
+
+void zc_tx_print(struct zc_tx *tx)
+{
+  if (tx->mode == ZC_MSG)
+    printf("tx path: msg (sends %llu, completions %llu, copied by kernel %llu)\n",
+	   tx->sends, tx->completions, tx->copied);
+  else if (tx->mode != ZC_COPY)
+    printf("tx path: %s (from memfd %llu B)\n", zc_mode_name(tx->mode), tx->file_bytes);
+  else
+    puts("tx path: copy");
+}
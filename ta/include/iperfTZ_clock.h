@@ -0,0 +1,162 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: high-resolution clock of the TA
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef IPERFTZ_CLOCK_H
+#define IPERFTZ_CLOCK_H
+
+#include <stdint.h>
+#ifdef CFG_IPERFTZ_HOST
+#include <time.h>
+#endif
+
+#include <tee_internal_api.h>
+
+#include <iperfTZ_ta.h>
+
+/*
+ * TEE_GetSystemTime() counts milliseconds, too coarse for a block that
+ * crosses the worlds in microseconds. The TA reads the ARM generic timer's
+ * virtual counter instead, which Linux already opens to EL0 through
+ * CNTKCTL for its vDSO. Builds with CFG_IPERFTZ_COUNTER=n, or for other
+ * architectures, fall back to TEE_GetSystemTime(). The host build, see
+ * host/, counts the nanoseconds of CLOCK_MONOTONIC instead.
+ */
+#if defined(CFG_IPERFTZ_HOST)
+#define IPTZ_HAVE_COUNTER 1
+#define IPTZ_COUNTER_SOURCE IPERFTZ_CLOCK_MONOTONIC
+#elif defined(CFG_IPERFTZ_COUNTER) && (defined(__aarch64__) || defined(__arm__))
+#define IPTZ_HAVE_COUNTER 1
+#define IPTZ_COUNTER_SOURCE IPERFTZ_CLOCK_COUNTER
+#endif
+
+struct iptz_clock {
+  uint32_t source; /* enum iptz_clock_source */
+  uint64_t freq;   /* counter ticks per second */
+  uint64_t base;   /* counter at clock_init() */
+  uint64_t res_ns; /* smallest step of clock_now() */
+};
+
+#if defined(CFG_IPERFTZ_HOST)
+static inline uint64_t counter_read(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t counter_freq(void)
+{
+  return 1000000000ULL;
+}
+#elif defined(IPTZ_HAVE_COUNTER)
+static inline uint64_t counter_read(void)
+{
+  uint64_t v;
+
+#ifdef __aarch64__
+  __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r" (v) : : "memory");
+#else
+  __asm__ volatile("isb; mrrc p15, 1, %Q0, %R0, c14" : "=r" (v) : : "memory");
+#endif
+  return v;
+}
+
+static inline uint64_t counter_freq(void)
+{
+#ifdef __aarch64__
+  uint64_t v;
+
+  __asm__ volatile("mrs %0, cntfrq_el0" : "=r" (v));
+  return v;
+#else
+  uint32_t v;
+
+  __asm__ volatile("mrc p15, 0, %0, c14, c0, 0" : "=r" (v));
+  return v;
+#endif
+}
+#endif
+
+static inline uint64_t system_ns(void)
+{
+  TEE_Time t;
+
+  TEE_GetSystemTime(&t);
+  return t.seconds * 1000000000ULL + t.millis * 1000000ULL;
+}
+
+/* Wait for the system time to step, returns the time after the step */
+static inline uint64_t system_edge(void)
+{
+  uint64_t t0 = system_ns();
+  uint64_t t;
+
+  while ((t = system_ns()) == t0)
+    ;
+  return t;
+}
+
+/*
+ * Firmware that leaves CNTFRQ unset gets the counter's frequency measured
+ * against the system time over 100 ms, between two steps of the latter.
+ */
+static inline void clock_init(struct iptz_clock *c)
+{
+  uint64_t t0, t1;
+
+  c->source = IPERFTZ_CLOCK_SYSTEM;
+  c->freq = 0;
+  c->base = 0;
+#ifdef IPTZ_HAVE_COUNTER
+  c->freq = counter_freq();
+  if (c->freq == 0) {
+    t0 = system_edge();
+    c->base = counter_read();
+    TEE_Wait(100);
+    t1 = system_edge();
+    c->freq = (counter_read() - c->base) * 1000000000ULL / (t1 - t0);
+  }
+  if (c->freq > 0) {
+    c->source = IPTZ_COUNTER_SOURCE;
+    c->base = counter_read();
+    c->res_ns = (1000000000ULL + c->freq - 1) / c->freq;
+    return;
+  }
+#endif
+  /* The step of the system time, usually but not always 1 ms */
+  t0 = system_edge();
+  t1 = system_edge();
+  c->res_ns = t1 - t0;
+}
+
+/* Nanoseconds on a monotonic time line */
+static inline uint64_t clock_now(struct iptz_clock *c)
+{
+#ifdef IPTZ_HAVE_COUNTER
+  uint64_t d;
+
+  if (c->source == IPTZ_COUNTER_SOURCE) {
+    d = counter_read() - c->base;
+    return d / c->freq * 1000000000ULL + d % c->freq * 1000000000ULL / c->freq;
+  }
+#endif
+  return system_ns();
+}
+
+#endif /* IPERFTZ_CLOCK_H */
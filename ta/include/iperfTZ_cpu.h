@@ -0,0 +1,174 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: CPU accounting of the CA and the server
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef IPERFTZ_CPU_H
+#define IPERFTZ_CPU_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+/*
+ * Normal world only, the TA has neither. The hardware counters come from
+ * perf_event_open() for the calling thread and need a kernel with a PMU
+ * driver, without it only the times and context switches are counted.
+ * A perf_event_paranoid above 1 limits them to user space. Cycles a
+ * thread spends in the secure world are usually hidden from the normal
+ * world's counters, its system time includes them.
+ */
+enum cpu_counter {
+  CPU_CYCLES,
+  CPU_INSTRUCTIONS,
+  CPU_CACHE_MISSES,
+  CPU_COUNTERS
+};
+
+struct iptz_cpu {
+  int who;                /* RUSAGE_SELF or RUSAGE_THREAD */
+  int fd[CPU_COUNTERS];   /* -1 when not counted */
+  int error;              /* errno of the first counter that failed */
+  int user_only;          /* the kernel's share is not counted */
+  struct rusage ru;       /* at cpu_start(), the difference after cpu_stop() */
+  long long wall_ns;
+  long long thread_ns;    /* CPU time of the calling thread */
+  uint64_t count[CPU_COUNTERS];
+};
+
+static inline long long tv_ns(struct timeval *tv)
+{
+  return tv->tv_sec * 1000000000LL + tv->tv_usec * 1000LL;
+}
+
+static inline long long clock_ns(clockid_t id)
+{
+  struct timespec t;
+
+  clock_gettime(id, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static inline void cpu_close(struct iptz_cpu *c)
+{
+  int i;
+
+  for (i = 0; i < CPU_COUNTERS; i++)
+    if (c->fd[i] != -1) {
+      close(c->fd[i]);
+      c->fd[i] = -1;
+    }
+}
+
+/* Open the hardware counters if asked to, the rest needs no setup */
+static inline void cpu_open(struct iptz_cpu *c, int who, int counters)
+{
+  static const uint64_t config[CPU_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES
+  };
+  struct perf_event_attr attr;
+  int i;
+
+  memset(c, 0, sizeof(*c));
+  c->who = who;
+  c->error = counters ? 0 : ENOENT;
+  for (i = 0; i < CPU_COUNTERS; i++) {
+    c->fd[i] = -1;
+    if (!counters || (c->error != 0))
+      continue;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config[i];
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = c->user_only;
+    c->fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if ((c->fd[i] == -1) && (errno == EACCES) && !c->user_only) {
+      c->user_only = 1;
+      attr.exclude_kernel = 1;
+      c->fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (c->fd[i] == -1)
+      c->error = errno;
+  }
+  /* All or none, so that the ratios between them hold */
+  if (c->error != 0)
+    cpu_close(c);
+}
+
+static inline void cpu_start(struct iptz_cpu *c)
+{
+  int i;
+
+  for (i = 0; i < CPU_COUNTERS; i++)
+    if (c->fd[i] != -1) {
+      ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  getrusage(c->who, &c->ru);
+  c->thread_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  c->wall_ns = clock_ns(CLOCK_MONOTONIC);
+}
+
+/* Counters multiplexed with other events are scaled to the time enabled */
+static inline void cpu_stop(struct iptz_cpu *c)
+{
+  struct rusage ru;
+  uint64_t v[3];
+  int i;
+
+  c->wall_ns = clock_ns(CLOCK_MONOTONIC) - c->wall_ns;
+  c->thread_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - c->thread_ns;
+  getrusage(c->who, &ru);
+  timersub(&ru.ru_utime, &c->ru.ru_utime, &c->ru.ru_utime);
+  timersub(&ru.ru_stime, &c->ru.ru_stime, &c->ru.ru_stime);
+  c->ru.ru_nvcsw = ru.ru_nvcsw - c->ru.ru_nvcsw;
+  c->ru.ru_nivcsw = ru.ru_nivcsw - c->ru.ru_nivcsw;
+  for (i = 0; i < CPU_COUNTERS; i++) {
+    if (c->fd[i] == -1)
+      continue;
+    ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    if ((read(c->fd[i], v, sizeof(v)) != sizeof(v)) || (v[2] == 0))
+      c->count[i] = 0;
+    else
+      c->count[i] = v[2] < v[1] ? (double)v[0] * v[1] / v[2] : v[0];
+  }
+}
+
+/* User and system time between cpu_start() and cpu_stop() */
+static inline long long cpu_time_ns(struct iptz_cpu *c)
+{
+  return tv_ns(&c->ru.ru_utime) + tv_ns(&c->ru.ru_stime);
+}
+
+static inline int cpu_counted(struct iptz_cpu *c)
+{
+  return c->error == 0;
+}
+
+#endif /* IPERFTZ_CPU_H */
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: control handshake between the TA and a server daemon
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef IPERFTZ_CTRL_H
+#define IPERFTZ_CTRL_H
+
+#include <stdint.h>
+
+#include <iperfTZ_ta.h>
+
+/*
+ * Before a test the TA connects to the daemon's TCP port and sends the
+ * test parameters. The daemon sets the test up and answers with a status,
+ * 0 when the TA may connect its data sockets to the same port. The control
+ * connection stays open until the test is over, when the daemon sends
+ * what it measured as a report of 64-bit words.
+ */
+#define CTRL_MAGIC   0x69505a54 /* "iPZT" */
+#define CTRL_VERSION 4
+#define CTRL_WORDS   12
+#define CTRL_LEN     (CTRL_WORDS * 4)
+#define CTRL_REPLY_LEN 4
+#define CTRL_REPORT_LEN 32
+#define CTRL_REPORT_MSEC 5000 /* how long the TA waits for the report */
+
+static inline void ctrl_put64(unsigned char *p, uint64_t v)
+{
+  iptz_put32(p, v >> 32);
+  iptz_put32(p + 4, v);
+}
+
+static inline uint64_t ctrl_get64(const unsigned char *p)
+{
+  return ((uint64_t)iptz_get32(p) << 32) | iptz_get32(p + 4);
+}
+
+static inline void ctrl_encode(unsigned char *msg, const struct iptz_args *args)
+{
+  iptz_put32(msg, CTRL_MAGIC);
+  iptz_put32(msg + 4, CTRL_VERSION);
+  iptz_put32(msg + 8, args->blksize);
+  iptz_put32(msg + 12, args->socket_bufsize);
+  iptz_put32(msg + 16, args->bitrate);
+  iptz_put32(msg + 20, args->burst);
+  iptz_put32(msg + 24, args->transmit_bytes);
+  iptz_put32(msg + 28, args->interval_msec);
+  iptz_put32(msg + 32, args->protocol);
+  iptz_put32(msg + 36, args->reverse);
+  iptz_put32(msg + 40, args->streams);
+  iptz_put32(msg + 44, args->seed);
+}
+
+/* Returns 0, or -1 if msg is no handshake this version understands */
+static inline int ctrl_decode(const unsigned char *msg, struct iptz_args *args)
+{
+  if ((iptz_get32(msg) != CTRL_MAGIC) || (iptz_get32(msg + 4) != CTRL_VERSION))
+    return -1;
+  args->blksize = iptz_get32(msg + 8);
+  args->socket_bufsize = iptz_get32(msg + 12);
+  args->bitrate = iptz_get32(msg + 16);
+  args->burst = iptz_get32(msg + 20);
+  args->transmit_bytes = iptz_get32(msg + 24);
+  args->interval_msec = iptz_get32(msg + 28);
+  args->protocol = iptz_get32(msg + 32);
+  args->reverse = iptz_get32(msg + 36);
+  args->streams = iptz_get32(msg + 40);
+  args->seed = iptz_get32(msg + 44);
+  return 0;
+}
+
+static inline void ctrl_report_encode(unsigned char *msg, const struct iptz_report *r)
+{
+  ctrl_put64(msg, r->bytes);
+  ctrl_put64(msg + 8, r->runtime_ns);
+  ctrl_put64(msg + 16, r->net_ns);
+  ctrl_put64(msg + 24, r->cpu_ns);
+}
+
+static inline void ctrl_report_decode(const unsigned char *msg, struct iptz_report *r)
+{
+  r->bytes = ctrl_get64(msg);
+  r->runtime_ns = ctrl_get64(msg + 8);
+  r->net_ns = ctrl_get64(msg + 16);
+  r->cpu_ns = ctrl_get64(msg + 24);
+}
+
+#endif /* IPERFTZ_CTRL_H */
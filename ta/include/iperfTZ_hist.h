@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: latency histogram shared by the TA and the server
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef IPERFTZ_HIST_H
+#define IPERFTZ_HIST_H
+
+#include <stdint.h>
+
+#include <iperfTZ_ta.h>
+
+/*
+ * Log-linear buckets as in HdrHistogram: values below 2 * HIST_SUB count
+ * exactly, above every power of two is split into HIST_SUB buckets, which
+ * keeps the error of a recorded value below 1 / HIST_SUB (3 %). Values
+ * from 2^HIST_MAX_BITS ns (18 minutes) on land in the last bucket.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1U << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct iptz_hist {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t bucket[HIST_BUCKETS];
+};
+
+static inline void hist_init(struct iptz_hist *h)
+{
+  unsigned int i;
+
+  h->count = 0;
+  h->min = UINT64_MAX;
+  h->max = 0;
+  for (i = 0; i < HIST_BUCKETS; i++)
+    h->bucket[i] = 0;
+}
+
+static inline unsigned int hist_index(uint64_t v)
+{
+  unsigned int shift;
+
+  if (v < 2 * HIST_SUB)
+    return v;
+  if (v >> HIST_MAX_BITS)
+    return HIST_BUCKETS - 1;
+  shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+/* Largest value that falls into bucket i */
+static inline uint64_t hist_upper(unsigned int i)
+{
+  unsigned int shift;
+
+  if (i < 2 * HIST_SUB)
+    return i;
+  shift = i / HIST_SUB - 1;
+  return (((uint64_t)(i % HIST_SUB + HIST_SUB) + 1) << shift) - 1;
+}
+
+static inline void hist_record(struct iptz_hist *h, uint64_t v)
+{
+  h->bucket[hist_index(v)]++;
+  h->count++;
+  if (v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+}
+
+/* Value that permille of the recorded values do not exceed */
+static inline uint64_t hist_percentile(struct iptz_hist *h, unsigned int permille)
+{
+  uint64_t rank;
+  uint64_t seen = 0;
+  unsigned int i;
+
+  if (h->count == 0)
+    return 0;
+  rank = (h->count * permille + 999) / 1000;
+  if (rank == 0)
+    rank = 1;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->bucket[i];
+    if (seen >= rank)
+      return hist_upper(i) < h->max ? hist_upper(i) : h->max;
+  }
+  return h->max;
+}
+
+static inline void hist_summary(struct iptz_hist *h, struct iptz_latency *l)
+{
+  l->count = h->count;
+  l->min = h->count > 0 ? h->min : 0;
+  l->p50 = hist_percentile(h, 500);
+  l->p90 = hist_percentile(h, 900);
+  l->p99 = hist_percentile(h, 990);
+  l->p999 = hist_percentile(h, 999);
+  l->max = h->max;
+}
+
+#endif /* IPERFTZ_HIST_H */
@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: token-bucket pacer shared by the TA and the server
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef IPERFTZ_PACER_H
+#define IPERFTZ_PACER_H
+
+#include <stdint.h>
+
+/*
+ * Tokens are counted in bit nanoseconds, a byte is worth PACER_SCALE
+ * tokens. Refilling at rate bit/s for t ns then adds exactly rate * t
+ * tokens, so the pacer keeps the long-term rate without rounding drift
+ * however coarse the sender's clock or sleep is.
+ */
+#define PACER_SCALE     8000000000ULL
+#define PACER_BURST_MAX (1U << 30) /* keeps the bucket within 64 bits */
+
+struct iptz_pacer {
+  uint64_t rate;    /* bit/s, 0 for unlimited */
+  uint64_t depth;   /* bucket size in tokens */
+  uint64_t tokens;
+  uint64_t last_ns; /* last refill */
+  uint64_t waits;   /* times the sender slept */
+  uint64_t wait_ns; /* time the sender slept */
+};
+
+/*
+ * Bucket size in bytes: the requested burst, never less than a block, or
+ * by default a block plus what the rate delivers within the sender's
+ * wake-up granularity, so that waking up late does not cost tokens.
+ */
+static inline uint64_t pacer_burst(uint64_t rate,
+				   uint64_t burst,
+				   uint64_t blksize,
+				   uint64_t granularity_ns)
+{
+  if (burst == 0)
+    burst = blksize + rate / 8 * granularity_ns / 1000000000ULL;
+  if (burst < blksize)
+    burst = blksize;
+  if (burst > PACER_BURST_MAX)
+    burst = PACER_BURST_MAX;
+  return burst;
+}
+
+/* Start with a full bucket */
+static inline void pacer_init(struct iptz_pacer *p,
+			      uint64_t rate,
+			      uint64_t burst,
+			      uint64_t now_ns)
+{
+  p->rate = rate;
+  p->depth = burst * PACER_SCALE;
+  p->tokens = p->depth;
+  p->last_ns = now_ns;
+  p->waits = 0;
+  p->wait_ns = 0;
+}
+
+static inline void pacer_refill(struct iptz_pacer *p, uint64_t now_ns)
+{
+  uint64_t dt;
+
+  if (now_ns <= p->last_ns)
+    return;
+  dt = now_ns - p->last_ns;
+  p->last_ns = now_ns;
+  if (dt >= (p->depth - p->tokens) / p->rate + 1)
+    p->tokens = p->depth;
+  else
+    p->tokens += dt * p->rate;
+}
+
+/* Nanoseconds until len bytes may be sent, 0 if they may go right away */
+static inline uint64_t pacer_delay(struct iptz_pacer *p,
+				   uint64_t len,
+				   uint64_t now_ns)
+{
+  uint64_t need = len * PACER_SCALE;
+
+  if (p->rate == 0)
+    return 0;
+  pacer_refill(p, now_ns);
+  if (need > p->depth)
+    need = p->depth;
+  if (p->tokens >= need)
+    return 0;
+  return (need - p->tokens + p->rate - 1) / p->rate;
+}
+
+/* Messages of len bytes, at most max, that may be sent right away */
+static inline unsigned int pacer_count(struct iptz_pacer *p,
+				       uint64_t len,
+				       unsigned int max)
+{
+  uint64_t n;
+
+  if ((p->rate == 0) || (len == 0))
+    return max;
+  n = p->tokens / (len * PACER_SCALE);
+  if (n == 0)
+    n = 1;
+  return n < max ? n : max;
+}
+
+/* Take the tokens of bytes that were sent */
+static inline void pacer_consume(struct iptz_pacer *p, uint64_t bytes)
+{
+  uint64_t n = bytes * PACER_SCALE;
+
+  if (p->rate == 0)
+    return;
+  p->tokens = p->tokens > n ? p->tokens - n : 0;
+}
+
+static inline void pacer_slept(struct iptz_pacer *p, uint64_t ns)
+{
+  p->waits++;
+  p->wait_ns += ns;
+}
+
+#endif /* IPERFTZ_PACER_H */
@@ -26,7 +26,12 @@
 /* Command IDs */
 enum cmd_id {
   IPERFTZ_TA_RECV,
-  IPERFTZ_TA_SEND
+  IPERFTZ_TA_SEND,
+  IPERFTZ_TA_OPEN,     /* keep a test open in the session */
+  IPERFTZ_TA_TRANSFER, /* move blocks of the open test */
+  IPERFTZ_TA_CLOSE,    /* end the open test */
+  IPERFTZ_TA_NULL,     /* return right away, the cost of entering the TA */
+  IPERFTZ_TA_ECHO      /* copy an input memref into an output memref */
 };
 
 enum protocol {
@@ -34,29 +39,179 @@ enum protocol {
   IPERFTZ_UDP
 };
 
+/* Timestamp source of the TA */
+enum iptz_clock_source {
+  IPERFTZ_CLOCK_SYSTEM,   /* TEE_GetSystemTime() */
+  IPERFTZ_CLOCK_COUNTER,  /* ARM generic timer */
+  IPERFTZ_CLOCK_MONOTONIC /* CLOCK_MONOTONIC of a host build */
+};
+
+/* Where the TA's blocks come from or go to */
+enum iptz_payload {
+  IPERFTZ_PAYLOAD_TA,     /* private buffer of the TA */
+  IPERFTZ_PAYLOAD_SHARED, /* straight from or into the CA's shared memory */
+  IPERFTZ_PAYLOAD_COPY    /* copied between the shared memory and the TA's buffer */
+};
+
+/* Normal world payload the CA shares by default */
+#define IPERFTZ_PAYLOAD_SIZE (1024 * 1024)
+
 #define IPERFTZ_ADDRSTRLEN 46
+#define IPERFTZ_PORT 5002
 #define TCP_WINDOW_DEFAULT (16 * 1024)
 
 struct iptz_args {
   uint32_t blksize;
   uint32_t socket_bufsize;
   uint32_t bitrate;
+  uint32_t burst;    /* pacer bucket size, 0 for the default */
   uint32_t transmit_bytes;
+  uint32_t interval_msec; /* sample period, 0 for no samples */
   char ip[IPERFTZ_ADDRSTRLEN];
+  uint32_t port;
+  uint32_t control; /* negotiate the test with a server daemon */
+  uint32_t streams; /* parallel connections, blocks go round-robin */
+  uint32_t telemetry_msec; /* progress record period with a telemetry ring */
+  uint32_t payload; /* enum iptz_payload */
+  uint32_t seed;    /* of the payload pattern */
+  uint32_t verify;  /* receivers check the pattern of every block */
   uint32_t protocol;
   uint32_t reverse;
 };
 
+#define IPERFTZ_INTERVALS_MAX 256
+
+/* One sample of the time series, counters are for the interval only */
+struct iptz_interval {
+  uint32_t end_msec;    /* since the start of the test */
+  uint32_t bytes;
+  uint32_t cycles;
+  uint32_t worlds_usec; /* world switch time */
+  uint32_t lost;        /* UDP datagrams */
+  uint32_t jitter_usec; /* UDP interarrival jitter at the end */
+};
+
+/* Distribution of the time per block in ns */
+struct iptz_latency {
+  uint64_t count;
+  uint64_t min;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+};
+
+/* Datagrams a UDP receiver expected and got */
+struct iptz_loss {
+  uint64_t datagrams;
+  uint64_t expected;
+  uint64_t lost;
+  uint64_t duplicates;
+  uint64_t reordered;
+  uint64_t jitter; /* ns */
+};
+
+/* What the server measured of a test, see iperfTZ_ctrl.h */
+struct iptz_report {
+  uint64_t bytes;
+  uint64_t runtime_ns;
+  uint64_t net_ns; /* inside socket calls */
+  uint64_t cpu_ns;
+};
+
+#define IPERFTZ_STREAMS_MAX 16
+
+/* What one of the parallel connections carried */
+struct iptz_stream {
+  uint32_t bytes;
+  uint32_t cycles;
+  uint64_t worlds_ns;
+  struct iptz_loss loss;
+};
+
 struct iptz_results {
   uint32_t worlds_sec;   /* world switch time seconds */
   uint32_t worlds_msec;  /* world switch time milliseconds */
   uint32_t runtime_sec;  /* runtime seconds */
   uint32_t runtime_msec; /* runtime milliseconds */
+  uint64_t worlds_ns;    /* world switch time */
+  uint64_t runtime_ns;
+  uint32_t clock;        /* enum iptz_clock_source */
+  uint32_t clock_res_ns; /* resolution of the TA's clock */
+  uint64_t buffer_setup_ns; /* getting the block buffer at the start */
+  uint64_t buffer_fill_ns;  /* filling it with random bytes, when it last was */
+  uint32_t buffer_reused;   /* the session's buffer was filled before */
+  uint64_t verify_blocks;   /* blocks or datagrams checked */
+  uint64_t verify_errors;   /* of them not matching the pattern */
+  uint64_t verify_ns;       /* time spent checking */
+  uint64_t invoke_ns;       /* inside the TA, summed over the test's invocations */
+  uint64_t returned_ns;     /* of the runtime, back in the CA between invocations */
+  uint64_t connect_ns;      /* opening the sockets and the control handshake */
+  uint64_t report_ns;       /* waiting for the server's report */
+  uint64_t close_ns;        /* closing the sockets */
+  uint32_t reported;        /* the server's report is valid */
+  uint32_t drained;         /* a UDP receive ended as the sender went quiet */
+  struct iptz_report server;
   uint32_t cycles;
   uint32_t zcycles;
   uint32_t bytes_transmitted;
+  uint32_t pacer_waits;     /* times the pacer slept */
+  uint32_t pacer_wait_msec; /* time the pacer slept */
+  struct iptz_latency latency;
+  struct iptz_loss loss;
+  uint32_t intervals;       /* samples taken, may exceed the array */
+  struct iptz_interval interval[IPERFTZ_INTERVALS_MAX];
+  uint32_t streams;
+  struct iptz_stream stream[IPERFTZ_STREAMS_MAX];
+};
+
+#define IPERFTZ_RECORDS 256 /* power of two */
+
+/* Progress of a running test, counters are totals since the start */
+struct iptz_record {
+  uint64_t time_ns; /* since the start of the test, TA clock */
+  uint64_t bytes;
+  uint32_t cycles;
+  uint32_t errors;  /* socket calls that failed */
+  uint64_t lost;    /* UDP datagrams */
+};
+
+enum iptz_telemetry_state {
+  IPERFTZ_TELEMETRY_IDLE,
+  IPERFTZ_TELEMETRY_RUNNING,
+  IPERFTZ_TELEMETRY_DONE
+};
+
+/*
+ * Ring of progress records in shared memory that the TA writes while the
+ * test runs, the optional third parameter of a test. Only the TA writes
+ * records and head, only the CA writes stop. head counts the records
+ * ever written and is stored after the record it publishes, a reader
+ * that finds head moved by a whole ring while copying a record drops it.
+ */
+struct iptz_telemetry {
+  uint32_t head;
+  uint32_t state; /* enum iptz_telemetry_state */
+  uint32_t stop;  /* the CA asks the TA to end the test early */
+  uint32_t reserved;
+  struct iptz_record record[IPERFTZ_RECORDS];
 };
 
 #define BUFFER_SIZE (128 * 1024)
 
+/* Wire format of header fields and control messages, network byte order */
+static inline void iptz_put32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline uint32_t iptz_get32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
 #endif /* IPERFTZ_TA_H */
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ * iperfTZ: UDP datagram header and receiver statistics
+ * Copyright (C) 2019  Christian Göttel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef IPERFTZ_UDP_H
+#define IPERFTZ_UDP_H
+
+#include <stdint.h>
+
+#include <iperfTZ_ta.h>
+
+/*
+ * Every datagram starts with a sequence number and the sender's clock in
+ * seconds and nanoseconds, each 32 bits in network byte order. Only the
+ * difference of the two clocks matters for the jitter, so the sender's
+ * and the receiver's clocks need not be synchronized.
+ */
+#define UDP_HDR_LEN 12
+#define UDP_WINDOW  1024 /* latest sequence numbers checked for duplicates */
+#define UDP_DRAIN_MSEC 2000 /* a receiver ends the test after a quiet sender */
+
+struct iptz_udp {
+  uint64_t datagrams;  /* with a header, duplicates included */
+  uint64_t duplicates;
+  uint64_t reordered;  /* arrived after a later one */
+  uint64_t next;       /* highest sequence number seen + 1 */
+  int64_t transit;     /* of the previous datagram */
+  uint64_t jitter;     /* ns, scaled by 16 */
+  uint64_t window[UDP_WINDOW / 64];
+};
+
+static inline void udp_stamp(void *datagram, uint32_t seq, uint64_t now_ns)
+{
+  unsigned char *p = (unsigned char *)datagram;
+
+  iptz_put32(p, seq);
+  iptz_put32(p + 4, now_ns / 1000000000ULL);
+  iptz_put32(p + 8, now_ns % 1000000000ULL);
+}
+
+static inline void udp_init(struct iptz_udp *u)
+{
+  unsigned int i;
+
+  u->datagrams = 0;
+  u->duplicates = 0;
+  u->reordered = 0;
+  u->next = 0;
+  u->transit = 0;
+  u->jitter = 0;
+  for (i = 0; i < UDP_WINDOW / 64; i++)
+    u->window[i] = 0;
+}
+
+static inline int udp_seen(struct iptz_udp *u, uint64_t seq)
+{
+  return (u->window[(seq / 64) % (UDP_WINDOW / 64)] >> (seq % 64)) & 1;
+}
+
+static inline void udp_mark(struct iptz_udp *u, uint64_t seq, int on)
+{
+  uint64_t *w = &u->window[(seq / 64) % (UDP_WINDOW / 64)];
+
+  if (on)
+    *w |= 1ULL << (seq % 64);
+  else
+    *w &= ~(1ULL << (seq % 64));
+}
+
+/* Account a received datagram, len bytes of which are at datagram */
+static inline void udp_track(struct iptz_udp *u,
+			     const void *datagram,
+			     uint32_t len,
+			     uint64_t now_ns)
+{
+  const unsigned char *p = (const unsigned char *)datagram;
+  uint64_t seq;
+  int64_t transit, d;
+
+  if (len < UDP_HDR_LEN)
+    return;
+  seq = iptz_get32(p);
+
+  /* RFC 3550 interarrival jitter, J += (|D| - J) / 16 */
+  transit = now_ns - (iptz_get32(p + 4) * 1000000000ULL + iptz_get32(p + 8));
+  if (u->datagrams > 0) {
+    d = transit - u->transit;
+    if (d < 0)
+      d = -d;
+    u->jitter += d - u->jitter / 16;
+  }
+  u->transit = transit;
+  u->datagrams++;
+
+  if (seq >= u->next) {
+    if (seq - u->next >= UDP_WINDOW) {
+      unsigned int i;
+
+      for (i = 0; i < UDP_WINDOW / 64; i++)
+	u->window[i] = 0;
+    } else {
+      for (; u->next < seq; u->next++)
+	udp_mark(u, u->next, 0);
+    }
+    udp_mark(u, seq, 1);
+    u->next = seq + 1;
+  } else if (u->next - seq > UDP_WINDOW) {
+    /* Too late to tell a duplicate */
+    u->reordered++;
+  } else if (udp_seen(u, seq)) {
+    u->duplicates++;
+  } else {
+    udp_mark(u, seq, 1);
+    u->reordered++;
+  }
+}
+
+static inline uint64_t udp_lost(struct iptz_udp *u)
+{
+  uint64_t unique = u->datagrams - u->duplicates;
+
+  return u->next > unique ? u->next - unique : 0;
+}
+
+static inline void udp_summary(struct iptz_udp *u, struct iptz_loss *l)
+{
+  l->datagrams = u->datagrams;
+  l->expected = u->next;
+  l->lost = udp_lost(u);
+  l->duplicates = u->duplicates;
+  l->reordered = u->reordered;
+  l->jitter = u->jitter / 16;
+}
+
+#endif /* IPERFTZ_UDP_H */
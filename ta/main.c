@@ -26,9 +26,93 @@
 #include <__tee_tcpsocket_defines_extensions.h>
 #include <tee_udpsocket.h>
 
+#include <iperfTZ_clock.h>
+#include <iperfTZ_ctrl.h>
+#include <iperfTZ_hist.h>
+#include <iperfTZ_pacer.h>
+#include <iperfTZ_payload.h>
 #include <iperfTZ_ta.h>
+#include <iperfTZ_udp.h>
 
-static void init_results(struct iptz_results *results)
+/* TEE_Wait() sleeps in milliseconds */
+#define PACER_GRANULARITY_NS 2000000ULL
+
+/* Cache line of the block buffer */
+#define POOL_ALIGN 64
+
+static struct iptz_clock clk;
+
+/* A connection of the test and what the TA tracks of it */
+struct stream {
+  TEE_iSocketHandle ctx;
+  TEE_tcpSocket_Setup tcpSetup;
+  TEE_udpSocket_Setup udpSetup;
+  struct iptz_udp udp; /* UDP receivers */
+  uint32_t seq;        /* UDP senders */
+  struct iptz_verify verify; /* receivers checking the pattern */
+};
+
+/*
+ * Block buffer of a session. It grows to the largest block a test asked
+ * for and holds the payload pattern, which is only written again when
+ * it grows, the seed changes or a test received or copied data into it.
+ * Later tests reuse it as it is.
+ */
+struct pool {
+  char *mem;
+  char *buffer; /* aligned to POOL_ALIGN */
+  uint32_t size;
+  uint32_t seed;
+  int dirty;
+  uint64_t fill_ns;
+};
+
+/* Counters at the start of the running interval */
+struct sampler {
+  uint32_t start_msec;
+  uint32_t next_msec;
+  uint32_t bytes;
+  uint32_t cycles;
+  uint64_t worlds_ns;
+  struct test *udp; /* UDP receivers */
+  uint64_t lost;
+};
+
+/* A test from its connections to its counters */
+struct test {
+  struct iptz_args args;
+  TEE_iSocket *socket;
+  struct stream *streams;
+  uint32_t nstreams;
+  uint32_t next; /* stream of the next block */
+  TEE_iSocketHandle ctrlCtx;
+  TEE_tcpSocket_Setup ctrlSetup;
+  struct iptz_hist *hist;
+  char *buffer;  /* of the session's pool */
+  uint64_t setup_ns;
+  uint64_t connect_ns;
+  uint32_t reused;
+  uint64_t fill_ns;
+  uint64_t verify_ns;
+  char *payload; /* normal world memory of the invocation, or NULL */
+  uint32_t payload_blocks;
+  uint32_t block; /* of the payload, next to go */
+  struct iptz_pacer pacer; /* senders */
+  struct sampler sampler;
+  uint64_t start;
+  uint64_t last; /* UDP receivers, the latest datagram */
+};
+
+/* A test kept open across invocations of the session, one at a time */
+struct session {
+  struct test t;
+  struct iptz_results results;
+  int open;
+  uint64_t returned; /* when the last invocation of the test returned */
+  struct pool pool;
+};
+
+static void init_results(struct iptz_results *results, uint32_t streams)
 {
   results->cycles = 0;
   results->zcycles = 0;
@@ -37,6 +121,133 @@ static void init_results(struct iptz_results *results)
   results->worlds_msec = 0;
   results->runtime_sec = 0;
   results->runtime_msec = 1;
+  results->worlds_ns = 0;
+  results->runtime_ns = 0;
+  results->clock = clk.source;
+  results->clock_res_ns = clk.res_ns;
+  results->buffer_setup_ns = 0;
+  results->buffer_fill_ns = 0;
+  results->buffer_reused = 0;
+  results->verify_blocks = 0;
+  results->verify_errors = 0;
+  results->verify_ns = 0;
+  results->invoke_ns = 0;
+  results->returned_ns = 0;
+  results->connect_ns = 0;
+  results->report_ns = 0;
+  results->close_ns = 0;
+  results->reported = 0;
+  results->drained = 0;
+  TEE_MemFill(&results->server, 0, sizeof(results->server));
+  results->pacer_waits = 0;
+  results->pacer_wait_msec = 0;
+  results->latency.count = 0;
+  TEE_MemFill(&results->loss, 0, sizeof(results->loss));
+  results->intervals = 0;
+  results->streams = streams;
+  TEE_MemFill(results->stream, 0, sizeof(results->stream));
+}
+
+/* Datagrams lost on all streams so far */
+static uint64_t test_lost(struct test *t)
+{
+  uint64_t lost = 0;
+  uint32_t i;
+
+  for (i = 0; i < t->nstreams; i++)
+    lost += udp_lost(&t->streams[i].udp);
+  return lost;
+}
+
+/* Mean jitter of the streams in ns */
+static uint64_t test_jitter(struct test *t)
+{
+  uint64_t jitter = 0;
+  uint32_t i;
+
+  for (i = 0; i < t->nstreams; i++)
+    jitter += t->streams[i].udp.jitter / 16;
+  return jitter / t->nstreams;
+}
+
+/* Per-stream loss and its sum over the streams */
+static void summarize_loss(struct iptz_results *results, struct test *t)
+{
+  struct iptz_loss *l;
+  uint64_t expected;
+  uint32_t i;
+
+  TEE_MemFill(&results->loss, 0, sizeof(results->loss));
+  for (i = 0; i < t->nstreams; i++) {
+    l = &results->stream[i].loss;
+    udp_summary(&t->streams[i].udp, l);
+    results->loss.datagrams += l->datagrams;
+    results->loss.expected += l->expected;
+    results->loss.lost += l->lost;
+    results->loss.duplicates += l->duplicates;
+    results->loss.reordered += l->reordered;
+  }
+  results->loss.jitter = test_jitter(t);
+  /* Datagrams after the last one received, the sender sends whole blocks */
+  if (!results->drained)
+    return;
+  expected = ((uint64_t)t->args.transmit_bytes + t->args.blksize - 1) / t->args.blksize;
+  if (expected > results->loss.expected) {
+    results->loss.lost += expected - results->loss.expected;
+    results->loss.expected = expected;
+  }
+}
+
+static void init_sampler(struct sampler *s,
+			 struct iptz_args *args,
+			 struct test *udp)
+{
+  s->start_msec = 0;
+  s->next_msec = args->interval_msec;
+  s->bytes = 0;
+  s->cycles = 0;
+  s->worlds_ns = 0;
+  s->udp = udp;
+  s->lost = 0;
+}
+
+/*
+ * Close the running interval once the runtime passed its end, or the last
+ * one at the end of the test. Samples beyond the array are only counted.
+ */
+static void sample(struct sampler *s,
+		   struct iptz_args *args,
+		   struct iptz_results *results,
+		   int last)
+{
+  struct iptz_interval *iv;
+  uint32_t runtime;
+
+  if (args->interval_msec == 0)
+    return;
+  runtime = results->runtime_ns / 1000000;
+  if ((!last && (runtime < s->next_msec)) || (runtime <= s->start_msec))
+    return;
+
+  if (results->intervals < IPERFTZ_INTERVALS_MAX) {
+    iv = &results->interval[results->intervals];
+    iv->end_msec = runtime;
+    iv->bytes = results->bytes_transmitted - s->bytes;
+    iv->cycles = results->cycles - s->cycles;
+    iv->worlds_usec = (results->worlds_ns - s->worlds_ns) / 1000;
+    iv->lost = s->udp != NULL ? test_lost(s->udp) - s->lost : 0;
+    iv->jitter_usec = s->udp != NULL ? test_jitter(s->udp) / 1000 : 0;
+  }
+  results->intervals++;
+
+  s->start_msec = runtime;
+  s->bytes = results->bytes_transmitted;
+  s->cycles = results->cycles;
+  s->worlds_ns = results->worlds_ns;
+  if (s->udp != NULL)
+    s->lost = test_lost(s->udp);
+  while (s->next_msec <= runtime)
+    s->next_msec += args->interval_msec;
 }
 
 static TEE_Result tcp_connect(TEE_tcpSocket_Setup *setup,
@@ -51,7 +262,7 @@ static TEE_Result tcp_connect(TEE_tcpSocket_Setup *setup,
 
   setup->ipVersion = TEE_IP_VERSION_DC;
   setup->server_addr = args->ip;
-  setup->server_port = 5002U;
+  setup->server_port = args->port;
 
   res = TEE_tcpSocket->open(ctx, setup, &protocolError);
   if (res != TEE_SUCCESS) {
@@ -79,7 +290,7 @@ static TEE_Result udp_connect(TEE_udpSocket_Setup *setup,
   
   setup->ipVersion = TEE_IP_VERSION_DC;
   setup->server_addr = args->ip;
-  setup->server_port = 5002U;
+  setup->server_port = args->port;
 
   res = TEE_udpSocket->open(ctx, setup, &protocolError);
   if (res != TEE_SUCCESS) {
@@ -91,210 +302,749 @@ static TEE_Result udp_connect(TEE_udpSocket_Setup *setup,
   return TEE_SUCCESS;
 }
 
-static char *init_buffer(struct iptz_args *args)
+/* Hand the test parameters to a server daemon, see iperfTZ_ctrl.h */
+static TEE_Result ctrl_connect(TEE_tcpSocket_Setup *setup,
+			       TEE_iSocketHandle *ctx,
+			       struct iptz_args *args)
 {
-  char *buffer;
-  buffer = (char *)TEE_Malloc(args->blksize, TEE_MALLOC_FILL_ZERO);
-  if (buffer == NULL)
-    return buffer;
-  
-  TEE_GenerateRandom(buffer, args->blksize);
-  return buffer;
+  unsigned char msg[CTRL_LEN];
+  uint32_t buflen;
+  uint32_t bytes;
+  uint32_t protocolError;
+  TEE_Result res;
+
+  setup->ipVersion = TEE_IP_VERSION_DC;
+  setup->server_addr = args->ip;
+  setup->server_port = args->port;
+
+  res = TEE_tcpSocket->open(ctx, setup, &protocolError);
+  if (res != TEE_SUCCESS) {
+    EMSG("open() failed for the control connection. Return code: %#0" PRIX32
+	 ", protocol error: %#0" PRIX32, res, protocolError);
+    return res;
+  }
+
+  ctrl_encode(msg, args);
+  bytes = 0;
+  do {
+    buflen = CTRL_LEN - bytes;
+    res = TEE_tcpSocket->send(*ctx, msg + bytes, &buflen, TEE_TIMEOUT_INFINITE);
+    bytes += buflen;
+  } while ((bytes < CTRL_LEN) && (res == TEE_SUCCESS));
+
+  bytes = 0;
+  while ((bytes < CTRL_REPLY_LEN) && (res == TEE_SUCCESS)) {
+    buflen = CTRL_REPLY_LEN - bytes;
+    res = TEE_tcpSocket->recv(*ctx, msg + bytes, &buflen, TEE_TIMEOUT_INFINITE);
+    if ((res == TEE_SUCCESS) && (buflen == 0))
+      res = TEE_ERROR_COMMUNICATION;
+    bytes += buflen;
+  }
+  if ((res == TEE_SUCCESS) && (iptz_get32(msg) != 0)) {
+    EMSG("The server refused the test. Status: %" PRIu32, iptz_get32(msg));
+    res = TEE_ERROR_COMMUNICATION;
+  }
+  if (res != TEE_SUCCESS) {
+    EMSG("Control handshake failed. Return code: %#0" PRIX32, res);
+    TEE_tcpSocket->close(*ctx);
+  }
+
+  return res;
 }
 
-static TEE_Result iperfTZ_recv(uint32_t param_types, TEE_Param params[4])
+/* What the server daemon measured, sent at the end of the test */
+static TEE_Result ctrl_report(TEE_iSocketHandle ctx, struct iptz_report *r)
 {
-  TEE_iSocket *socket = NULL;
-  TEE_iSocketHandle socketCtx;
-  TEE_Result res;
-  TEE_tcpSocket_Setup tcpSetup;
-  TEE_udpSocket_Setup udpSetup;
-  TEE_Time ta, ti, to;
-  struct iptz_args *args;
-  char *buffer;
+  unsigned char msg[CTRL_REPORT_LEN];
   uint32_t buflen;
-  uint32_t diff;
-  struct iptz_results *results;
+  uint32_t bytes = 0;
+  TEE_Result res = TEE_SUCCESS;
+
+  while ((bytes < CTRL_REPORT_LEN) && (res == TEE_SUCCESS)) {
+    buflen = CTRL_REPORT_LEN - bytes;
+    res = TEE_tcpSocket->recv(ctx, msg + bytes, &buflen, CTRL_REPORT_MSEC);
+    if ((res == TEE_SUCCESS) && (buflen == 0))
+      res = TEE_ERROR_COMMUNICATION;
+    bytes += buflen;
+  }
+  if (res != TEE_SUCCESS) {
+    EMSG("No report from the server. Return code: %#0" PRIX32, res);
+    return res;
+  }
+  ctrl_report_decode(msg, r);
+
+  return res;
+}
+
+/* A buffer of at least size bytes, NULL when out of memory */
+static char *pool_get(struct pool *p, uint32_t size, uint32_t seed, uint32_t *reused)
+{
+  char *mem;
+  uint64_t t;
+
+  *reused = (size <= p->size) && (seed == p->seed) && !p->dirty;
+  if (*reused)
+    return p->buffer;
+
+  if (size > p->size) {
+    mem = (char *)TEE_Malloc(size + POOL_ALIGN - 1, 0);
+    if (mem == NULL)
+      return NULL;
+    TEE_Free(p->mem);
+    p->mem = mem;
+    p->buffer = (char *)(((uintptr_t)mem + POOL_ALIGN - 1) & ~(uintptr_t)(POOL_ALIGN - 1));
+    p->size = size;
+  }
+
+  /* Every block size sees the same pattern, a prefix of the buffer's */
+  t = clock_now(&clk);
+  pattern_fill(p->buffer, p->size, seed);
+  p->fill_ns = clock_now(&clk) - t;
+  p->seed = seed;
+  p->dirty = 0;
+  return p->buffer;
+}
+
+static void pool_free(struct pool *p)
+{
+  TEE_Free(p->mem);
+  p->mem = NULL;
+  p->buffer = NULL;
+  p->size = 0;
+}
+
+/* Where progress goes while the test runs, ring is NULL without a ring */
+struct telemetry {
+  struct iptz_telemetry *ring;
+  uint64_t period_ns;
+  uint64_t next_ns;
+  uint32_t errors;
+};
+
+/*
+ * Tests take the arguments, the results and optionally a telemetry ring
+ * and a payload. Without a period from the CA the ring gets a record
+ * every 100 ms.
+ */
+static TEE_Result check_params(uint32_t param_types,
+			       TEE_Param params[4],
+			       struct telemetry *tel)
+{
+  struct iptz_args *args;
   uint32_t exp_param_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
 					     TEE_PARAM_TYPE_MEMREF_OUTPUT,
 					     TEE_PARAM_TYPE_NONE,
 					     TEE_PARAM_TYPE_NONE);
-  if (param_types != exp_param_types)
+  uint32_t tel_type = TEE_PARAM_TYPE_GET(param_types, 2);
+  uint32_t payload_type = TEE_PARAM_TYPE_GET(param_types, 3);
+
+  tel->ring = NULL;
+  tel->errors = 0;
+  if ((tel_type != TEE_PARAM_TYPE_NONE) && (tel_type != TEE_PARAM_TYPE_MEMREF_INOUT))
+    return TEE_ERROR_BAD_PARAMETERS;
+  if ((payload_type != TEE_PARAM_TYPE_NONE) && (payload_type != TEE_PARAM_TYPE_MEMREF_INOUT))
+    return TEE_ERROR_BAD_PARAMETERS;
+  if (TEE_PARAM_TYPES(TEE_PARAM_TYPE_GET(param_types, 0),
+		      TEE_PARAM_TYPE_GET(param_types, 1),
+		      TEE_PARAM_TYPE_NONE,
+		      TEE_PARAM_TYPE_NONE) != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+  if ((params[0].memref.size < sizeof(struct iptz_args)) ||
+      (params[1].memref.size < sizeof(struct iptz_results)))
+    return TEE_ERROR_BAD_PARAMETERS;
+  if (tel_type == TEE_PARAM_TYPE_NONE)
+    return TEE_SUCCESS;
+  if (params[2].memref.size < sizeof(struct iptz_telemetry))
     return TEE_ERROR_BAD_PARAMETERS;
 
   args = (struct iptz_args *)params[0].memref.buffer;
-  results = (struct iptz_results *)params[1].memref.buffer;
+  tel->ring = (struct iptz_telemetry *)params[2].memref.buffer;
+  tel->period_ns = (args->telemetry_msec > 0 ? args->telemetry_msec : 100) * 1000000ULL;
+  tel->next_ns = 0;
+  tel->ring->head = 0;
+  __atomic_store_n(&tel->ring->state, IPERFTZ_TELEMETRY_RUNNING, __ATOMIC_RELEASE);
+  return TEE_SUCCESS;
+}
+
+/*
+ * Take the payload of an invocation, if the CA passed one. Shared memory
+ * is only mapped during the invocation, so a test kept open gets it anew
+ * with every transfer and moves on through it where it left off.
+ */
+static TEE_Result test_payload(struct test *t, uint32_t type, TEE_Param *param)
+{
+  t->payload = NULL;
+  if (type == TEE_PARAM_TYPE_NONE) {
+    if (t->args.payload != IPERFTZ_PAYLOAD_TA)
+      return TEE_ERROR_BAD_PARAMETERS;
+    return TEE_SUCCESS;
+  }
+  if ((t->args.payload == IPERFTZ_PAYLOAD_TA) ||
+      (param->memref.size < t->args.blksize))
+    return TEE_ERROR_BAD_PARAMETERS;
 
-  buffer = init_buffer(args);
-  if (buffer == NULL)
-    return TEE_ERROR_OUT_OF_MEMORY;
+  t->payload = (char *)param->memref.buffer;
+  t->payload_blocks = param->memref.size / t->args.blksize;
+  if (t->block >= t->payload_blocks)
+    t->block = 0;
+  return TEE_SUCCESS;
+}
 
-  if (args->protocol == IPERFTZ_TCP) {
-    socket = TEE_tcpSocket;
-    res = tcp_connect(&tcpSetup, &socketCtx, args, TEE_TCP_SET_RECVBUF);
-  } else {
-    socket = TEE_udpSocket;
-    res = udp_connect(&udpSetup, &socketCtx, args);
+/*
+ * Memory of the next block: the TA's own buffer, or the payload's next
+ * block unless the TA copies it, which send_block() and recv_block() do
+ * before sending and after receiving.
+ */
+static char *test_data(struct test *t)
+{
+  if ((t->payload == NULL) || (t->args.payload == IPERFTZ_PAYLOAD_COPY))
+    return t->buffer;
+  return t->payload + t->block * t->args.blksize;
+}
+
+static void test_advance(struct test *t)
+{
+  t->next = (t->next + 1) % t->nstreams;
+  if (t->payload != NULL)
+    t->block = (t->block + 1) % t->payload_blocks;
+}
+
+/* Write a record once the period is over, and the last one at the end */
+static void publish(struct telemetry *tel,
+		    struct iptz_results *results,
+		    struct test *udp,
+		    int last)
+{
+  struct iptz_record *r;
+  uint32_t head;
+
+  if ((tel->ring == NULL) || (!last && (results->runtime_ns < tel->next_ns)))
+    return;
+
+  head = tel->ring->head;
+  r = &tel->ring->record[head % IPERFTZ_RECORDS];
+  r->time_ns = results->runtime_ns;
+  r->bytes = results->bytes_transmitted;
+  r->cycles = results->cycles;
+  r->errors = tel->errors;
+  r->lost = udp != NULL ? test_lost(udp) : 0;
+  __atomic_store_n(&tel->ring->head, head + 1, __ATOMIC_RELEASE);
+  if (last)
+    __atomic_store_n(&tel->ring->state, IPERFTZ_TELEMETRY_DONE, __ATOMIC_RELEASE);
+
+  while (tel->next_ns <= results->runtime_ns)
+    tel->next_ns += tel->period_ns;
+}
+
+/* The CA ends a test early through the ring, the results still count */
+static int stopped(struct telemetry *tel)
+{
+  return (tel->ring != NULL) && __atomic_load_n(&tel->ring->stop, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Open the test's data sockets and, with a server daemon, the control
+ * connection before them. On failure everything opened is closed again.
+ */
+static TEE_Result test_open(struct test *t,
+			    struct pool *pool,
+			    struct iptz_args *args,
+			    uint32_t reverse)
+{
+  TEE_Result res = TEE_SUCCESS;
+  uint64_t start;
+  uint32_t i;
+
+  TEE_MemMove(&t->args, args, sizeof(t->args));
+  args = &t->args;
+  args->reverse = reverse;
+  t->nstreams = args->streams == 0 ? 1 : args->streams;
+  if (t->nstreams > IPERFTZ_STREAMS_MAX)
+    t->nstreams = IPERFTZ_STREAMS_MAX;
+  t->socket = args->protocol == IPERFTZ_TCP ? TEE_tcpSocket : TEE_udpSocket;
+  t->payload = NULL;
+
+  t->streams = (struct stream *)TEE_Malloc(t->nstreams * sizeof(*t->streams), TEE_MALLOC_FILL_ZERO);
+  t->hist = (struct iptz_hist *)TEE_Malloc(sizeof(*t->hist), 0);
+  start = clock_now(&clk);
+  t->buffer = pool_get(pool, args->blksize, args->seed, &t->reused);
+  t->setup_ns = clock_now(&clk) - start;
+  t->fill_ns = pool->fill_ns;
+  /* Receivers and copied payloads overwrite the pattern */
+  if (reverse || (args->payload == IPERFTZ_PAYLOAD_COPY))
+    pool->dirty = 1;
+  if ((t->streams == NULL) || (t->hist == NULL) || (t->buffer == NULL)) {
+    res = TEE_ERROR_OUT_OF_MEMORY;
+    goto err;
   }
-  if (res != TEE_SUCCESS)
+  hist_init(t->hist);
+
+  start = clock_now(&clk);
+  if (args->control) {
+    res = ctrl_connect(&t->ctrlSetup, &t->ctrlCtx, args);
+    if (res != TEE_SUCCESS)
+      goto err;
+  }
+
+  for (i = 0; i < t->nstreams; i++) {
+    if (args->protocol == IPERFTZ_TCP)
+      res = tcp_connect(&t->streams[i].tcpSetup, &t->streams[i].ctx, args,
+			args->reverse ? TEE_TCP_SET_RECVBUF : TEE_TCP_SET_SENDBUF);
+    else
+      res = udp_connect(&t->streams[i].udpSetup, &t->streams[i].ctx, args);
+    if (res != TEE_SUCCESS)
+      break;
+    udp_init(&t->streams[i].udp);
+    verify_init(&t->streams[i].verify, args->seed, args->blksize, args->protocol);
+  }
+  t->connect_ns = clock_now(&clk) - start;
+  if (res == TEE_SUCCESS)
     return res;
 
-  init_results(results);
+  while (i-- > 0)
+    t->socket->close(t->streams[i].ctx);
+  if (args->control)
+    TEE_tcpSocket->close(t->ctrlCtx);
+ err:
+  TEE_Free(t->hist);
+  TEE_Free(t->streams);
+  return res;
+}
+
+/*
+ * Close the test's sockets. With results, a server daemon's report is
+ * awaited first, while the data sockets are still open, so that a
+ * sender on the server side is not cut off before it reports.
+ */
+static void test_close(struct test *t, struct iptz_results *results)
+{
+  uint64_t start;
+  uint32_t i;
+
+  start = clock_now(&clk);
+  if ((results != NULL) && t->args.control) {
+    results->reported = ctrl_report(t->ctrlCtx, &results->server) == TEE_SUCCESS;
+    results->report_ns = clock_now(&clk) - start;
+    start = clock_now(&clk);
+  }
+  for (i = 0; i < t->nstreams; i++)
+    t->socket->close(t->streams[i].ctx);
+  if (t->args.control)
+    TEE_tcpSocket->close(t->ctrlCtx);
+  if (results != NULL)
+    results->close_ns = clock_now(&clk) - start;
+  TEE_Free(t->hist);
+  TEE_Free(t->streams);
+}
+
+/* Start the clock, a UDP receiver first announces every stream */
+static void test_start(struct test *t, struct iptz_results *results)
+{
+  struct iptz_args *args = &t->args;
+  uint32_t buflen;
+  uint32_t i;
+
+  init_results(results, t->nstreams);
+  results->buffer_setup_ns = t->setup_ns;
+  results->buffer_fill_ns = t->fill_ns;
+  results->buffer_reused = t->reused;
+  results->connect_ns = t->connect_ns;
+  init_sampler(&t->sampler, args,
+	       args->reverse && (args->protocol == IPERFTZ_UDP) ? t : NULL);
 
   /* Send some datagrams first to "synchronize" with the server */
-  if (args->protocol == IPERFTZ_UDP) {
-    buflen = args->blksize < 1024 ? args->blksize : 1024;
-    socket->send(socketCtx, buffer, &buflen, 0);
+  if (args->reverse && (args->protocol == IPERFTZ_UDP)) {
+    for (i = 0; i < t->nstreams; i++) {
+      buflen = args->blksize < 1024 ? args->blksize : 1024;
+      t->socket->send(t->streams[i].ctx, t->buffer, &buflen, 0);
+    }
   }
-  
-  TEE_GetSystemTime(&ta);
+
+  t->next = 0;
+  t->block = 0;
+  t->verify_ns = 0;
+  t->start = clock_now(&clk);
+  t->last = t->start;
+  pacer_init(&t->pacer, args->reverse ? 0 : args->bitrate,
+	     pacer_burst(args->bitrate, args->burst, args->blksize, PACER_GRANULARITY_NS),
+	     t->start);
+}
+
+/* Add a block that took from ti to to to the results */
+static void account(struct iptz_results *results,
+		    uint32_t stream,
+		    uint32_t bytes,
+		    uint64_t ti,
+		    uint64_t to)
+{
+  results->worlds_ns += to - ti;
+  results->worlds_sec = results->worlds_ns / 1000000000ULL;
+  results->worlds_msec = results->worlds_ns / 1000000 % 1000;
+  if (to - ti < 1000000)
+    results->zcycles++;
+    
+  results->cycles++;
+  results->bytes_transmitted += bytes;
+
+  results->stream[stream].bytes += bytes;
+  results->stream[stream].cycles++;
+  results->stream[stream].worlds_ns += to - ti;
+}
+
+static void runtime(struct iptz_results *results, uint64_t ta, uint64_t to)
+{
+  results->runtime_ns = to - ta;
+  results->runtime_sec = results->runtime_ns / 1000000000ULL;
+  results->runtime_msec = results->runtime_ns / 1000000 % 1000;
+}
+
+/* Receive a block from the next stream */
+static TEE_Result recv_block(struct test *t,
+			     struct iptz_results *results,
+			     struct telemetry *tel)
+{
+  TEE_Result res;
+  struct iptz_args *args = &t->args;
+  struct stream *s = &t->streams[t->next];
+  char *data = test_data(t);
+  uint32_t buflen;
+  uint32_t bytes = 0;
+  uint32_t timeout = args->protocol == IPERFTZ_UDP ? UDP_DRAIN_MSEC : 0;
+  uint64_t ti, tv, to;
+
+  ti = clock_now(&clk);
   do {
-    uint32_t bytes = 0;
+    buflen = args->blksize - bytes;
+    res = t->socket->recv(s->ctx, data + bytes, &buflen, timeout);
+    if (args->protocol == IPERFTZ_UDP) {
+      tv = clock_now(&clk);
+      if (buflen > 0)
+	t->last = tv;
+      udp_track(&s->udp, data + bytes, buflen, tv);
+      if (args->verify && (buflen > 0)) {
+	verify_datagram(&s->verify, data + bytes, buflen);
+	t->verify_ns += clock_now(&clk) - tv;
+      }
+    }
+    bytes += buflen;
+  } while ((bytes < args->blksize) && (res == TEE_SUCCESS));
+  /*
+   * Lost datagrams never make up the bytes to transmit, the test ends
+   * with the last one once the sender went quiet
+   */
+  if ((args->protocol == IPERFTZ_UDP) && (res == TEE_ISOCKET_ERROR_TIMEOUT)) {
+    results->drained = 1;
+    if (bytes > 0)
+      account(results, t->next, bytes, ti, t->last);
+    runtime(results, t->start, t->last);
+    return TEE_SUCCESS;
+  }
+  if (args->verify && (args->protocol == IPERFTZ_TCP)) {
+    tv = clock_now(&clk);
+    verify_stream(&s->verify, data, bytes);
+    t->verify_ns += clock_now(&clk) - tv;
+  }
+  if ((t->payload != NULL) && (data == t->buffer))
+    TEE_MemMove(t->payload + t->block * args->blksize, data, bytes);
+  to = clock_now(&clk);
+  if (res != TEE_SUCCESS)
+    tel->errors++;
+  hist_record(t->hist, to - ti);
+  account(results, t->next, bytes, ti, to);
+  runtime(results, t->start, to);
+  sample(&t->sampler, args, results, 0);
+  publish(tel, results, t->sampler.udp, 0);
+  test_advance(t);
+
+  return res;
+}
 
-    TEE_GetSystemTime(&ti);
+/*
+ * Send a block on the next stream, or sleep until the pacer admits one.
+ * Only a sent block counts as a cycle.
+ */
+static TEE_Result send_block(struct test *t,
+			     struct iptz_results *results,
+			     struct telemetry *tel)
+{
+  TEE_Result res;
+  struct iptz_args *args = &t->args;
+  struct stream *s = &t->streams[t->next];
+  char *data = test_data(t);
+  uint32_t buflen;
+  uint32_t bytes;
+  uint64_t ti, to;
+  uint64_t delay;
+
+  ti = clock_now(&clk);
+  delay = pacer_delay(&t->pacer, args->blksize, ti);
+  if (delay > 0) {
+    /* Sleep until the bucket holds a block, the burst absorbs oversleeping */
+    delay = (delay + 999999) / 1000000;
+    res = TEE_Wait(delay);
+    pacer_slept(&t->pacer, delay * 1000000);
+    to = clock_now(&clk);
+  } else {
+    if ((t->payload != NULL) && (data == t->buffer))
+      TEE_MemMove(data, t->payload + t->block * args->blksize, args->blksize);
+    if ((args->protocol == IPERFTZ_UDP) && (args->blksize >= UDP_HDR_LEN))
+      udp_stamp(data, s->seq++, ti);
+    bytes = 0;
     do {
       buflen = args->blksize - bytes;
-      res = socket->recv(socketCtx, buffer + bytes, &buflen, 0);
+      res = t->socket->send(s->ctx, data + bytes, &buflen, TEE_TIMEOUT_INFINITE);
       bytes += buflen;
     } while ((bytes < args->blksize) && (res == TEE_SUCCESS));
-    TEE_GetSystemTime(&to);
-    
-    diff = to.millis - ti.millis;
-    if (diff > to.millis) {
-      results->worlds_sec += to.seconds - ti.seconds - 1;
-      results->worlds_msec += to.millis + (0xffffffff - diff);
-    } else {
-      uint32_t seconds;
-      seconds = to.seconds - ti.seconds;
-      results->worlds_sec += seconds;
-      results->worlds_msec += diff;
-      if ((seconds == 0) && (diff == 0))
-	results->zcycles++;
-    }
+    to = clock_now(&clk);
+    if (res != TEE_SUCCESS)
+      tel->errors++;
+    pacer_consume(&t->pacer, bytes);
+    hist_record(t->hist, to - ti);
+    account(results, t->next, bytes, ti, to);
+    test_advance(t);
+  }
 
-    while (results->worlds_msec >= 1000) {
-      results->worlds_sec++;
-      results->worlds_msec -= 1000;
-    }
-    
-    results->cycles++;
-    results->bytes_transmitted += bytes;
-
-    diff = to.millis - ta.millis;
-    if (diff > to.millis) {
-      results->runtime_sec = to.seconds - ta.seconds - 1;
-      results->runtime_msec = to.millis + (0xffffffff - diff);
-    } else {
-      results->runtime_sec = to.seconds - ta.seconds;
-      results->runtime_msec = diff;
-    }
-  } while (((args->transmit_bytes == 0) && (results->runtime_sec < 10)) ||
-	   (((args->transmit_bytes > 0) && (results->bytes_transmitted < args->transmit_bytes)) &&
-	    (res == TEE_SUCCESS)));
+  runtime(results, t->start, to);
+  sample(&t->sampler, args, results, 0);
+  publish(tel, results, NULL, 0);
+
+  return res;
+}
+
+static TEE_Result test_block(struct test *t,
+			     struct iptz_results *results,
+			     struct telemetry *tel)
+{
+  if (t->args.reverse)
+    return recv_block(t, results, tel);
+  return send_block(t, results, tel);
+}
+
+/* Summaries of the counters so far */
+static void test_summary(struct test *t, struct iptz_results *results)
+{
+  uint32_t i;
+
+  results->verify_blocks = 0;
+  results->verify_errors = 0;
+  for (i = 0; i < t->nstreams; i++) {
+    results->verify_blocks += t->streams[i].verify.blocks;
+    results->verify_errors += t->streams[i].verify.errors;
+  }
+  results->verify_ns = t->verify_ns;
+  hist_summary(t->hist, &results->latency);
+  if (t->sampler.udp != NULL)
+    summarize_loss(results, t);
+  results->pacer_waits = t->pacer.waits;
+  results->pacer_wait_msec = t->pacer.wait_ns / 1000000;
+}
+
+static void test_finish(struct test *t,
+			struct iptz_results *results,
+			struct telemetry *tel)
+{
+  sample(&t->sampler, &t->args, results, 1);
+  publish(tel, results, t->sampler.udp, 1);
+  test_summary(t, results);
+}
+
+/*
+ * Run a whole test within one invocation, until the bytes to transmit
+ * went through or, without them, for 10 seconds.
+ */
+static TEE_Result iperfTZ_test(struct session *sess,
+			       uint32_t reverse,
+			       uint32_t param_types,
+			       TEE_Param params[4])
+{
+  TEE_Result res;
+  struct iptz_args *args;
+  struct iptz_results *results;
+  struct telemetry tel;
+  struct test t;
+  uint64_t entry = clock_now(&clk);
+
+  res = check_params(param_types, params, &tel);
+  if (res != TEE_SUCCESS)
+    return res;
+
+  if (sess->open)
+    return TEE_ERROR_BAD_STATE;
 
-  socket->close(socketCtx);
+  args = (struct iptz_args *)params[0].memref.buffer;
+  results = (struct iptz_results *)params[1].memref.buffer;
 
+  res = test_open(&t, &sess->pool, args, reverse);
   if (res != TEE_SUCCESS)
-    EMSG("recv() failed for socket. Return code: %#0" PRIX32, res);
+    return res;
+  res = test_payload(&t, TEE_PARAM_TYPE_GET(param_types, 3), &params[3]);
+  if (res != TEE_SUCCESS) {
+    test_close(&t, NULL);
+    return res;
+  }
+
+  /* Blocks go through the streams in turn, the pacer limits them all */
+  test_start(&t, results);
+  do {
+    res = test_block(&t, results, &tel);
+  } while (!stopped(&tel) && !results->drained &&
+	   (((args->transmit_bytes == 0) && (results->runtime_sec < 10)) ||
+	    (((args->transmit_bytes > 0) && (results->bytes_transmitted < args->transmit_bytes)) &&
+	     (res == TEE_SUCCESS))));
+
+  test_finish(&t, results, &tel);
+  test_close(&t, results);
+  results->invoke_ns = clock_now(&clk) - entry;
+
+  if (res != TEE_SUCCESS)
+    EMSG("%s() failed for socket. Return code: %#0" PRIX32, reverse ? "recv" : "send", res);
 
   return res;
 }
 
-static TEE_Result iperfTZ_send(uint32_t param_types, TEE_Param params[4])
+/* Open the session's test, blocks follow with IPERFTZ_TA_TRANSFER */
+static TEE_Result iperfTZ_open(struct session *sess,
+			       uint32_t param_types,
+			       TEE_Param params[4])
 {
-  TEE_iSocket *socket = NULL;
-  TEE_iSocketHandle socketCtx;
   TEE_Result res;
-  TEE_tcpSocket_Setup tcpSetup;
-  TEE_udpSocket_Setup udpSetup;
-  TEE_Time ta, ti, to;
-  char *buffer;
-  uint32_t buflen;
   struct iptz_args *args;
-  struct iptz_results *results;
+  uint64_t entry = clock_now(&clk);
   uint32_t exp_param_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
-					     TEE_PARAM_TYPE_MEMREF_OUTPUT,
+					     TEE_PARAM_TYPE_NONE,
 					     TEE_PARAM_TYPE_NONE,
 					     TEE_PARAM_TYPE_NONE);
-  if (param_types != exp_param_types)
+  if ((param_types != exp_param_types) ||
+      (params[0].memref.size < sizeof(struct iptz_args)))
     return TEE_ERROR_BAD_PARAMETERS;
+  if (sess->open)
+    return TEE_ERROR_BAD_STATE;
 
   args = (struct iptz_args *)params[0].memref.buffer;
-  results = (struct iptz_results *)params[1].memref.buffer;
+  res = test_open(&sess->t, &sess->pool, args, args->reverse);
+  if (res != TEE_SUCCESS)
+    return res;
+  test_start(&sess->t, &sess->results);
+  sess->returned = clock_now(&clk);
+  sess->results.invoke_ns = sess->returned - entry;
+  sess->open = 1;
 
-  buffer = init_buffer(args);
-  if (buffer == NULL)
-    return TEE_ERROR_OUT_OF_MEMORY;
+  return TEE_SUCCESS;
+}
 
-  if (args->protocol == IPERFTZ_TCP) {
-    socket = TEE_tcpSocket;
-    res = tcp_connect(&tcpSetup, &socketCtx, args, TEE_TCP_SET_SENDBUF);
-  } else {
-    socket = TEE_udpSocket;
-    res = udp_connect(&udpSetup, &socketCtx, args);
-  }
+/*
+ * Transfer as many blocks as the first parameter's a asks for, with the
+ * payload in the third one if any, and return the results since the test
+ * was opened.
+ */
+static TEE_Result iperfTZ_transfer(struct session *sess,
+				   uint32_t param_types,
+				   TEE_Param params[4])
+{
+  TEE_Result res = TEE_SUCCESS;
+  struct telemetry tel;
+  uint32_t cycles;
+  uint64_t entry = clock_now(&clk);
+  uint32_t payload_type = TEE_PARAM_TYPE_GET(param_types, 2);
+  uint32_t exp_param_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT,
+					     TEE_PARAM_TYPE_MEMREF_OUTPUT,
+					     payload_type,
+					     TEE_PARAM_TYPE_NONE);
+  if ((param_types != exp_param_types) ||
+      ((payload_type != TEE_PARAM_TYPE_NONE) && (payload_type != TEE_PARAM_TYPE_MEMREF_INOUT)) ||
+      (params[1].memref.size < sizeof(struct iptz_results)))
+    return TEE_ERROR_BAD_PARAMETERS;
+  if (!sess->open)
+    return TEE_ERROR_BAD_STATE;
+  res = test_payload(&sess->t, payload_type, &params[2]);
   if (res != TEE_SUCCESS)
     return res;
-  
-  init_results(results);
 
-  TEE_GetSystemTime(&ta);
-  do {
-    uint32_t bytes;
-    uint32_t diff;
-
-    if ((args->bitrate == 0U) || (args->bitrate > ((results->bytes_transmitted + args->blksize) * 8 / (results->runtime_sec * 1000 + results->runtime_msec) * 1000))) {
-      TEE_GetSystemTime(&ti);
-      bytes = 0;
-      do {
-	buflen = args->blksize - bytes;
-	res = socket->send(socketCtx, buffer + bytes, &buflen, TEE_TIMEOUT_INFINITE);
-	bytes += buflen;
-      } while ((bytes < args->blksize) && (res == TEE_SUCCESS));
-      TEE_GetSystemTime(&to);
-        
-      diff = to.millis - ti.millis;
-      if (diff > to.millis) {
-	results->worlds_sec += to.seconds - ti.seconds - 1;
-	results->worlds_msec += to.millis + (0xffffffff - diff);
-      } else {
-	uint32_t seconds;
-	seconds = to.seconds - ti.seconds;
-	results->worlds_sec += seconds;
-	results->worlds_msec += diff;
-	if ((seconds == 0) && (diff == 0))
-	  results->zcycles++;
-      }
+  sess->results.returned_ns += entry - sess->returned;
+  tel.ring = NULL;
+  tel.errors = 0;
+  /* The last transfer ends early with the bytes to transmit */
+  cycles = sess->results.cycles + params[0].value.a;
+  while ((sess->results.cycles < cycles) && (res == TEE_SUCCESS) &&
+	 !sess->results.drained &&
+	 ((sess->t.args.transmit_bytes == 0) ||
+	  (sess->results.bytes_transmitted < sess->t.args.transmit_bytes)))
+    res = test_block(&sess->t, &sess->results, &tel);
 
-      while (results->worlds_msec >= 1000) {
-	results->worlds_sec++;
-	results->worlds_msec -= 1000;
-      }
-    
-      results->cycles++;
-      results->bytes_transmitted += bytes;
-    } else {
-      TEE_GetSystemTime(&to);
-    }
+  sess->t.payload = NULL;
+  test_summary(&sess->t, &sess->results);
+  sess->returned = clock_now(&clk);
+  sess->results.invoke_ns += sess->returned - entry;
+  TEE_MemMove(params[1].memref.buffer, &sess->results, sizeof(sess->results));
+  if (res != TEE_SUCCESS)
+    EMSG("%s() failed for socket. Return code: %#0" PRIX32, sess->t.args.reverse ? "recv" : "send", res);
 
-    diff = to.millis - ta.millis;
-    if (diff > to.millis) {
-      results->runtime_sec = to.seconds - ta.seconds - 1;
-      results->runtime_msec = to.millis + (0xffffffff - diff);
-    } else {
-      results->runtime_sec = to.seconds - ta.seconds;
-      results->runtime_msec = diff;
-    }
-  } while (((args->transmit_bytes == 0) && (results->runtime_sec < 10)) ||
-	   (((args->transmit_bytes > 0) && (results->bytes_transmitted < args->transmit_bytes)) &&
-	    (res == TEE_SUCCESS)));
+  return res;
+}
 
-  socket->close(socketCtx);
+/* Close the session's test, optionally returning its final results */
+static TEE_Result iperfTZ_close(struct session *sess,
+				uint32_t param_types,
+				TEE_Param params[4])
+{
+  struct telemetry tel;
+  uint64_t entry = clock_now(&clk);
+  uint32_t exp_param_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_OUTPUT,
+					     TEE_PARAM_TYPE_NONE,
+					     TEE_PARAM_TYPE_NONE,
+					     TEE_PARAM_TYPE_NONE);
+  if ((param_types != exp_param_types) &&
+      (param_types != TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE, TEE_PARAM_TYPE_NONE,
+				      TEE_PARAM_TYPE_NONE, TEE_PARAM_TYPE_NONE)))
+    return TEE_ERROR_BAD_PARAMETERS;
+  if ((param_types == exp_param_types) &&
+      (params[0].memref.size < sizeof(struct iptz_results)))
+    return TEE_ERROR_BAD_PARAMETERS;
+  if (!sess->open)
+    return TEE_ERROR_BAD_STATE;
 
-  if (res != TEE_SUCCESS)
-    EMSG("send() failed for socket. Return code: %#0" PRIX32, res);
+  tel.ring = NULL;
+  tel.errors = 0;
+  test_finish(&sess->t, &sess->results, &tel);
+  test_close(&sess->t, &sess->results);
+  sess->results.invoke_ns += clock_now(&clk) - entry;
+  sess->open = 0;
+  if (param_types == exp_param_types)
+    TEE_MemMove(params[0].memref.buffer, &sess->results, sizeof(sess->results));
 
-  return res;
+  return TEE_SUCCESS;
+}
+
+static TEE_Result iperfTZ_null(uint32_t param_types)
+{
+  uint32_t exp_param_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
+					     TEE_PARAM_TYPE_NONE,
+					     TEE_PARAM_TYPE_NONE,
+					     TEE_PARAM_TYPE_NONE);
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  return TEE_SUCCESS;
+}
+
+/*
+ * Copy the first memref into the second, which with the null command
+ * gives the cost of passing parameters of a given size and kind.
+ */
+static TEE_Result iperfTZ_echo(uint32_t param_types, TEE_Param params[4])
+{
+  uint32_t exp_param_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+					     TEE_PARAM_TYPE_MEMREF_OUTPUT,
+					     TEE_PARAM_TYPE_NONE,
+					     TEE_PARAM_TYPE_NONE);
+  if ((param_types != exp_param_types) ||
+      (params[1].memref.size < params[0].memref.size))
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  TEE_MemMove(params[1].memref.buffer, params[0].memref.buffer, params[0].memref.size);
+  params[1].memref.size = params[0].memref.size;
+
+  return TEE_SUCCESS;
 }
 
 /*
@@ -305,6 +1055,8 @@ TEE_Result TA_CreateEntryPoint(void)
 {
 	DMSG("has been called");
 
+	clock_init(&clk);
+
 	return TEE_SUCCESS;
 }
 
@@ -339,7 +1091,11 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
 
 	/* Unused parameters */
 	(void)&params;
-	(void)&sess_ctx;
+
+	/* Room for a test kept open across invocations */
+	*sess_ctx = TEE_Malloc(sizeof(struct session), TEE_MALLOC_FILL_ZERO);
+	if (*sess_ctx == NULL)
+		return TEE_ERROR_OUT_OF_MEMORY;
 
 	/* If return value != TEE_SUCCESS the session will not be created. */
 	return TEE_SUCCESS;
@@ -351,8 +1107,14 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
  */
 void TA_CloseSessionEntryPoint(void __maybe_unused *sess_ctx)
 {
-	(void)&sess_ctx; /* Unused parameter */
+	struct session *sess = (struct session *)sess_ctx;
+
 	DMSG("has been called");
+
+	if (sess->open)
+		test_close(&sess->t, NULL);
+	pool_free(&sess->pool);
+	TEE_Free(sess);
 }
 
 /*
@@ -364,13 +1126,23 @@ TEE_Result TA_InvokeCommandEntryPoint(void __maybe_unused *sess_ctx,
 			uint32_t cmd_id,
 			uint32_t param_types, TEE_Param params[4])
 {
-	(void)&sess_ctx; /* Unused parameter */
+	struct session *sess = (struct session *)sess_ctx;
 
 	switch (cmd_id) {
 	case IPERFTZ_TA_RECV:
-	  return iperfTZ_recv(param_types, params);
+	  return iperfTZ_test(sess, 1, param_types, params);
 	case IPERFTZ_TA_SEND:
-	  return iperfTZ_send(param_types, params);
+	  return iperfTZ_test(sess, 0, param_types, params);
+	case IPERFTZ_TA_OPEN:
+	  return iperfTZ_open(sess, param_types, params);
+	case IPERFTZ_TA_TRANSFER:
+	  return iperfTZ_transfer(sess, param_types, params);
+	case IPERFTZ_TA_CLOSE:
+	  return iperfTZ_close(sess, param_types, params);
+	case IPERFTZ_TA_NULL:
+	  return iperfTZ_null(param_types);
+	case IPERFTZ_TA_ECHO:
+	  return iperfTZ_echo(param_types, params);
 	default:
 		return TEE_ERROR_BAD_PARAMETERS;
 	}